@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "nrf_drv_twi.h"
 #include "sdk_errors.h"
 #include "app_util_platform.h"
@@ -112,7 +114,7 @@ ret_code_t tripoint_get_info (uint16_t* id, uint8_t* version) {
 }
 
 ret_code_t tripoint_start_ranging (bool periodic, uint8_t rate) {
-	uint8_t buf_cmd[4];
+	uint8_t buf_cmd[5];
 	ret_code_t ret;
 
 	buf_cmd[0] = TRIPOINT_CMD_CONFIG;
@@ -134,7 +136,10 @@ ret_code_t tripoint_start_ranging (bool periodic, uint8_t rate) {
 	// And rate
 	buf_cmd[3] = rate;
 
-	ret = nrf_drv_twi_tx(&twi_instance, TRIPOINT_ADDRESS, buf_cmd, 4, false);
+	// And ranging profile
+	buf_cmd[4] = TRIPOINT_PROFILE;
+
+	ret = nrf_drv_twi_tx(&twi_instance, TRIPOINT_ADDRESS, buf_cmd, 5, false);
 	if (ret != NRF_SUCCESS) return ret;
 
 	return NRF_SUCCESS;
@@ -153,18 +158,10 @@ ret_code_t tripoint_start_anchor (bool is_glossy_master) {
 	else
 		buf_cmd[1] = 0x01;
 
-	// // TAG options
-	// buf_cmd[2] = 0;
-	// if (periodic) {
-	// 	// leave 0
-	// } else {
-	// 	buf_cmd[2] |= 0x2;
-	// }
+	// Ranging profile
+	buf_cmd[2] = TRIPOINT_PROFILE;
 
-	// // And rate
-	// buf_cmd[3] = rate;
-
-	ret = nrf_drv_twi_tx(&twi_instance, TRIPOINT_ADDRESS, buf_cmd, 2, false);
+	ret = nrf_drv_twi_tx(&twi_instance, TRIPOINT_ADDRESS, buf_cmd, 3, false);
 	if (ret != NRF_SUCCESS) return ret;
 
 	return NRF_SUCCESS;
@@ -231,6 +228,21 @@ ret_code_t tripoint_resume () {
 	return NRF_SUCCESS;
 }
 
+// Tell the TriPoint where an anchor is so that it can calculate its own
+// location. The EUI is in the same byte order as the TriPoint reports it
+// with ranges.
+ret_code_t tripoint_set_anchor_location (uint8_t* anchor_eui, int32_t x_mm, int32_t y_mm, int32_t z_mm) {
+	uint8_t buf_cmd[21];
+	ret_code_t ret;
 
+	buf_cmd[0] = TRIPOINT_CMD_SET_LOCATION;
+	memcpy(buf_cmd+1, anchor_eui, 8);
+	memcpy(buf_cmd+9, &x_mm, 4);
+	memcpy(buf_cmd+13, &y_mm, 4);
+	memcpy(buf_cmd+17, &z_mm, 4);
 
+	ret = nrf_drv_twi_tx(&twi_instance, TRIPOINT_ADDRESS, buf_cmd, 21, false);
+	if (ret != NRF_SUCCESS) return ret;
 
+	return NRF_SUCCESS;
+}
@@ -17,6 +17,14 @@
 #define TRIPOINT_CMD_SET_LOCATION     0x07
 #define TRIPOINT_CMD_READ_CALIBRATION 0x08
 
+// Ranging profiles. Every tag and anchor must use the same one.
+#define TRIPOINT_PROFILE_FAST 0
+#define TRIPOINT_PROFILE_LONG 1
+
+#ifndef TRIPOINT_PROFILE
+#define TRIPOINT_PROFILE TRIPOINT_PROFILE_FAST
+#endif
+
 
 typedef void (*tripoint_interface_data_cb_f)(uint8_t* data, uint32_t len);
 
@@ -30,5 +38,6 @@ ret_code_t tripoint_start_calibration (uint8_t index);
 ret_code_t tripoint_get_calibration (uint8_t* calib_buf);
 ret_code_t tripoint_sleep ();
 ret_code_t tripoint_resume ();
+ret_code_t tripoint_set_anchor_location (uint8_t* anchor_eui, int32_t x_mm, int32_t y_mm, int32_t z_mm);
 
 #endif
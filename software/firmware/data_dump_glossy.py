@@ -28,6 +28,7 @@ import binascii
 import datetime
 import pprint
 import random
+import heapq
 import requests
 import struct
 import sys
@@ -55,6 +56,8 @@ parser.add_argument('-n', '--no-iter', action='store_true')
 parser.add_argument('-e', '--exact', default=None, type=int)
 parser.add_argument('-d', '--dump-full', action='store_true')
 parser.add_argument('-v', '--diversity', default=None)
+parser.add_argument('-p', '--profile', action='store_true',
+		help="Print range calculation timing from firmware built with PROFILE_RANGING")
 parser.add_argument('--gdp', action='store_true')
 parser.add_argument('--gdp-rest', action='store_true')
 parser.add_argument('--gdp-rest-url', default='http://localhost:8080')
@@ -376,12 +379,14 @@ def useful_read(length):
 HEADER      = (0x80018001).to_bytes(4, 'big')
 DATA_HEADER = (0x8080).to_bytes(2, 'big')
 FOOTER      = (0x80FE).to_bytes(2, 'big')
+PROFILE_HEADER = (0x80018002).to_bytes(4, 'big')
 DWT_TIME_UNITS = 1/499.2e6/128;
 SPEED_OF_LIGHT = 2.99792458e8;
 AIR_N = 1.0003;
 good = 0
 bad = 0
 NUM_RANGING_CHANNELS = 3
+NUM_ANTENNAS = 3
 NUM_RANGING_BROADCASTS = 30
 EUI_LEN = 8
 data_section_length = 8*NUM_RANGING_CHANNELS + 8+1+1+8+8+30*8
@@ -409,9 +414,23 @@ def oneway_get_ss_index_from_settings(anchor_antenna_index, window_num):
 	ret = antenna_and_channel_to_subsequence_number(tag_antenna_index, anchor_antenna_index, channel_index)
 	return ret
 
+def read_profile():
+	# Matches send_profile() in oneway_tag.c. All times are in microseconds.
+	num_anchors, calc_us, last_calc_us, track_us, report_us = struct.unpack("<BIIII", useful_read(17))
+	if useful_read(len(FOOTER)) != FOOTER:
+		log.warn("Bad profile footer")
+		return
+	per_anchor_us = calc_us / num_anchors if num_anchors else 0
+	print("PROFILE anchors {} calculate {} us ({:.0f} us/anchor) last window {} us track {} us report {} us".format(
+		num_anchors, calc_us, per_anchor_us, last_calc_us, track_us, report_us))
+
 def find_header():
 	b = useful_read(len(HEADER))
 	while b != HEADER:
+		if args.profile and b == PROFILE_HEADER:
+			read_profile()
+			b = useful_read(len(HEADER))
+			continue
 		b = b[1:len(HEADER)] + useful_read(1)
 
 def dwtime_to_millimeters(dwtime):
@@ -419,6 +438,59 @@ def dwtime_to_millimeters(dwtime):
 	ret = ret * 1000;
 	return ret
 
+RANGE_PERCENTILE_NUMERATOR = 1
+RANGE_PERCENTILE_DENOMENATOR = 10
+
+def range_percentile(values):
+	# Same percentile as oneway_range_percentile() on the tag, which is not
+	# quite what np.percentile() interpolates. Only the two values around
+	# the percentile are needed, so no need to sort everything.
+	count = len(values)
+	if count == 0:
+		return float('nan')
+	bot = min((count*RANGE_PERCENTILE_NUMERATOR) // RANGE_PERCENTILE_DENOMENATOR, count-1)
+	top = bot+1
+	smallest = heapq.nsmallest(top+1, values)
+	if top >= count:
+		return smallest[bot]
+	return smallest[bot] + (smallest[top]-smallest[bot]) * \
+		((RANGE_PERCENTILE_NUMERATOR*count) - (bot*RANGE_PERCENTILE_DENOMENATOR)) / RANGE_PERCENTILE_DENOMENATOR
+
+ONEWAY_RANGE_AGREEMENT_MM = 200
+ONEWAY_RANGE_MIN_AGREEING_POLLS = 4
+
+def subsequence_number_to_configuration(subseq_num):
+	tag_antenna_index = (subseq_num // NUM_RANGING_CHANNELS // NUM_RANGING_CHANNELS) % NUM_ANTENNAS
+	anchor_antenna_index = (subseq_num // NUM_RANGING_CHANNELS) % NUM_ANTENNAS
+	channel_index = subseq_num % NUM_RANGING_CHANNELS
+	return (((tag_antenna_index * NUM_ANTENNAS) + anchor_antenna_index) * NUM_RANGING_CHANNELS) + channel_index
+
+def diversity_range(distances):
+	# Same as oneway_range_diversity_estimate() on the tag. distances maps
+	# subsequence number to distance. Each configuration's distances are
+	# replaced by their median, and the medians that fewer than
+	# ONEWAY_RANGE_MIN_AGREEING_POLLS distances agree with are dropped
+	# (unless that is all of them) before taking the percentile.
+	groups = {}
+	for ss, d in distances.items():
+		groups.setdefault(subsequence_number_to_configuration(ss), []).append(d)
+	medians = []
+	for group in groups.values():
+		group.sort()
+		mid = len(group) // 2
+		if len(group) % 2:
+			m = group[mid]
+		else:
+			m = group[mid-1] + (group[mid]-group[mid-1])/2
+		agreeing = sum(1 for d in distances.values() if abs(d - m) <= ONEWAY_RANGE_AGREEMENT_MM)
+		medians.append((m, len(group), agreeing >= ONEWAY_RANGE_MIN_AGREEING_POLLS))
+	if any(agreed for _, _, agreed in medians):
+		medians = [median for median in medians if median[2]]
+	values = []
+	for m, count, _ in medians:
+		values.extend([m] * count)
+	return range_percentile(values), len(groups)
+
 #if args.textfiles:
 #	tsfile  = open(args.outfile + '.timestamps', 'w')
 #	datfile = open(args.outfile + '.data', 'w')
@@ -550,6 +622,7 @@ try:
 		
 				# Declare an array for sorting ranges
 				distance_millimeters = []
+				distance_by_subsequence = {}
 				d_mm_all = []
 				for jj in range(NUM_RANGING_BROADCASTS):
 					broadcast_send_time = ranging_broadcast_ss_send_times[jj]
@@ -567,6 +640,7 @@ try:
 					mm = dwtime_to_millimeters(TOF)
 					mm -= 121.591
 					distance_millimeters.append(mm)
+					distance_by_subsequence[jj] = mm
 					d_mm_all.append(mm)
 
 					if args.dump_full:
@@ -588,11 +662,12 @@ try:
 							nodiversity_drop_count += 1
 							print("Dropping, cnt", nodiversity_drop_count)
 							continue
-						range_mm = np.percentile(d,10)
+						range_mm = range_percentile(d)
 					else:
 						range_mm = d_mm_all[int(args.diversity)]
 				else:
-					range_mm = np.percentile(distance_millimeters,10)
+					range_mm, num_configurations = diversity_range(distance_by_subsequence)
+					log.debug('Anchor {} range from {} configurations'.format(anchor_eui, num_configurations))
 
 
 				if range_mm < 0 or range_mm > (1000*30):
@@ -43,6 +43,34 @@ const uint32_t txPower[DW1000_NUM_CHANNELS] = {
 	0x5171B1D1UL
 };
 
+// Settings for each dw1000_profile_e
+static const dw1000_profile_t _profiles[DW1000_NUM_PROFILES] = {
+	[DW1000_PROFILE_FAST] = {
+		.preamble_length             = DWT_PLEN_64,
+		.pac_size                    = DWT_PAC8,
+		.data_rate                   = DWT_BR_6M8,
+		.smart_power_en              = 1,
+		.sfd_timeout                 = (64+8+1),
+		.broadcasts_period_us        = 1000,
+		.listening_window_us         = 8000,
+		.listening_window_padding_us = 900,
+		.tag_pipeline_depth          = 2,
+		.tag_pipeline_phase_us       = 450,
+	},
+	[DW1000_PROFILE_LONG] = {
+		.preamble_length             = DWT_PLEN_4096,
+		.pac_size                    = DWT_PAC64,
+		.data_rate                   = DWT_BR_110K,
+		.smart_power_en              = 0,
+		.sfd_timeout                 = (4096+64+1),
+		.broadcasts_period_us        = 10000,
+		.listening_window_us         = 50000,
+		.listening_window_padding_us = 1800,
+		.tag_pipeline_depth          = 1,
+		.tag_pipeline_phase_us       = 0,
+	},
+};
+
 /******************************************************************************/
 // Data structures used in multiple functions
 /******************************************************************************/
@@ -56,6 +84,9 @@ static SPI_InitTypeDef SPI_InitStructure;
 static dwt_config_t _dw1000_config;
 static dwt_txconfig_t global_tx_config;
 
+// Which of the profiles above we are using
+static const dw1000_profile_t* _profile = &_profiles[DW1000_DEFAULT_PROFILE];
+
 // Calibration values and other things programmed in with flash
 static dw1000_programmed_values_t _prog_values;
 
@@ -590,14 +621,18 @@ void dw1000_read_eui (uint8_t *eui_buf) {
 // in DW1000 time format.
 uint64_t dw1000_get_tx_delay (uint8_t channel_index) {
 	// Make sure that antenna and channel are 0<=index<3
-	channel_index = channel_index % 3;
+	if (channel_index >= 3) {
+		channel_index = 0;
+	}
 
 	return (uint64_t) _prog_values.calibration_values[channel_index*2+1];
 }
 
 uint64_t dw1000_get_rx_delay (uint8_t channel_index) {
 	// Make sure that antenna and channel are 0<=index<3
-	channel_index = channel_index % 3;
+	if (channel_index >= 3) {
+		channel_index = 0;
+	}
 
 	return (uint64_t) _prog_values.calibration_values[channel_index*2];
 }
@@ -751,15 +786,15 @@ dw1000_err_e dw1000_configure_settings () {
 	// Set the parameters of ranging and channel and whatnot
 	_dw1000_config.chan           = 2;
 	_dw1000_config.prf            = DWT_PRF_64M;
-	_dw1000_config.txPreambLength = DW1000_PREAMBLE_LENGTH;
-	_dw1000_config.rxPAC          = DW1000_PAC_SIZE;
+	_dw1000_config.txPreambLength = _profile->preamble_length;
+	_dw1000_config.rxPAC          = _profile->pac_size;
 	_dw1000_config.txCode         = 9;  // preamble code
 	_dw1000_config.rxCode         = 9;  // preamble code
 	_dw1000_config.nsSFD          = 0;
-	_dw1000_config.dataRate       = DW1000_DATA_RATE;
+	_dw1000_config.dataRate       = _profile->data_rate;
 	_dw1000_config.phrMode        = DWT_PHRMODE_EXT; //Enable extended PHR mode (up to 1024-byte packets)
-	_dw1000_config.smartPowerEn   = DW1000_SMART_PWR_EN;
-	_dw1000_config.sfdTO          = DW1000_SFD_TO;//(1025 + 64 - 32);
+	_dw1000_config.smartPowerEn   = _profile->smart_power_en;
+	_dw1000_config.sfdTO          = _profile->sfd_timeout;//(1025 + 64 - 32);
 #if DW1000_USE_OTP
 	dwt_configure(&_dw1000_config, (DWT_LOADANTDLY | DWT_LOADXTALTRIM));
 #else
@@ -881,6 +916,28 @@ dw1000_err_e dw1000_wakeup () {
 	return DW1000_WAKEUP_SUCCESS;
 }
 
+// Switch to a different ranging profile. The radio settings take effect
+// right away, and the ranging timing from the next ranging event. Unknown
+// profiles are ignored.
+void dw1000_set_profile (dw1000_profile_e profile) {
+	if (profile >= DW1000_NUM_PROFILES) {
+		return;
+	}
+	_profile = &_profiles[profile];
+
+	_dw1000_config.txPreambLength = _profile->preamble_length;
+	_dw1000_config.rxPAC          = _profile->pac_size;
+	_dw1000_config.dataRate       = _profile->data_rate;
+	_dw1000_config.smartPowerEn   = _profile->smart_power_en;
+	_dw1000_config.sfdTO          = _profile->sfd_timeout;
+	dw1000_reset_configuration();
+}
+
+// The ranging profile in use
+const dw1000_profile_t* dw1000_get_profile () {
+	return _profile;
+}
+
 // Call to change the DW1000 channel and force set all of the configs
 // that are needed when changing channels.
 void dw1000_update_channel (uint8_t chan) {
@@ -906,44 +963,10 @@ void dw1000_reset_configuration () {
 }
 
 
-/******************************************************************************/
-// Decawave specific utility functions
-/******************************************************************************/
-
-// Convert a time of flight measurement to millimeters
-int dwtime_to_millimeters (double dwtime) {
-	// Get meters using the speed of light
-	double dist = dwtime * DWT_TIME_UNITS * SPEED_OF_LIGHT;
-
-	// And return millimeters
-	return (int) (dist*1000.0);
-}
-
-
 /******************************************************************************/
 // Misc Utility
 /******************************************************************************/
 
-// Shoved this here for now.
-// Insert an element into a sorted array.
-// end is the number of elements in the array.
-void insert_sorted (int arr[], int new, unsigned end) {
-	unsigned insert_at = 0;
-	while ((insert_at < end) && (new >= arr[insert_at])) {
-		insert_at++;
-	}
-	if (insert_at == end) {
-		arr[insert_at] = new;
-	} else {
-		while (insert_at <= end) {
-			int temp = arr[insert_at];
-			arr[insert_at] = new;
-			new = temp;
-			insert_at++;
-		}
-	}
-}
-
 uint64_t dw1000_readrxtimestamp(){
 	uint64_t cur_dw_timestamp = 0;
 	dwt_readrxtimestamp(&cur_dw_timestamp);
@@ -90,6 +90,10 @@
 
 #define SPEED_OF_LIGHT 299702547.0
 
+// Millimeters traveled in one DW1000 time unit (DWT_TIME_UNITS*SPEED_OF_LIGHT),
+// scaled by 2^24. Lets us convert times to distances without floating point.
+#define DW1000_MM_PER_DWTIME_Q24 78691130
+
 /******************************************************************************/
 // Data structs for 802.15.4 packets
 /******************************************************************************/
@@ -150,6 +154,32 @@ typedef enum {
 } dw1000_err_e;
 
 
+/******************************************************************************/
+// Ranging profiles
+/******************************************************************************/
+
+// Each profile is a set of DW1000 radio settings and the ranging timing
+// that goes with them. Every node in a network has to use the same one.
+typedef enum {
+	DW1000_PROFILE_FAST = 0,  // 6.8 Mbps, for low latency when anchors are close
+	DW1000_PROFILE_LONG = 1,  // 110 Kbps, for range
+	DW1000_NUM_PROFILES
+} dw1000_profile_e;
+
+typedef struct {
+	uint8_t  preamble_length;             // DWT_PLEN_*
+	uint8_t  pac_size;                    // DWT_PAC*
+	uint8_t  data_rate;                   // DWT_BR_*
+	uint8_t  smart_power_en;
+	uint16_t sfd_timeout;
+	uint32_t broadcasts_period_us;        // Time between the tag's polls
+	uint32_t listening_window_us;         // How long each anchor reply window is
+	uint32_t listening_window_padding_us; // Guard time on each side of a window
+	uint8_t  tag_pipeline_depth;          // How many tags can share an LWB ranging slot
+	uint32_t tag_pipeline_phase_us;       // How far apart their polls are
+} dw1000_profile_t;
+
+
 /******************************************************************************/
 // Structs for data stored in the flash
 /******************************************************************************/
@@ -168,7 +198,8 @@ typedef struct {
 
 // Utility
 int  dwtime_to_millimeters (double dwtime);
-void insert_sorted (int arr[], int new, unsigned end);
+int  dwtime_fixed_to_millimeters (int64_t dwtime, uint8_t frac_bits);
+uint32_t isqrt64 (uint64_t x);
 uint16_t dw1000_preamble_time_in_us();
 uint32_t dw1000_packet_data_time_in_us(uint16_t data_len);
 
@@ -177,6 +208,8 @@ dw1000_err_e  dw1000_init ();
 void          dw1000_spi_fast ();
 void          dw1000_spi_slow ();
 dw1000_err_e  dw1000_configure_settings ();
+void          dw1000_set_profile (dw1000_profile_e profile);
+const dw1000_profile_t* dw1000_get_profile ();
 void          dw1000_reset ();
 void          dw1000_choose_antenna (uint8_t antenna_number);
 void          dw1000_read_eui (uint8_t *eui_buf);
@@ -0,0 +1,62 @@
+#include "deca_device_api.h"
+
+#include "dw1000.h"
+
+/******************************************************************************/
+// Decawave specific utility functions
+/******************************************************************************/
+
+// These only do math, so they live apart from the rest of dw1000.c, which
+// needs the radio and the STM32 peripherals. host/ builds them on a PC.
+
+// Convert a time of flight measurement to millimeters
+int dwtime_to_millimeters (double dwtime) {
+	// Get meters using the speed of light
+	double dist = dwtime * DWT_TIME_UNITS * SPEED_OF_LIGHT;
+
+	// And return millimeters
+	return (int) (dist*1000.0);
+}
+
+// Integer version of dwtime_to_millimeters(). dwtime is in DW1000 time units
+// with frac_bits fractional bits. Like the cast above, this truncates
+// towards zero.
+int dwtime_fixed_to_millimeters (int64_t dwtime, uint8_t frac_bits) {
+	bool negative = dwtime < 0;
+	uint64_t magnitude = negative ? -dwtime : dwtime;
+
+	// Keep the multiply inside of 64 bits. Anything this long (over 2^28
+	// time units) is not a distance we care about.
+	if ((magnitude >> frac_bits) >= (((uint64_t) 1) << 28)) {
+		return negative ? INT32_MIN : INT32_MAX;
+	}
+	if (frac_bits > 8) {
+		magnitude >>= frac_bits - 8;
+	} else {
+		magnitude <<= 8 - frac_bits;
+	}
+
+	// magnitude is now in Q8, and the constant is in Q24
+	int millimeters = (int) ((magnitude * DW1000_MM_PER_DWTIME_Q24) >> 32);
+	return negative ? -millimeters : millimeters;
+}
+
+// Integer square root, rounded down.
+uint32_t isqrt64 (uint64_t x) {
+	uint64_t result = 0;
+	uint64_t bit = ((uint64_t) 1) << 62;
+
+	while (bit > x) {
+		bit >>= 2;
+	}
+	while (bit != 0) {
+		if (x >= result + bit) {
+			x -= result + bit;
+			result = (result >> 1) + bit;
+		} else {
+			result >>= 1;
+		}
+		bit >>= 2;
+	}
+	return (uint32_t) result;
+}
@@ -25,6 +25,7 @@ typedef enum {
 typedef enum {
 	APP_ONEWAY = 0,
 	APP_CALIBRATION = 1,
+	APP_TWR = 2,
 } polypoint_application_e;
 
 
@@ -52,7 +53,9 @@ void polypoint_start ();
 void polypoint_stop ();
 void polypoint_reset ();
 bool polypoint_ready ();
-void polypoint_tag_do_range ();
+void polypoint_tag_do_range (uint8_t* anchor_addr);
+void polypoint_tag_set_anchor_location (uint8_t* anchor_addr, int32_t x_mm, int32_t y_mm, int32_t z_mm);
+void polypoint_tag_clear_anchor_locations ();
 
 /******************************************************************************/
 // OS functions.
@@ -1,6 +1,7 @@
 #include "dw1000.h"
 #include "deca_regs.h"
 #include "glossy.h"
+#include "glossy_clock.h"
 #include "oneway_common.h"
 #include "timer.h"
 #include "prng.h"
@@ -34,12 +35,23 @@ static bool _lwb_scheduled;
 static uint32_t _lwb_num_timeslots;
 static uint32_t _lwb_timeslot;
 static uint32_t _lwb_mod_timeslot;
+static uint8_t _lwb_pipeline_phase;
+static uint16_t _lwb_pipeline_phase_us;
+static bool _lwb_pipeline_shared;
 static void (*_lwb_schedule_callback)(void);
 static double _clock_offset;
 
 static uint8_t _sched_euis[MAX_SCHED_TAGS][EUI_LEN];
 static uint8_t _tag_timeout[MAX_SCHED_TAGS];
 
+static bool _anchor_slot_req_en;
+static bool _anchor_slot_assigned;
+static uint8_t _anchor_slot;
+static uint16_t _anchor_slot_mask;
+static uint8_t _anchor_slot_refresh;
+static uint8_t _anchor_slot_euis[MAX_ANCHOR_SLOTS][EUI_LEN];
+static uint8_t _anchor_slot_timeout[MAX_ANCHOR_SLOTS];
+
 static ranctx _prng_state;
 
 #ifdef GLOSSY_PER_TEST
@@ -77,12 +89,19 @@ void glossy_init(glossy_role_e role){
 		.message_type = MSG_TYPE_PP_GLOSSY_SYNC,
 		.tag_ranging_mask = 0,
 		.tag_sched_idx = 0,
-		.tag_sched_eui = { 0 }
+		.tag_sched_eui = { 0 },
+		.tag_pipeline_depth = 1,
+		.tag_pipeline_phase_us = 0,
+		.anchor_slot_mask = 0,
+		.anchor_slot_idx = 0,
+		.anchor_slot_eui = { 0 },
+		.sync_num = 0
 	};
 
 	_sched_req_pkt.header = _sync_pkt.header;
 	_sched_req_pkt.message_type = MSG_TYPE_PP_GLOSSY_SCHED_REQ;
 	_sched_req_pkt.deschedule_flag = 0;
+	_sched_req_pkt.anchor_slot_flag = 0;
 	dw1000_read_eui(_sched_req_pkt.tag_sched_eui);
 
 	// TODO: We're currently using the same EUI throughout...
@@ -98,11 +117,19 @@ void glossy_init(glossy_role_e role){
 	_sending_sync = FALSE;
 	_lwb_counter = 0;
 	memset(_tag_timeout, 0, sizeof(_tag_timeout));
+	memset(_anchor_slot_timeout, 0, sizeof(_anchor_slot_timeout));
+	_anchor_slot_req_en = FALSE;
+	_anchor_slot_assigned = FALSE;
+	_anchor_slot_mask = 0;
+	_anchor_slot_refresh = 0;
 	_glossy_flood_timeslot_corrected_us = (uint64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8;
 
 	_lwb_valid = FALSE;
 	_lwb_sched_en = FALSE;
 	_lwb_scheduled = FALSE;
+	_lwb_pipeline_phase = 0;
+	_lwb_pipeline_phase_us = 0;
+	_lwb_pipeline_shared = FALSE;
 	_lwb_schedule_callback = NULL;
 	_glossy_currently_flooding = FALSE;
 
@@ -139,6 +166,51 @@ void increment_sched_timeout(){
 	}
 }
 
+void increment_anchor_slot_timeout(){
+	for(int ii=0; ii < MAX_ANCHOR_SLOTS; ii++){
+		// The master never has to ask for its own slot
+		if(_anchor_slot_assigned && ii == _anchor_slot)
+			continue;
+
+		if(_sync_pkt.anchor_slot_mask & (1 << ii)){
+			_anchor_slot_timeout[ii]++;
+			if(_anchor_slot_timeout[ii] == ANCHOR_SLOT_TIMEOUT)
+				_sync_pkt.anchor_slot_mask &= ~(1 << ii);
+		} else {
+			_anchor_slot_timeout[ii] = 0;
+		}
+	}
+	_anchor_slot_mask = _sync_pkt.anchor_slot_mask;
+}
+
+// Give this anchor a reply slot, or keep the one it has. The lowest free
+// slot is used so tags can keep their listening windows short. Announces
+// the slot in the next sync flood and returns it, or -1 if all of the slots
+// are taken.
+static int assign_anchor_slot(uint8_t* eui){
+	int candidate_slot = -1;
+	for(int ii = 0; ii < MAX_ANCHOR_SLOTS; ii++){
+		if(_sync_pkt.anchor_slot_mask & (1 << ii)){
+			if(memcmp(_anchor_slot_euis[ii], eui, EUI_LEN) == 0){
+				candidate_slot = ii;
+				break;
+			}
+		} else if(candidate_slot < 0){
+			candidate_slot = ii;
+		}
+	}
+	if(candidate_slot < 0)
+		return -1;
+
+	memcpy(_anchor_slot_euis[candidate_slot], eui, EUI_LEN);
+	_sync_pkt.anchor_slot_mask |= 1 << candidate_slot;
+	_sync_pkt.anchor_slot_idx = candidate_slot;
+	memcpy(_sync_pkt.anchor_slot_eui, eui, EUI_LEN);
+	_anchor_slot_timeout[candidate_slot] = 0;
+	_anchor_slot_mask = _sync_pkt.anchor_slot_mask;
+	return candidate_slot;
+}
+
 void glossy_deschedule(){
 	_sched_req_pkt.deschedule_flag = 1;
 }
@@ -171,8 +243,16 @@ void glossy_sync_task(){
 			dw1000_choose_antenna(0);
 
 			increment_sched_timeout();
+			increment_anchor_slot_timeout();
+
+#ifdef LWB_PIPELINE_TAGS
+			// Let tags share ranging slots if the profile leaves room
+			_sync_pkt.tag_pipeline_depth = dw1000_get_profile()->tag_pipeline_depth;
+			_sync_pkt.tag_pipeline_phase_us = dw1000_get_profile()->tag_pipeline_phase_us;
+#endif
 		
 			_last_time_sent += GLOSSY_UPDATE_INTERVAL_DW;
+			_sync_pkt.sync_num++;
 			send_sync(_last_time_sent);
 			_sending_sync = TRUE;
 		}
@@ -192,7 +272,12 @@ void glossy_sync_task(){
 			if(_lwb_counter == 1){
 				dw1000_update_channel(1);
 				dw1000_choose_antenna(0);
-				if((!_lwb_scheduled && _lwb_sched_en) || _sched_req_pkt.deschedule_flag){
+				bool anchor_slot_req = _anchor_slot_req_en && (!_anchor_slot_assigned || _anchor_slot_refresh >= ANCHOR_SLOT_REFRESH);
+				if((!_lwb_scheduled && _lwb_sched_en) || _sched_req_pkt.deschedule_flag || anchor_slot_req){
+					_sched_req_pkt.anchor_slot_flag = anchor_slot_req;
+					if(anchor_slot_req)
+						_anchor_slot_refresh = 0;
+
 					dwt_forcetrxoff();
 
 					uint16_t frame_len = sizeof(struct pp_sched_req_flood);
@@ -253,6 +338,67 @@ void lwb_set_sched_callback(void (*callback)(void)){
 	_lwb_schedule_callback = callback;
 }
 
+// Anchors call this to get a slot of their own to reply to tags in. The
+// master is an anchor too, so it just takes one.
+void lwb_set_anchor_slot_request(bool slot_en){
+	_anchor_slot_req_en = slot_en;
+
+	if(slot_en && _role == GLOSSY_MASTER){
+		int slot = assign_anchor_slot(_sched_req_pkt.tag_sched_eui);
+		if(slot >= 0){
+			_anchor_slot = slot;
+			_anchor_slot_assigned = TRUE;
+		}
+	}
+}
+
+// Which reply slot this anchor was given. Returns FALSE if it doesn't have
+// one yet.
+bool glossy_get_anchor_slot(uint8_t* slot){
+	*slot = _anchor_slot;
+	return _anchor_slot_req_en && _anchor_slot_assigned;
+}
+
+// How many reply slots a tag has to listen for to hear every anchor that
+// has one. Returns 0 if no anchors have slots.
+uint8_t glossy_get_num_anchor_slots(){
+	uint8_t num_slots = 0;
+	for(uint8_t ii = 0; ii < MAX_ANCHOR_SLOTS; ii++){
+		if(_anchor_slot_mask & (1 << ii))
+			num_slots = ii+1;
+	}
+	return num_slots;
+}
+
+// Where this tag is among the tags sharing its ranging slot, and how long
+// after the start of the slot it should start. The tag at phase 0 starts
+// right away and the anchors follow its schedule. Returns FALSE if the tag
+// has the slot to itself.
+bool lwb_get_pipeline_phase(uint8_t* phase, uint32_t* start_offset_us){
+	*phase = _lwb_pipeline_phase;
+	*start_offset_us = (uint32_t)(_lwb_pipeline_phase) * _lwb_pipeline_phase_us;
+	return _lwb_pipeline_shared;
+}
+
+// Convert a DW1000 timestamp into time on the master's clock, as how long
+// after the master sent sync number sync_num it happened. Every synced
+// node gets the same answer for the same instant, give or take the sync
+// error. Returns FALSE if we aren't synced.
+bool glossy_get_sync_time(uint64_t dw_timestamp, uint32_t* sync_num, uint64_t* time_since_sync){
+	if(_role == GLOSSY_MASTER){
+		if(_sync_pkt.sync_num == 0)
+			return FALSE;
+		*sync_num = _sync_pkt.sync_num;
+		*time_since_sync = (dw_timestamp - ((uint64_t)(_last_time_sent) << 8)) & 0xFFFFFFFFFFULL;
+	} else {
+		if(!_currently_syncd)
+			return FALSE;
+		*sync_num = _sync_pkt.sync_num;
+		*time_since_sync = (uint64_t)((double)((dw_timestamp - _last_sync_timestamp) & 0xFFFFFFFFFFULL) / _clock_offset);
+	}
+	return TRUE;
+}
+
 void glossy_process_txcallback(){
 	if(_role == GLOSSY_MASTER && _sending_sync){
 		// Sync has sent, set the timer to send the next one at a later time
@@ -335,6 +481,11 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 			dw1000_choose_antenna(1);
 			dwt_rxenable(0);
 #else
+			if(in_glossy_sched_req->anchor_slot_flag){
+				assign_anchor_slot(in_glossy_sched_req->tag_sched_eui);
+				return;
+			}
+
 			int ii, candidate_slot;
 			for(ii = 0; ii < MAX_SCHED_TAGS; ii++){
 				if(memcmp(_sched_euis[ii], in_glossy_sched_req->tag_sched_eui, EUI_LEN) == 0){
@@ -393,8 +544,27 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 			// Next, make sure the tag is still scheduled
 			if(_lwb_scheduled && ((in_glossy_sync->tag_ranging_mask & ((uint64_t)(1) << _lwb_timeslot)) == 0))
 				_lwb_scheduled = FALSE;
-			_lwb_num_timeslots = uint64_count_ones(in_glossy_sync->tag_ranging_mask);
-			_lwb_mod_timeslot = uint64_count_ones(in_glossy_sync->tag_ranging_mask & (((uint64_t)(1) << _lwb_timeslot) - 1));
+			// Each group of tag_pipeline_depth scheduled tags shares a
+			// ranging slot. Where a tag is in its group sets how long after
+			// the start of the slot it starts.
+			uint8_t pipeline_depth = in_glossy_sync->tag_pipeline_depth;
+			if(pipeline_depth == 0) pipeline_depth = 1;
+			uint8_t num_tags = uint64_count_ones(in_glossy_sync->tag_ranging_mask);
+			uint8_t tag_position = uint64_count_ones(in_glossy_sync->tag_ranging_mask & (((uint64_t)(1) << _lwb_timeslot) - 1));
+			_lwb_num_timeslots = (num_tags + pipeline_depth - 1) / pipeline_depth;
+			_lwb_mod_timeslot = tag_position / pipeline_depth;
+			_lwb_pipeline_phase = tag_position % pipeline_depth;
+			_lwb_pipeline_phase_us = in_glossy_sync->tag_pipeline_phase_us;
+			_lwb_pipeline_shared = (num_tags - _lwb_mod_timeslot*pipeline_depth) > 1 && pipeline_depth > 1;
+
+			// Same for anchor reply slots
+			if(memcmp(in_glossy_sync->anchor_slot_eui, _sched_req_pkt.tag_sched_eui, EUI_LEN) == 0){
+				_anchor_slot = in_glossy_sync->anchor_slot_idx;
+				_anchor_slot_assigned = TRUE;
+			}
+			_anchor_slot_mask = in_glossy_sync->anchor_slot_mask;
+			if(_anchor_slot_assigned && ((_anchor_slot_mask & (1 << _anchor_slot)) == 0))
+				_anchor_slot_assigned = FALSE;
 
 #ifdef GLOSSY_ANCHOR_SYNC_TEST
 			_sched_req_pkt.sync_depth = in_glossy_sync->header.seqNum;
@@ -404,15 +574,14 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 				if(_last_sync_timestamp + ((uint64_t)(DW_DELAY_FROM_US(GLOSSY_UPDATE_INTERVAL_US * 1.5)) << 8) > dw_timestamp){
 					// If we're between 0.5 to 1.0 times the update interval, we are now able to update our clock and perpetuate the flood!
 			
-					// Calculate the ppm offset from the last two received sync messages
-					double clock_offset_ppm = (((double)(dw_timestamp - 
-					                                     ((uint64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8)*(in_glossy_sync->header.seqNum) - 
-					                                     _last_sync_timestamp) / ((uint64_t)(GLOSSY_UPDATE_INTERVAL_DW) << 8)) - 1.0) * 1e6;
+					// Fit our clock to the master's over the last few syncs
+					glossy_clock_add_sync(in_glossy_sync->sync_num, in_glossy_sync->header.seqNum, dw_timestamp);
+					double clock_offset_ppm = (glossy_clock_get_ratio() - 1.0) * 1e6;
 #ifdef GLOSSY_ANCHOR_SYNC_TEST
 					_sched_req_pkt.clock_offset_ppm = clock_offset_ppm;
 #endif
 					
-					_clock_offset = (clock_offset_ppm/1e6)+1.0;
+					_clock_offset = glossy_clock_get_ratio();
 					_glossy_flood_timeslot_corrected_us = (uint64_t)((double)((uint64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8)*_clock_offset);
 
 					// Great, we're still sync'd!
@@ -422,6 +591,8 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 					// Since we're sync'd, we should make sure to reset our LWB window timer
 					_lwb_counter = 0;
 					_lwb_valid = TRUE;
+					if(_anchor_slot_refresh < ANCHOR_SLOT_REFRESH)
+						_anchor_slot_refresh++;
 					timer_reset(_glossy_timer, ((uint32_t)(in_glossy_sync->header.seqNum))*GLOSSY_FLOOD_TIMESLOT_US);
 
 					// Update DW1000's crystal trim to account for observed PPM offset
@@ -431,6 +602,10 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 					if(_xtal_trim < 1) _xtal_trim = 1;
 					else if(_xtal_trim > 31) _xtal_trim = 31;
 					dwt_xtaltrim(_xtal_trim);
+
+					// We know about how much that changes our clock, so the fit
+					// doesn't have to find out over the next few syncs
+					glossy_clock_trim_step(-((int)(_xtal_trim) - (int)(_last_xtal_trim)) * CW_CAL_12PF);
 #ifdef GLOSSY_ANCHOR_SYNC_TEST
 					_sched_req_pkt.xtal_trim = trim_diff;
 					// Sync is invalidated if the xtal trim has changed (this won't happen often)
@@ -449,14 +624,20 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 
 					_glossy_currently_flooding = TRUE;
 				} else {
-					// We lost sync :(
+					// We lost sync :( Start the fit over from this sync
 					_currently_syncd = 0;
+					glossy_clock_reset();
+					glossy_clock_add_sync(in_glossy_sync->sync_num, in_glossy_sync->header.seqNum, dw_timestamp);
 				}
 			} else {
 				// We've just received a following packet in the flood
 				// This really shouldn't happen, but for now let's ignore it
 			}
-			_last_sync_timestamp = dw_timestamp - (_glossy_flood_timeslot_corrected_us * in_glossy_sync->header.seqNum);
+
+			// Use when the fit says the sync left the master rather than this
+			// one reception
+			if(!glossy_clock_get_local_time(in_glossy_sync->sync_num, &_last_sync_timestamp))
+				_last_sync_timestamp = dw_timestamp - (_glossy_flood_timeslot_corrected_us * in_glossy_sync->header.seqNum);
 		}
 	}
 }
@@ -12,6 +12,15 @@
 #define GLOSSY_MAX_DEPTH          10
 #define TAG_SCHED_TIMEOUT         60
 
+// Anchors get their own slot to reply to tags in, handed out by the master.
+// Anchors ask again every ANCHOR_SLOT_REFRESH syncs so the master knows
+// they are still around, and the master frees the slot of an anchor it
+// hasn't heard from in ANCHOR_SLOT_TIMEOUT syncs. There are only as many
+// slots as a tag keeps responses (MAX_NUM_ANCHOR_RESPONSES).
+#define MAX_ANCHOR_SLOTS          10
+#define ANCHOR_SLOT_REFRESH       20
+#define ANCHOR_SLOT_TIMEOUT       60
+
 #ifdef GLOSSY_PER_TEST
 #define GLOSSY_UPDATE_INTERVAL_US 1e4
 #else
@@ -33,6 +42,12 @@ struct pp_sched_flood {
 	uint64_t tag_ranging_mask;
 	uint8_t tag_sched_idx;
 	uint8_t tag_sched_eui[EUI_LEN];
+	uint8_t tag_pipeline_depth;      // How many tags share each ranging slot
+	uint16_t tag_pipeline_phase_us;  // How far apart their start times are
+	uint16_t anchor_slot_mask;
+	uint8_t anchor_slot_idx;
+	uint8_t anchor_slot_eui[EUI_LEN];
+	uint32_t sync_num;  // Counts up with every sync the master sends
 	struct ieee154_footer footer;
 } __attribute__ ((__packed__));
 
@@ -40,6 +55,7 @@ struct pp_sched_req_flood {
 	struct ieee154_header_broadcast header;
 	uint8_t message_type;
 	uint8_t deschedule_flag;
+	uint8_t anchor_slot_flag;  // Asking for an anchor reply slot, not an LWB slot
 	uint8_t tag_sched_eui[EUI_LEN];
 #ifdef GLOSSY_ANCHOR_SYNC_TEST
 	uint64_t turnaround_time;
@@ -55,6 +71,11 @@ void glossy_deschedule();
 void glossy_sync_task();
 void lwb_set_sched_request(bool sched_en);
 void lwb_set_sched_callback(void (*callback)(void));
+void lwb_set_anchor_slot_request(bool slot_en);
+bool glossy_get_anchor_slot(uint8_t* slot);
+uint8_t glossy_get_num_anchor_slots();
+bool lwb_get_pipeline_phase(uint8_t* phase, uint32_t* start_offset_us);
+bool glossy_get_sync_time(uint64_t dw_timestamp, uint32_t* sync_num, uint64_t* time_since_sync);
 void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf);
 void glossy_process_txcallback();
 
@@ -0,0 +1,114 @@
+#include "dw1000.h"
+#include "glossy_clock.h"
+
+// How much master time there is between syncs, and how much each hop of
+// the flood adds, in DW1000 time units
+#define GLOSSY_CLOCK_SYNC_DW ((int64_t)(GLOSSY_UPDATE_INTERVAL_DW) << 8)
+#define GLOSSY_CLOCK_HOP_DW  ((int64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8)
+
+static glossy_clock_sample_t _samples[GLOSSY_CLOCK_HISTORY];
+static uint8_t _num_samples;
+static uint8_t _newest;
+
+// The fit: how many of our time units pass per master time unit, and when
+// the newest sync left the master on our clock
+static double _ratio = 1.0;
+static uint32_t _ref_sync_num;
+static uint64_t _ref_local_time;
+
+// Master time of a sample, relative to the newest one
+static int64_t master_time_from_newest(glossy_clock_sample_t* sample){
+	glossy_clock_sample_t* newest = &_samples[_newest];
+	return (int64_t)((int32_t)(sample->sync_num - newest->sync_num)) * GLOSSY_CLOCK_SYNC_DW +
+	       ((int64_t)(sample->depth) - newest->depth) * GLOSSY_CLOCK_HOP_DW;
+}
+
+// Least squares line through the history. Everything is relative to the
+// newest sample so the doubles keep the precision. With a single sample
+// the ratio from before is kept.
+static void fit(){
+	glossy_clock_sample_t* newest = &_samples[_newest];
+	double mean_x = 0.0;
+	double mean_y = 0.0;
+	for(int ii = 0; ii < _num_samples; ii++){
+		mean_x += (double)(master_time_from_newest(&_samples[ii]));
+		mean_y += (double)((int64_t)(_samples[ii].local_time - newest->local_time));
+	}
+	mean_x /= _num_samples;
+	mean_y /= _num_samples;
+
+	if(_num_samples > 1){
+		double sxx = 0.0;
+		double sxy = 0.0;
+		for(int ii = 0; ii < _num_samples; ii++){
+			double dx = (double)(master_time_from_newest(&_samples[ii])) - mean_x;
+			double dy = (double)((int64_t)(_samples[ii].local_time - newest->local_time)) - mean_y;
+			sxx += dx*dx;
+			sxy += dx*dy;
+		}
+		if(sxx > 0.0)
+			_ratio = sxy/sxx;
+	}
+
+	// Where the line puts the newest sync leaving the master, at depth 0
+	double ref_x = (double)(-((int64_t)(newest->depth) * GLOSSY_CLOCK_HOP_DW));
+	_ref_sync_num = newest->sync_num;
+	_ref_local_time = newest->local_time + (int64_t)(mean_y + _ratio*(ref_x - mean_x));
+}
+
+// Forget the history, for when we lose sync. The ratio is kept as a
+// starting point since the crystal hasn't changed.
+void glossy_clock_reset(){
+	_num_samples = 0;
+	_newest = 0;
+}
+
+// Add a sync flood we received. depth is how many hops it took to get to
+// us.
+void glossy_clock_add_sync(uint32_t sync_num, uint8_t depth, uint64_t local_time){
+	if(_num_samples > 0)
+		_newest = (_newest + 1) % GLOSSY_CLOCK_HISTORY;
+	_samples[_newest].sync_num = sync_num;
+	_samples[_newest].depth = depth;
+	_samples[_newest].local_time = local_time;
+	if(_num_samples < GLOSSY_CLOCK_HISTORY)
+		_num_samples++;
+
+	fit();
+}
+
+// Our clock rate just changed by about ppm because the crystal trim was
+// changed. Scale the history as if it had been taken at the new rate, so
+// the fit follows the change right away instead of averaging it in over
+// the next few syncs.
+void glossy_clock_trim_step(double ppm){
+	if(_num_samples == 0)
+		return;
+
+	double scale = 1.0 + ppm/1e6;
+	uint64_t now = _samples[_newest].local_time;
+	for(int ii = 0; ii < _num_samples; ii++){
+		int64_t since = (int64_t)(_samples[ii].local_time - now);
+		_samples[ii].local_time = now + (int64_t)((double)(since)*scale);
+	}
+	_ratio *= scale;
+
+	fit();
+}
+
+// How many of our DW1000 time units pass per master time unit
+double glossy_clock_get_ratio(){
+	return _ratio;
+}
+
+// When sync number sync_num left the master, on our clock with the
+// overflows counted. Works for syncs that haven't been sent yet too.
+// Returns FALSE if there is no history to go on.
+bool glossy_clock_get_local_time(uint32_t sync_num, uint64_t* local_time){
+	if(_num_samples == 0)
+		return FALSE;
+
+	double since_ref = (double)((int64_t)((int32_t)(sync_num - _ref_sync_num)) * GLOSSY_CLOCK_SYNC_DW) * _ratio;
+	*local_time = _ref_local_time + (int64_t)(since_ref);
+	return TRUE;
+}
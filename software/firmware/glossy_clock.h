@@ -0,0 +1,29 @@
+#ifndef __GLOSSY_CLOCK_H
+#define __GLOSSY_CLOCK_H
+
+#include "glossy.h"
+
+// Glossy slaves keep the last GLOSSY_CLOCK_HISTORY syncs they received and
+// fit a line through them to map their own DW1000 clock onto the master's.
+// Every sync is sent a whole number of GLOSSY_UPDATE_INTERVAL_DW after the
+// one before it, and every hop of the flood adds one flood timeslot, so
+// the master time a sync went out at is known exactly from its sync number
+// and depth. The slope of the fit is the crystal offset and the line itself
+// gives when each sync left the master, without the jitter of any single
+// reception. Four syncs are enough to average out the reception jitter,
+// and more is RAM the tag can't spare.
+#define GLOSSY_CLOCK_HISTORY 4
+
+typedef struct {
+	uint32_t sync_num;
+	uint8_t  depth;
+	uint64_t local_time;  // When we got it, with the overflows counted
+} __attribute__ ((__packed__)) glossy_clock_sample_t;
+
+void glossy_clock_reset();
+void glossy_clock_add_sync(uint32_t sync_num, uint8_t depth, uint64_t local_time);
+void glossy_clock_trim_step(double ppm);
+double glossy_clock_get_ratio();
+bool glossy_clock_get_local_time(uint32_t sync_num, uint64_t* local_time);
+
+#endif
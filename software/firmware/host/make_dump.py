@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+
+# Write a UART dump of simulated ranging events for range_replay. The tag
+# and anchors have their own crystal offsets and every poll gets timestamp
+# noise, some multipath and a chance of being lost, so all of the paths
+# through the range calculation get used. Now and then a poll's first path
+# is found early on a noise peak. The format is what report_range() in
+# oneway_tag.c sends with UART_DATA_OFFLOAD.
+#
+# If a second file is given, the true distance to the anchor in each
+# response is written to it, one per line in millimeters, so range_replay
+# can score the range estimates.
+
+import random
+import struct
+import sys
+
+HEADER      = (0x80018001).to_bytes(4, 'big')
+DATA_HEADER = (0x8080).to_bytes(2, 'big')
+FOOTER      = (0x80FE).to_bytes(2, 'big')
+
+NUM_RANGING_CHANNELS = 3
+NUM_ANTENNAS = 3
+NUM_RANGING_BROADCASTS = 30
+NUM_RANGING_LISTENING_WINDOWS = 3
+
+DWT_TIME_UNITS = 1/499.2e6/128
+DW_PER_US = 1e-6/DWT_TIME_UNITS
+SPEED_OF_LIGHT = 299702547.0
+DW_PER_MM = 1/(SPEED_OF_LIGHT*DWT_TIME_UNITS*1000)
+
+# The fast profile in dw1000.c
+BROADCASTS_PERIOD_US = 1000
+LISTENING_WINDOW_US = 8000
+LISTENING_WINDOW_PADDING_US = 900
+
+NUM_EVENTS = 250
+NUM_ANCHORS = 10
+TOA_NOISE_MM = 40
+MULTIPATH_MM = 150
+EARLY_FIRST_PATH = 0.03
+EARLY_FIRST_PATH_MM = (200, 1500)
+
+def anchor_eui(anchor):
+	# c0:98:e5:50:50:44:50:xx, little endian like the tag stores it
+	return bytes([anchor+1, 0x50, 0x44, 0x50, 0x50, 0xe5, 0x98, 0xc0])
+
+def ss_to_configuration(ss):
+	tag_antenna = (ss // NUM_RANGING_CHANNELS // NUM_RANGING_CHANNELS) % NUM_ANTENNAS
+	anchor_antenna = (ss // NUM_RANGING_CHANNELS) % NUM_ANTENNAS
+	channel = ss % NUM_RANGING_CHANNELS
+	return (((tag_antenna * NUM_ANTENNAS) + anchor_antenna) * NUM_RANGING_CHANNELS) + channel
+
+def ss_index_from_settings(anchor_antenna, window):
+	# oneway_get_ss_index_from_settings(), the tag uses antenna 0 to listen
+	return anchor_antenna*NUM_RANGING_CHANNELS + (window % NUM_RANGING_CHANNELS)
+
+def ranging_event(rng, anchors, truth):
+	tag_start = rng.randrange(1 << 30, 1 << 39)
+	# Delayed sends drop the low 9 bits
+	send_times = [(tag_start + int(ii*BROADCASTS_PERIOD_US*DW_PER_US)) & ~0x1FF
+			for ii in range(NUM_RANGING_BROADCASTS)]
+
+	responses = []
+	for anchor in anchors:
+		# Both crystals are 20 ppm parts
+		ratio = 1 + rng.uniform(-40e-6, 40e-6)
+		anchor_start = rng.randrange(1 << 30, 1 << 39)
+		def anchor_time(tag_time):
+			return anchor_start + (tag_time - tag_start)*ratio
+
+		distance_mm = rng.uniform(500, 25000)
+		tof = distance_mm*DW_PER_MM
+		multipath = [rng.expovariate(1/MULTIPATH_MM)*DW_PER_MM for _ in range(NUM_ANTENNAS*NUM_ANTENNAS*NUM_RANGING_CHANNELS)]
+		loss = rng.uniform(0.02, 0.5)
+
+		toas = [0]*NUM_RANGING_BROADCASTS
+		for ii in range(NUM_RANGING_BROADCASTS):
+			if rng.random() < loss:
+				continue
+			arrival = send_times[ii] + tof + multipath[ss_to_configuration(ii)] + \
+					rng.gauss(0, TOA_NOISE_MM*DW_PER_MM)
+			if rng.random() < EARLY_FIRST_PATH:
+				arrival -= rng.uniform(*EARLY_FIRST_PATH_MM)*DW_PER_MM
+			toas[ii] = int(round(anchor_time(arrival)))
+			if toas[ii] & 0xFFFF == 0:
+				toas[ii] = 0
+		heard = [ii for ii in range(NUM_RANGING_BROADCASTS) if toas[ii] != 0]
+		if len(heard) == 0:
+			continue
+
+		window = rng.randrange(NUM_RANGING_LISTENING_WINDOWS)
+		antenna = rng.randrange(NUM_ANTENNAS)
+		window_start = send_times[-1] + (BROADCASTS_PERIOD_US +
+				window*(LISTENING_WINDOW_US+LISTENING_WINDOW_PADDING_US))*DW_PER_US
+		send_at = window_start + rng.uniform(0, LISTENING_WINDOW_US)*DW_PER_US
+		tx_timestamp = int(anchor_time(send_at)) & ~0x1FF
+		sent = tag_start + (tx_timestamp - anchor_start)/ratio
+		rx_timestamp = int(round(sent + tof + rng.gauss(0, TOA_NOISE_MM*DW_PER_MM)))
+
+		first_idx = heard[0]
+		last_idx = heard[-1]
+		# Now and then a corrupted packet gets through
+		if rng.random() < 0.01:
+			first_idx = 0xFF
+
+		responses.append(struct.pack('<8sBBQQBQBQ30H', anchor_eui(anchor), antenna, window,
+				tx_timestamp, rx_timestamp,
+				first_idx, toas[heard[0]], last_idx, toas[heard[-1]],
+				*[toa & 0xFFFF for toa in toas]))
+		truth.append(int(round(distance_mm)))
+
+	out = HEADER + struct.pack('<B', len(responses)) + struct.pack('<30Q', *send_times)
+	for response in responses:
+		out += DATA_HEADER + response
+	return out + FOOTER
+
+if len(sys.argv) not in (2, 3):
+	print("usage: {} dump [truth]".format(sys.argv[0]))
+	sys.exit(2)
+
+rng = random.Random(4)
+truth = []
+with open(sys.argv[1], 'wb') as f:
+	for _ in range(NUM_EVENTS):
+		anchors = rng.sample(range(NUM_ANCHORS), rng.randint(3, NUM_ANCHORS))
+		f.write(ranging_event(rng, anchors, truth))
+if len(sys.argv) == 3:
+	with open(sys.argv[2], 'w') as f:
+		f.writelines('{}\n'.format(distance_mm) for distance_mm in truth)
@@ -0,0 +1,695 @@
+// Replay ranging events dumped by a tag over UART through the firmware's
+// range math on a PC. For every anchor response the fixed-point range from
+// oneway_range.c is checked against the same calculation done in doubles,
+// and then each of the hot paths is timed. Exits with an error if the two
+// disagree or anything takes more instructions than its limit in
+// benchmarks[]. Time depends on the machine and whatever else it is doing,
+// so the time limits are only checked with -s.
+//
+//   range_replay [-n iterations] [-t tolerance_mm] [-r truth] [-s] dump...
+//
+// The dumps are the raw bytes a tag built with UART_DATA_OFFLOAD sends, the
+// same format data_dump_glossy.py reads. If the true distance for each
+// response is known, like for the dumps make_dump.py writes, -r gives a
+// file with them one per line. The range estimate is then scored against
+// them, and it fails if it does worse than the plain percentile of all of
+// the distances.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "oneway_common.h"
+#include "oneway_tag.h"
+#include "oneway_range.h"
+#include "glossy_clock.h"
+
+// The tag's UART packet framing, from report_range() in oneway_tag.c
+#define DUMP_HEADER      0x80018001
+#define DUMP_DATA_HEADER 0x8080
+#define DUMP_FOOTER      0x80FE
+
+// How many times each benchmark goes over all of the replayed responses
+#define DEFAULT_ITERATIONS 200
+
+// How far the fixed-point range can be from the doubles
+#define DEFAULT_TOLERANCE_MM 1
+
+
+/******************************************************************************/
+// Reading dumps
+/******************************************************************************/
+
+typedef struct {
+	uint64_t send_times[NUM_RANGING_BROADCASTS];
+	uint8_t num_responses;
+	anchor_responses_t responses[MAX_NUM_ANCHOR_RESPONSES];
+} ranging_event_t;
+
+static ranging_event_t* _events;
+static uint32_t _num_events;
+static uint32_t _num_responses;
+
+static int read_bytes (FILE* f, void* buf, size_t len) {
+	return fread(buf, 1, len, f) == len;
+}
+
+// Scan up to the next packet header, like find_header() in
+// data_dump_glossy.py. Anything else on the UART is skipped.
+static int find_header (FILE* f) {
+	uint32_t window = 0;
+	int c;
+	while ((c = fgetc(f)) != EOF) {
+		window = (window << 8) | (uint8_t) c;
+		if (window == DUMP_HEADER) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static uint16_t read_marker (FILE* f) {
+	uint8_t b[2] = {0, 0};
+	read_bytes(f, b, 2);
+	return (b[0] << 8) | b[1];
+}
+
+// Add all of the complete ranging events in a dump to _events. Returns the
+// number of packets that had to be thrown out.
+static uint32_t load_dump (const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(2);
+	}
+
+	uint32_t bad = 0;
+	ranging_event_t event;
+	while (find_header(f)) {
+		memset(&event, 0, sizeof(event));
+		if (!read_bytes(f, &event.num_responses, 1) ||
+		    !read_bytes(f, event.send_times, sizeof(event.send_times)) ||
+		    event.num_responses > MAX_NUM_ANCHOR_RESPONSES) {
+			bad++;
+			continue;
+		}
+
+		uint8_t i;
+		for (i=0; i<event.num_responses; i++) {
+			if (read_marker(f) != DUMP_DATA_HEADER ||
+			    !read_bytes(f, &event.responses[i], sizeof(anchor_responses_t))) {
+				break;
+			}
+		}
+		if (i < event.num_responses || read_marker(f) != DUMP_FOOTER) {
+			bad++;
+			continue;
+		}
+
+		_events = realloc(_events, (_num_events+1)*sizeof(ranging_event_t));
+		_events[_num_events++] = event;
+		_num_responses += event.num_responses;
+	}
+
+	fclose(f);
+	return bad;
+}
+
+
+/******************************************************************************/
+// Reference range calculation
+/******************************************************************************/
+
+// Combines the distances from each poll of a response into one range
+typedef int (*range_estimator_t) (int distances[], uint8_t configurations[], uint8_t count);
+
+static int diversity_estimate (int distances[], uint8_t configurations[], uint8_t count) {
+	uint8_t num_configurations;
+	uint8_t selected_configuration;
+	return oneway_range_diversity_estimate(distances, configurations, count,
+	                                       &num_configurations, &selected_configuration);
+}
+
+// Each fixed-point distance can be off from the doubles by the tolerance,
+// so a configuration whose median about as many distances agree with as it
+// needs can be counted by one and left out by the other. The range is then
+// different, and it isn't the arithmetic's fault. This notes when that can
+// happen before making the estimate.
+static int32_t _tolerance_mm;
+static bool _agreement_borderline;
+
+static int compare_ints (const void* a, const void* b) {
+	return *(const int*) a - *(const int*) b;
+}
+
+static int checked_diversity_estimate (int distances[], uint8_t configurations[], uint8_t count) {
+	const int32_t margin = 2*_tolerance_mm;
+	_agreement_borderline = FALSE;
+
+	for (uint8_t i=0; i<count; i++) {
+		int group[NUM_RANGING_BROADCASTS];
+		uint8_t n = 0;
+		for (uint8_t j=0; j<count; j++) {
+			if (configurations[j] == configurations[i]) {
+				group[n++] = distances[j];
+			}
+		}
+		qsort(group, n, sizeof(int), compare_ints);
+		int median = (n % 2) ? group[n/2] : group[n/2-1] + ((group[n/2] - group[n/2-1]) / 2);
+
+		uint8_t surely = 0;
+		uint8_t maybe = 0;
+		for (uint8_t j=0; j<count; j++) {
+			int32_t diff = abs(distances[j] - median);
+			surely += diff <= ONEWAY_RANGE_AGREEMENT_MM - margin;
+			maybe += diff <= ONEWAY_RANGE_AGREEMENT_MM + margin;
+		}
+		if (surely < ONEWAY_RANGE_MIN_AGREEING_POLLS && maybe >= ONEWAY_RANGE_MIN_AGREEING_POLLS) {
+			_agreement_borderline = TRUE;
+		}
+	}
+
+	return diversity_estimate(distances, configurations, count);
+}
+
+// What the tag did before it looked at the configurations
+static int plain_percentile (int distances[], uint8_t configurations[], uint8_t count) {
+	(void) configurations;
+	return oneway_range_percentile(distances, count);
+}
+
+// oneway_range_calculate_anchor() done in doubles, the way the tag did it
+// before the fixed-point version. It throws out the same polls and gives
+// up in the same places, so the only difference left is the arithmetic.
+// The distances are combined with estimate, which for the comparison is
+// the firmware's own oneway_range_diversity_estimate(), all integer already.
+static int32_t reference_calculate_anchor (const uint64_t* send_times,
+                                           const anchor_responses_t* aresp,
+                                           range_estimator_t estimate) {
+	const double max_interval = (double) (((int64_t) 1) << 34);
+	const double max_skew = 1.0 / ONEWAY_RANGE_MAX_SKEW_DIVISOR;
+
+	uint8_t first_idx = aresp->tag_poll_first_idx;
+	uint8_t last_idx  = aresp->tag_poll_last_idx;
+	if (first_idx >= NUM_RANGING_BROADCASTS || last_idx >= NUM_RANGING_BROADCASTS) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+
+	uint64_t toas[NUM_RANGING_BROADCASTS] = {0};
+	toas[first_idx] = aresp->tag_poll_first_TOA;
+	toas[last_idx] = aresp->tag_poll_last_TOA;
+
+	// Least squares fit of the anchor's clock against the tag's, with one
+	// intercept per channel. x is in the same 256 time unit steps as the
+	// firmware uses, so the minimum span means the same thing.
+	double n[NUM_RANGING_CHANNELS] = {0};
+	double sum_x[NUM_RANGING_CHANNELS] = {0};
+	double sum_r[NUM_RANGING_CHANNELS] = {0};
+	double sxx = 0;
+	double sxr = 0;
+
+	if (last_idx > first_idx) {
+		double tag_interval = (double) (int64_t) (send_times[last_idx] - send_times[first_idx]);
+		double anchor_interval = (double) (int64_t) (aresp->tag_poll_last_TOA - aresp->tag_poll_first_TOA);
+		if (tag_interval <= 0 || tag_interval >= max_interval ||
+		    fabs(anchor_interval/tag_interval - 1.0) >= max_skew) {
+			return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+		}
+		double approx_ratio = anchor_interval / tag_interval;
+
+		for (uint8_t ii=first_idx+1; ii<last_idx; ii++) {
+			if (aresp->tag_poll_TOAs[ii] == 0) {
+				continue;
+			}
+			uint64_t estimated_TOA = aresp->tag_poll_first_TOA +
+				(int64_t) (approx_ratio * (double) (int64_t) (send_times[ii] - send_times[first_idx]));
+			uint64_t actual_TOA = (estimated_TOA & 0xFFFFFFFFFFFF0000ULL) + aresp->tag_poll_TOAs[ii];
+			if (actual_TOA < estimated_TOA - 0x7FFF) {
+				actual_TOA += 0x10000;
+			} else if (actual_TOA > estimated_TOA + 0x7FFF) {
+				actual_TOA -= 0x10000;
+			}
+			toas[ii] = actual_TOA;
+		}
+
+		for (uint8_t ii=first_idx; ii<=last_idx; ii++) {
+			if (toas[ii] == 0) {
+				continue;
+			}
+			double tag_offset = (double) (int64_t) (send_times[ii] - send_times[first_idx]);
+			double anchor_offset = (double) (int64_t) (toas[ii] - toas[first_idx]);
+			double r = anchor_offset - tag_offset;
+			if (fabs(tag_offset) >= max_interval || fabs(anchor_offset) >= max_interval ||
+			    fabs(r) >= (double) (1 << 24)) {
+				continue;
+			}
+			double x = tag_offset / 256.0;
+			uint8_t channel = oneway_subsequence_number_to_channel_index(ii);
+			n[channel]++;
+			sum_x[channel] += x;
+			sum_r[channel] += r;
+			sxx += x*x;
+			sxr += x*r;
+		}
+	}
+
+	for (uint8_t i=0; i<NUM_RANGING_CHANNELS; i++) {
+		if (n[i] > 0) {
+			sxx -= (sum_x[i] * sum_x[i]) / n[i];
+			sxr -= (sum_x[i] * sum_r[i]) / n[i];
+		}
+	}
+	double min_span = DW_DELAY_FROM_US(ONEWAY_RANGE_MIN_SKEW_SPAN_US);
+	if (sxx < (min_span * min_span) / 2) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+	double skew = sxr / (sxx * 256.0);
+	if (fabs(skew) >= max_skew) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+	double offset_anchor_over_tag = 1.0 + skew;
+
+	uint8_t ss_index_matching = oneway_get_ss_index_from_settings(aresp->anchor_final_antenna_index,
+	                                                              aresp->window_packet_recv);
+	if (ss_index_matching >= NUM_RANGING_BROADCASTS || toas[ss_index_matching] == 0) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+
+	uint64_t matching_broadcast_send_time = send_times[ss_index_matching];
+	uint64_t matching_broadcast_recv_time = toas[ss_index_matching];
+	double tag_round_trip = (double) (int64_t) (aresp->anc_final_rx_timestamp - matching_broadcast_send_time);
+	double anchor_turnaround = (double) (int64_t) (aresp->anc_final_tx_timestamp - matching_broadcast_recv_time);
+	if (fabs(tag_round_trip) >= max_interval || fabs(anchor_turnaround) >= max_interval) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+	double one_way_TOF = ((tag_round_trip * offset_anchor_over_tag) - anchor_turnaround) / 2.0;
+
+	int distances_millimeters[NUM_RANGING_BROADCASTS];
+	uint8_t distance_configurations[NUM_RANGING_BROADCASTS];
+	uint8_t num_valid_distances = 0;
+	for (uint8_t broadcast_index=0; broadcast_index<NUM_RANGING_BROADCASTS; broadcast_index++) {
+		if (toas[broadcast_index] == 0) {
+			continue;
+		}
+		double broadcast_anchor_offset = (double) (int64_t) (toas[broadcast_index] - matching_broadcast_recv_time);
+		double broadcast_tag_offset = (double) (int64_t) (send_times[broadcast_index] - matching_broadcast_send_time);
+		if (fabs(broadcast_anchor_offset) >= max_interval || fabs(broadcast_tag_offset) >= max_interval) {
+			continue;
+		}
+		double TOF = broadcast_anchor_offset - (broadcast_tag_offset * offset_anchor_over_tag) + one_way_TOF;
+
+		int distance_millimeters = dwtime_to_millimeters(TOF);
+		if (distance_millimeters >= MIN_VALID_RANGE_MM && distance_millimeters <= MAX_VALID_RANGE_MM) {
+			distances_millimeters[num_valid_distances] = distance_millimeters;
+			distance_configurations[num_valid_distances] = oneway_subsequence_number_to_configuration(broadcast_index);
+			num_valid_distances++;
+		}
+	}
+
+	if (num_valid_distances < MIN_VALID_RANGES_PER_ANCHOR) {
+		return ONEWAY_TAG_RANGE_ERROR_TOO_FEW_RANGES;
+	}
+
+	return estimate(distances_millimeters, distance_configurations, num_valid_distances);
+}
+
+// Compare the fixed-point range for every response with the reference.
+// Returns the number of responses that didn't match.
+static uint32_t check_ranges (int32_t tolerance_mm) {
+	uint32_t ranged = 0;
+	uint32_t mismatches = 0;
+	uint32_t borderline = 0;
+	int32_t max_diff = 0;
+
+	_tolerance_mm = tolerance_mm;
+
+	for (uint32_t e=0; e<_num_events; e++) {
+		ranging_event_t* event = &_events[e];
+		for (uint8_t i=0; i<event->num_responses; i++) {
+			int64_t skew;
+			oneway_range_quality_t quality;
+			uint8_t selected_configuration;
+			int32_t fixed = oneway_range_calculate_anchor(event->send_times, &event->responses[i], NULL,
+			                                              &skew, &quality, &selected_configuration);
+			_agreement_borderline = FALSE;
+			int32_t reference = reference_calculate_anchor(event->send_times, &event->responses[i],
+			                                               checked_diversity_estimate);
+
+			// The errors are all very negative
+			bool fixed_valid = fixed >= MIN_VALID_RANGE_MM;
+			bool reference_valid = reference >= MIN_VALID_RANGE_MM;
+			int32_t diff = (fixed_valid && reference_valid) ? abs(fixed - reference) : 0;
+			if (diff > tolerance_mm && _agreement_borderline) {
+				borderline++;
+				diff = 0;
+			} else if (fixed_valid != reference_valid || (!fixed_valid && fixed != reference) || diff > tolerance_mm) {
+				fprintf(stderr, "event %u anchor %u: fixed %d reference %d\n", e, i, fixed, reference);
+				mismatches++;
+			}
+			if (fixed_valid) {
+				ranged++;
+			}
+			if (diff > max_diff) {
+				max_diff = diff;
+			}
+		}
+	}
+
+	printf("%u events, %u responses, %u ranged, max diff %d mm, %u mismatches, %u too close to call\n",
+	       _num_events, _num_responses, ranged, max_diff, mismatches, borderline);
+	return mismatches;
+}
+
+
+/******************************************************************************/
+// Scoring the range estimate
+/******************************************************************************/
+
+// Read the true distances, one per response in the order of the dumps
+static int32_t* load_truth (const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(2);
+	}
+
+	int32_t* truth = malloc(_num_responses*sizeof(int32_t));
+	for (uint32_t n=0; n<_num_responses; n++) {
+		if (fscanf(f, "%d", &truth[n]) != 1) {
+			fprintf(stderr, "%s: only %u distances for %u responses\n", path, n, _num_responses);
+			exit(2);
+		}
+	}
+
+	fclose(f);
+	return truth;
+}
+
+// RMS error of the ranges from the firmware's estimate and from the plain
+// percentile, over the responses both give a range for. Returns TRUE if the
+// firmware's estimate does worse.
+static bool score_estimate (const int32_t* truth) {
+	double diversity_sq = 0;
+	double percentile_sq = 0;
+	uint32_t scored = 0;
+	uint32_t differ = 0;
+
+	uint32_t n = 0;
+	for (uint32_t e=0; e<_num_events; e++) {
+		ranging_event_t* event = &_events[e];
+		for (uint8_t i=0; i<event->num_responses; i++, n++) {
+			int32_t diversity = reference_calculate_anchor(event->send_times, &event->responses[i],
+			                                               diversity_estimate);
+			int32_t percentile = reference_calculate_anchor(event->send_times, &event->responses[i],
+			                                                plain_percentile);
+			if (diversity < MIN_VALID_RANGE_MM || percentile < MIN_VALID_RANGE_MM) {
+				continue;
+			}
+
+			diversity_sq += (double) (diversity - truth[n]) * (diversity - truth[n]);
+			percentile_sq += (double) (percentile - truth[n]) * (percentile - truth[n]);
+			scored++;
+			if (diversity != percentile) {
+				differ++;
+			}
+		}
+	}
+
+	if (scored == 0) {
+		return FALSE;
+	}
+	double diversity_rms = sqrt(diversity_sq / scored);
+	double percentile_rms = sqrt(percentile_sq / scored);
+	printf("range error: diversity estimate %.1f mm rms, plain percentile %.1f mm rms, %u of %u differ\n",
+	       diversity_rms, percentile_rms, differ, scored);
+	return diversity_rms > percentile_rms;
+}
+
+
+/******************************************************************************/
+// Benchmarks
+/******************************************************************************/
+
+// Each benchmark does one op per call and returns something that depends on
+// the result so the work can't be thrown away.
+typedef struct {
+	const char* name;
+	uint32_t (*op) (uint32_t n);
+	double max_instructions;    // Per op, 0 for no limit
+	double max_ns;              // Per op, 0 for no limit. Only checked with -s.
+} benchmark_t;
+
+// Benchmark op n works on response n of all of the replayed events
+static const uint64_t** _response_send_times;
+static const anchor_responses_t** _responses;
+
+static void index_responses () {
+	_response_send_times = malloc(_num_responses*sizeof(uint64_t*));
+	_responses = malloc(_num_responses*sizeof(anchor_responses_t*));
+	uint32_t n = 0;
+	for (uint32_t e=0; e<_num_events; e++) {
+		for (uint8_t i=0; i<_events[e].num_responses; i++) {
+			_response_send_times[n] = _events[e].send_times;
+			_responses[n] = &_events[e].responses[i];
+			n++;
+		}
+	}
+}
+
+static uint32_t bench_calculate_anchor (uint32_t n) {
+	n %= _num_responses;
+	int64_t skew;
+	oneway_range_quality_t quality;
+	uint8_t selected_configuration;
+	return oneway_range_calculate_anchor(_response_send_times[n], _responses[n], NULL,
+	                                     &skew, &quality, &selected_configuration);
+}
+
+static uint32_t bench_reference_calculate_anchor (uint32_t n) {
+	n %= _num_responses;
+	return reference_calculate_anchor(_response_send_times[n], _responses[n], diversity_estimate);
+}
+
+// Pack each response into the compact ANC_FINAL the anchor sends and parse
+// it back out the way the tag's RX callback does.
+static uint32_t bench_anc_final_pack_unpack (uint32_t n) {
+	const anchor_responses_t* aresp = _responses[n % _num_responses];
+
+	struct pp_anc_final anc_final;
+	memset(&anc_final, 0, sizeof(anc_final));
+	memcpy(anc_final.ieee154_header_unicast.sourceAddr, aresp->anchor_addr, EUI_LEN);
+	anc_final.message_type = MSG_TYPE_PP_NOSLOTS_ANC_FINAL;
+	anc_final.final_antenna = aresp->anchor_final_antenna_index;
+	anc_final.dw_time_sent = aresp->anc_final_tx_timestamp;
+	anc_final.first_rxd_idx = aresp->tag_poll_first_idx % NUM_RANGING_BROADCASTS;
+	anc_final.first_rxd_toa = aresp->tag_poll_first_TOA;
+	anc_final.last_rxd_idx = aresp->tag_poll_last_idx % NUM_RANGING_BROADCASTS;
+	anc_final.last_rxd_toa = aresp->tag_poll_last_TOA;
+	memcpy(anc_final.TOAs, aresp->tag_poll_TOAs, sizeof(anc_final.TOAs));
+
+	struct pp_anc_final_compact compact;
+	uint16_t len = oneway_anc_final_compact_pack(&anc_final, &compact);
+
+	anchor_responses_t unpacked;
+	return oneway_anc_final_unpack((uint8_t*) &compact, len, &unpacked) + unpacked.tag_poll_last_idx;
+}
+
+static uint32_t bench_percentile (uint32_t n) {
+	int values[NUM_RANGING_BROADCASTS];
+	for (uint8_t i=0; i<NUM_RANGING_BROADCASTS; i++) {
+		values[i] = (int) ((n + i*7919) % 4099) + 1000;
+	}
+	return oneway_range_percentile(values, NUM_RANGING_BROADCASTS);
+}
+
+// Walk a whole broadcast schedule the way the tag and anchors do
+static uint32_t bench_schedule (uint32_t n) {
+	const uint32_t masks[] = {ONEWAY_ALL_BROADCASTS_MASK,
+	                          ONEWAY_REQUIRED_BROADCASTS_MASK,
+	                          ONEWAY_TRACKING_BROADCASTS_MASK};
+	uint32_t mask = masks[n % 3];
+	uint32_t sum = 0;
+	for (uint8_t ss=0; ss<NUM_RANGING_BROADCASTS; ss=oneway_next_subsequence(mask, ss)) {
+		sum += oneway_subsequence_number_to_configuration(ss) +
+		       oneway_subsequence_number_to_channel_index(ss) +
+		       oneway_subsequence_position(mask, ss);
+	}
+	for (uint8_t window=0; window<NUM_RANGING_LISTENING_WINDOWS; window++) {
+		sum += oneway_get_ss_index_from_settings(n % NUM_ANTENNAS, window);
+	}
+	return sum;
+}
+
+// One glossy sync with a full history to fit
+static uint32_t bench_glossy_clock (uint32_t n) {
+	const uint64_t sync_dw = ((uint64_t) GLOSSY_UPDATE_INTERVAL_DW) << 8;
+	uint64_t local_time = 0x1000000000ULL + (n * sync_dw) + (n * sync_dw / 100000) + ((n * 7919) % 64);
+	glossy_clock_add_sync(n, n % 3, local_time);
+	uint64_t predicted;
+	glossy_clock_get_local_time(n + 1, &predicted);
+	return (uint32_t) predicted;
+}
+
+static uint32_t bench_track (uint32_t n) {
+	static oneway_range_track_t tracks[MAX_NUM_ANCHOR_RESPONSES];
+	ranging_event_t* event = &_events[n % _num_events];
+	int32_t ranges[MAX_NUM_ANCHOR_RESPONSES];
+	for (uint8_t i=0; i<event->num_responses; i++) {
+		ranges[i] = 3000 + ((n * 7 + i * 1000) % 5000);
+	}
+	oneway_range_track(tracks, ranges, event->responses, event->num_responses);
+	return ranges[0];
+}
+
+// The instruction limits are about 1.5x what an x86-64 gcc -O2 build
+// takes. The time limits have a lot more room since they depend on the
+// machine. The double reference is only there to compare against.
+static benchmark_t benchmarks[] = {
+	{"oneway_range_calculate_anchor", bench_calculate_anchor,             12000,  20000},
+	{"reference_calculate_anchor",    bench_reference_calculate_anchor,       0,      0},
+	{"oneway_anc_final_pack_unpack",  bench_anc_final_pack_unpack,         1500,   3000},
+	{"oneway_range_percentile",       bench_percentile,                    1800,   3000},
+	{"oneway_schedule_walk",          bench_schedule,                      4500,   5000},
+	{"glossy_clock_add_sync",         bench_glossy_clock,                   800,   2000},
+	{"oneway_range_track",            bench_track,                         1200,   3000},
+};
+
+// Count instructions in user space with the CPU's performance counters.
+// Returns -1 if they aren't available, like in most VMs.
+static int open_instruction_counter () {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now_ns () {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9) + ts.tv_nsec;
+}
+
+// Run all of the benchmarks. Returns the number that went over a limit.
+// Instruction limits are checked when the counters work, and time limits
+// only if check_time is set.
+static uint32_t run_benchmarks (uint32_t iterations, bool check_time) {
+	int counter = open_instruction_counter();
+	uint32_t failures = 0;
+	volatile uint32_t sink = 0;
+
+	printf("%-32s %12s %12s\n", "function", "ns/op", "instr/op");
+	for (uint8_t b=0; b<sizeof(benchmarks)/sizeof(benchmarks[0]); b++) {
+		benchmark_t* bench = &benchmarks[b];
+		uint32_t ops = iterations * _num_responses;
+
+		// Once to warm up the caches
+		for (uint32_t n=0; n<_num_responses; n++) {
+			sink += bench->op(n);
+		}
+
+		uint64_t instructions = 0;
+		if (counter >= 0) {
+			ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		double start = now_ns();
+		for (uint32_t n=0; n<ops; n++) {
+			sink += bench->op(n);
+		}
+		double ns_per_op = (now_ns() - start) / ops;
+		if (counter >= 0) {
+			ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(counter, &instructions, sizeof(instructions)) != sizeof(instructions)) {
+				instructions = 0;
+			}
+		}
+		double instructions_per_op = (double) instructions / ops;
+
+		bool slow = check_time && bench->max_ns > 0 && ns_per_op > bench->max_ns;
+		bool long_path = bench->max_instructions > 0 && instructions > 0 &&
+		                 instructions_per_op > bench->max_instructions;
+		if (counter >= 0 && instructions > 0) {
+			printf("%-32s %12.1f %12.1f", bench->name, ns_per_op, instructions_per_op);
+		} else {
+			printf("%-32s %12.1f %12s", bench->name, ns_per_op, "n/a");
+		}
+		if (slow || long_path) {
+			printf("  OVER LIMIT (%.0f ns, %.0f instr)", bench->max_ns, bench->max_instructions);
+			failures++;
+		}
+		printf("\n");
+	}
+
+	if (counter >= 0) {
+		close(counter);
+	}
+	return failures;
+}
+
+
+int main (int argc, char** argv) {
+	uint32_t iterations = DEFAULT_ITERATIONS;
+	int32_t tolerance_mm = DEFAULT_TOLERANCE_MM;
+	const char* truth_path = NULL;
+	bool check_time = FALSE;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:t:r:s")) != -1) {
+		switch (opt) {
+			case 'n': iterations = atoi(optarg); break;
+			case 't': tolerance_mm = atoi(optarg); break;
+			case 'r': truth_path = optarg; break;
+			case 's': check_time = TRUE; break;
+			default:
+				fprintf(stderr, "usage: %s [-n iterations] [-t tolerance_mm] [-r truth] [-s] dump...\n", argv[0]);
+				return 2;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-n iterations] [-t tolerance_mm] [-r truth] [-s] dump...\n", argv[0]);
+		return 2;
+	}
+
+	uint32_t bad = 0;
+	for (int i=optind; i<argc; i++) {
+		bad += load_dump(argv[i]);
+	}
+	if (bad > 0) {
+		printf("Skipped %u damaged packets\n", bad);
+	}
+	if (_num_responses == 0) {
+		fprintf(stderr, "No anchor responses in the dumps\n");
+		return 2;
+	}
+
+	uint32_t mismatches = check_ranges(tolerance_mm);
+
+	bool worse_estimate = FALSE;
+	if (truth_path != NULL) {
+		worse_estimate = score_estimate(load_truth(truth_path));
+	}
+
+	index_responses();
+	uint32_t failures = run_benchmarks(iterations, check_time);
+
+	if (mismatches > 0 || worse_estimate || failures > 0) {
+		printf("FAIL\n");
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
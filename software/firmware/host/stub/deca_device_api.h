@@ -0,0 +1,23 @@
+#ifndef __DECA_DEVICE_API_H
+#define __DECA_DEVICE_API_H
+
+// Just enough of the Decawave driver API for the range math to build on a
+// PC. The real one comes from the dw1000-driver submodule.
+
+typedef uint8_t  uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int32_t  int32;
+
+#define DWT_TIME_UNITS (1.0/499.2e6/128.0)
+
+typedef struct {
+	uint32 status;
+	uint16 datalength;
+	uint8  fctrl[2];
+	uint8  dblbuff;
+} dwt_callback_data_t;
+
+void dwt_forcetrxoff(void);
+
+#endif
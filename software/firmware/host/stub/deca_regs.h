@@ -0,0 +1 @@
+// The range math doesn't touch any DW1000 registers.
@@ -0,0 +1,11 @@
+#ifndef __STM32F0XX_H
+#define __STM32F0XX_H
+
+// The timer structs only need to exist for timer.h, nothing on the host
+// touches the hardware.
+
+typedef struct { uint32_t unused; } TIM_TypeDef;
+typedef struct { uint32_t unused; } NVIC_InitTypeDef;
+typedef struct { uint32_t unused; } TIM_TimeBaseInitTypeDef;
+
+#endif
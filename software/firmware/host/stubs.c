@@ -0,0 +1,56 @@
+// Everything oneway_common.c links against that needs the radio, the
+// timers or the host interface. None of it is used by the range math, so
+// these just stop the replay if something starts depending on them.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "oneway_common.h"
+#include "oneway_tag.h"
+#include "oneway_anchor.h"
+#include "host_interface.h"
+#include "firmware.h"
+
+static void not_on_host (const char* function) {
+	fprintf(stderr, "%s() needs the TriPoint hardware\n", function);
+	abort();
+}
+
+void dwt_forcetrxoff (void) { not_on_host(__func__); }
+
+void dw1000_set_profile (dw1000_profile_e profile) { (void) profile; not_on_host(__func__); }
+void dw1000_choose_antenna (uint8_t antenna_number) { (void) antenna_number; not_on_host(__func__); }
+uint64_t dw1000_get_tx_delay (uint8_t channel_index) { (void) channel_index; not_on_host(__func__); return 0; }
+uint64_t dw1000_get_rx_delay (uint8_t channel_index) { (void) channel_index; not_on_host(__func__); return 0; }
+dw1000_err_e dw1000_wakeup () { not_on_host(__func__); return DW1000_WAKEUP_ERR; }
+void dw1000_update_channel (uint8_t chan) { (void) chan; not_on_host(__func__); }
+
+void glossy_init (glossy_role_e role) { (void) role; not_on_host(__func__); }
+
+void host_interface_notify_ranges (uint8_t* anchor_ids_ranges, uint8_t len) {
+	(void) anchor_ids_ranges; (void) len; not_on_host(__func__);
+}
+void host_interface_notify_ranges_extended (uint8_t* anchor_ids_ranges, uint8_t len) {
+	(void) anchor_ids_ranges; (void) len; not_on_host(__func__);
+}
+void host_interface_notify_location (uint8_t* location, uint8_t len) {
+	(void) location; (void) len; not_on_host(__func__);
+}
+void host_interface_notify_blinks (uint8_t* blinks, uint8_t len) {
+	(void) blinks; (void) len; not_on_host(__func__);
+}
+
+void oneway_anchor_init (void *app_scratchspace) { (void) app_scratchspace; not_on_host(__func__); }
+dw1000_err_e oneway_anchor_start () { not_on_host(__func__); return DW1000_COMM_ERR; }
+void oneway_anchor_stop () { not_on_host(__func__); }
+void oneway_tag_init (void *app_scratchspace) { (void) app_scratchspace; not_on_host(__func__); }
+dw1000_err_e oneway_tag_start_ranging_event () { not_on_host(__func__); return DW1000_COMM_ERR; }
+void oneway_tag_stop () { not_on_host(__func__); }
+bool oneway_tag_set_anchor_location (uint8_t* anchor_addr, int32_t x_mm, int32_t y_mm, int32_t z_mm) {
+	(void) anchor_addr; (void) x_mm; (void) y_mm; (void) z_mm;
+	not_on_host(__func__);
+	return FALSE;
+}
+void oneway_tag_clear_anchor_locations () { not_on_host(__func__); }
+
+void polypoint_reset () { not_on_host(__func__); }
@@ -9,10 +9,15 @@
 #include "host_interface.h"
 #include "dw1000.h"
 #include "oneway_common.h"
+#include "twr.h"
 
-#define BUFFER_SIZE 128
-uint8_t rxBuffer[BUFFER_SIZE];
-uint8_t txBuffer[BUFFER_SIZE];
+// Big enough for an extended range report from every anchor, which is the
+// longest thing we send. The longest command we get is SET_LOCATION, at 21
+// bytes.
+#define TX_BUFFER_SIZE 192
+#define RX_BUFFER_SIZE 32
+uint8_t rxBuffer[RX_BUFFER_SIZE];
+uint8_t txBuffer[TX_BUFFER_SIZE];
 
 
 /* CPAL local transfer structures */
@@ -49,13 +54,13 @@ uint32_t host_interface_init () {
 
 	// Start CPAL communication configuration
 	// Initialize local Reception structures
-	rxStructure.wNumData = BUFFER_SIZE;   /* Maximum Number of data to be received */
+	rxStructure.wNumData = RX_BUFFER_SIZE; /* Maximum Number of data to be received */
 	rxStructure.pbBuffer = rxBuffer;      /* Common Rx buffer for all received data */
 	rxStructure.wAddr1 = 0;               /* Not needed */
 	rxStructure.wAddr2 = 0;               /* Not needed */
 
 	// Initialize local Transmission structures
-	txStructure.wNumData = BUFFER_SIZE;   /* Maximum Number of data to be received */
+	txStructure.wNumData = TX_BUFFER_SIZE; /* Maximum Number of data to be received */
 	txStructure.pbBuffer = txBuffer;      /* Common Rx buffer for all received data */
 	txStructure.wAddr1 = (I2C_OWN_ADDRESS << 1); /* The own board address */
 	txStructure.wAddr2 = 0;               /* Not needed */
@@ -97,6 +102,16 @@ static void interrupt_host_clear () {
 	GPIO_WriteBit(INTERRUPT_PORT, INTERRUPT_PIN, Bit_RESET);
 }
 
+// Get the ranging profile byte at idx of a WRITE that was rx_len bytes
+// long. Hosts that leave it off, or send one we don't know, get the
+// profile the firmware was built with.
+static dw1000_profile_e config_profile (uint8_t rx_len, uint8_t idx) {
+	if (idx >= rx_len || rxBuffer[idx] >= DW1000_NUM_PROFILES) {
+		return DW1000_DEFAULT_PROFILE;
+	}
+	return (dw1000_profile_e) rxBuffer[idx];
+}
+
 // Send to the tag the ranges.
 void host_interface_notify_ranges (uint8_t* anchor_ids_ranges, uint8_t len) {
 
@@ -111,6 +126,18 @@ void host_interface_notify_ranges (uint8_t* anchor_ids_ranges, uint8_t len) {
 	interrupt_host_set();
 }
 
+void host_interface_notify_ranges_extended (uint8_t* anchor_ids_ranges, uint8_t len) {
+	// TODO: this should be in an atomic block
+
+	// Save the relevant state for when the host asks for it
+	_interrupt_reason = HOST_IFACE_INTERRUPT_RANGES_EXTENDED;
+	_interrupt_buffer = anchor_ids_ranges;
+	_interrupt_buffer_len = len;
+
+	// Let the host know it should ask
+	interrupt_host_set();
+}
+
 void host_interface_notify_calibration (uint8_t* calibration_data, uint8_t len) {
 	// TODO: this should be in an atomic block
 
@@ -123,12 +150,36 @@ void host_interface_notify_calibration (uint8_t* calibration_data, uint8_t len)
 	interrupt_host_set();
 }
 
+void host_interface_notify_location (uint8_t* location, uint8_t len) {
+	// TODO: this should be in an atomic block
+
+	// Save the relevant state for when the host asks for it
+	_interrupt_reason = HOST_IFACE_INTERRUPT_LOCATION;
+	_interrupt_buffer = location;
+	_interrupt_buffer_len = len;
+
+	// Let the host know it should ask
+	interrupt_host_set();
+}
+
+void host_interface_notify_blinks (uint8_t* blinks, uint8_t len) {
+	// TODO: this should be in an atomic block
+
+	// Save the relevant state for when the host asks for it
+	_interrupt_reason = HOST_IFACE_INTERRUPT_BLINKS;
+	_interrupt_buffer = blinks;
+	_interrupt_buffer_len = len;
+
+	// Let the host know it should ask
+	interrupt_host_set();
+}
+
 // Doesn't block, but waits for an I2C master to initiate a WRITE.
 uint32_t host_interface_wait () {
 	uint32_t ret;
 
 	// Setup the buffer to receive the contents of the WRITE in
-	rxStructure.wNumData = BUFFER_SIZE;     // Maximum Number of data to be received
+	rxStructure.wNumData = RX_BUFFER_SIZE;  // Maximum Number of data to be received
 	rxStructure.pbBuffer = rxBuffer;        // Common Rx buffer for all received data
 
 	// Device is ready, not clear if this is needed
@@ -145,7 +196,7 @@ uint32_t host_interface_wait () {
 uint32_t host_interface_respond (uint8_t length) {
 	uint32_t ret;
 
-	if (length > BUFFER_SIZE) {
+	if (length > TX_BUFFER_SIZE) {
 		return CPAL_FAIL;
 	}
 
@@ -178,6 +229,10 @@ void host_interface_rx_fired () {
 		/**********************************************************************/
 		case HOST_CMD_CONFIG: {
 
+			// CPAL counts down wNumData as bytes arrive, so this is how
+			// long the CONFIG was. Get it before waiting again resets it.
+			uint8_t config_len = RX_BUFFER_SIZE - rxStructure.wNumData;
+
 			// Just go back to waiting for a WRITE after a config message
 			host_interface_wait();
 
@@ -213,7 +268,14 @@ void host_interface_rx_fired () {
 					oneway_config.report_mode = (config_tag & HOST_PKT_CONFIG_ONEWAY_TAG_RMODE_MASK) >> HOST_PKT_CONFIG_ONEWAY_TAG_RMODE_SHIFT;
 					oneway_config.update_mode = (config_tag & HOST_PKT_CONFIG_ONEWAY_TAG_UMODE_MASK) >> HOST_PKT_CONFIG_ONEWAY_TAG_UMODE_SHIFT;
 					oneway_config.sleep_mode  = (config_tag & HOST_PKT_CONFIG_ONEWAY_TAG_SLEEP_MASK) >> HOST_PKT_CONFIG_ONEWAY_TAG_SLEEP_SHIFT;
+					oneway_config.filter_ranges = (config_tag & HOST_PKT_CONFIG_ONEWAY_TAG_FILTER_MASK) >> HOST_PKT_CONFIG_ONEWAY_TAG_FILTER_SHIFT;
+					oneway_config.extended_ranges = (config_tag & HOST_PKT_CONFIG_ONEWAY_TAG_EXTRNG_MASK) >> HOST_PKT_CONFIG_ONEWAY_TAG_EXTRNG_SHIFT;
+					oneway_config.blink_mode = (config_tag & HOST_PKT_CONFIG_ONEWAY_TAG_BLINK_MASK) >> HOST_PKT_CONFIG_ONEWAY_TAG_BLINK_SHIFT;
+					oneway_config.adaptive_broadcasts = (config_tag & HOST_PKT_CONFIG_ONEWAY_TAG_ADAPT_MASK) >> HOST_PKT_CONFIG_ONEWAY_TAG_ADAPT_SHIFT;
 					oneway_config.update_rate = rxBuffer[3];
+					oneway_config.profile = config_profile(config_len, HOST_PKT_CONFIG_ONEWAY_TAG_PROFILE_IDX);
+				} else {
+					oneway_config.profile = config_profile(config_len, HOST_PKT_CONFIG_ONEWAY_ANCHOR_PROFILE_IDX);
 				}
 
 				// Now that we know how we should operate,
@@ -228,6 +290,15 @@ void host_interface_rx_fired () {
 				//cal_config.index = rxBuffer[2];
 				//polypoint_configure_app(my_app, &cal_config);
 				//polypoint_start();
+
+			} else if (my_app == APP_TWR) {
+				// Range with one anchor at a time when the host asks. Tags
+				// and anchors only need the profile.
+				twr_config_t twr_config;
+				twr_config.my_role = my_role;
+				twr_config.profile = config_profile(config_len, HOST_PKT_CONFIG_TWR_PROFILE_IDX);
+				polypoint_configure_app(my_app, &twr_config);
+				polypoint_start();
 			}
 
 			break;
@@ -243,8 +314,9 @@ void host_interface_rx_fired () {
 			// after getting a sleep command
 			host_interface_wait();
 
-			// Tell the application to perform a range
-			polypoint_tag_do_range();
+			// Tell the application to perform a range. Apps that range
+			// with one anchor take its EUI after the opcode.
+			polypoint_tag_do_range(rxBuffer+1);
 			break;
 
 		/**********************************************************************/
@@ -271,6 +343,31 @@ void host_interface_rx_fired () {
 			polypoint_start();
 			break;
 
+		/**********************************************************************/
+		// Tell a tag where an anchor is, so it can calculate its location.
+		/**********************************************************************/
+		case HOST_CMD_SET_LOCATION: {
+			// Keep listening for the next command.
+			host_interface_wait();
+
+			// An all 0xFF EUI means forget every anchor location.
+			uint8_t i;
+			for (i=0; i<EUI_LEN; i++) {
+				if (rxBuffer[1+i] != 0xFF) break;
+			}
+			if (i == EUI_LEN) {
+				polypoint_tag_clear_anchor_locations();
+				break;
+			}
+
+			int32_t x_mm, y_mm, z_mm;
+			memcpy(&x_mm, rxBuffer+1+EUI_LEN, sizeof(int32_t));
+			memcpy(&y_mm, rxBuffer+1+EUI_LEN+4, sizeof(int32_t));
+			memcpy(&z_mm, rxBuffer+1+EUI_LEN+8, sizeof(int32_t));
+			polypoint_tag_set_anchor_location(rxBuffer+1, x_mm, y_mm, z_mm);
+			break;
+		}
+
 		/**********************************************************************/
 		// These are handled from the interrupt context.
 		/**********************************************************************/
@@ -381,6 +478,7 @@ void CPAL_I2C_RXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct) {
 		case HOST_CMD_DO_RANGE:
 		case HOST_CMD_SLEEP:
 		case HOST_CMD_RESUME:
+		case HOST_CMD_SET_LOCATION:
 
 			// Just go back to waiting for a WRITE after a config message
 			host_interface_wait();
@@ -26,11 +26,27 @@
 #define HOST_PKT_CONFIG_ONEWAY_TAG_UMODE_SHIFT  1
 #define HOST_PKT_CONFIG_ONEWAY_TAG_SLEEP_MASK   0x08
 #define HOST_PKT_CONFIG_ONEWAY_TAG_SLEEP_SHIFT  3
+#define HOST_PKT_CONFIG_ONEWAY_TAG_FILTER_MASK  0x10
+#define HOST_PKT_CONFIG_ONEWAY_TAG_FILTER_SHIFT 4
+#define HOST_PKT_CONFIG_ONEWAY_TAG_EXTRNG_MASK  0x20
+#define HOST_PKT_CONFIG_ONEWAY_TAG_EXTRNG_SHIFT 5
+#define HOST_PKT_CONFIG_ONEWAY_TAG_BLINK_MASK   0x40
+#define HOST_PKT_CONFIG_ONEWAY_TAG_BLINK_SHIFT  6
+#define HOST_PKT_CONFIG_ONEWAY_TAG_ADAPT_MASK   0x80
+#define HOST_PKT_CONFIG_ONEWAY_TAG_ADAPT_SHIFT  7
+
+// Where the ranging profile is in a CONFIG packet
+#define HOST_PKT_CONFIG_ONEWAY_TAG_PROFILE_IDX    4
+#define HOST_PKT_CONFIG_ONEWAY_ANCHOR_PROFILE_IDX 2
+#define HOST_PKT_CONFIG_TWR_PROFILE_IDX           2
 
 // Defines for identifying data sent to host
 typedef enum {
 	HOST_IFACE_INTERRUPT_RANGES = 0x01,
 	HOST_IFACE_INTERRUPT_CALIBRATION = 0x02,
+	HOST_IFACE_INTERRUPT_LOCATION = 0x03,
+	HOST_IFACE_INTERRUPT_RANGES_EXTENDED = 0x04,
+	HOST_IFACE_INTERRUPT_BLINKS = 0x05,
 } interrupt_reason_e;
 
 
@@ -38,7 +54,10 @@ uint32_t host_interface_init();
 uint32_t host_interface_wait ();
 uint32_t host_interface_respond (uint8_t length);
 void host_interface_notify_ranges (uint8_t* anchor_ids_ranges, uint8_t len);
+void host_interface_notify_ranges_extended (uint8_t* anchor_ids_ranges, uint8_t len);
 void host_interface_notify_calibration (uint8_t* calibration_data, uint8_t len);
+void host_interface_notify_location (uint8_t* location, uint8_t len);
+void host_interface_notify_blinks (uint8_t* blinks, uint8_t len);
 
 
 // Interrupt callbacks
@@ -12,6 +12,7 @@
 #include "oneway_common.h"
 #include "oneway_tag.h"
 #include "oneway_anchor.h"
+#include "twr.h"
 #include "timer.h"
 #include "delay.h"
 #include "firmware.h"
@@ -60,6 +61,7 @@ static void error () {
 union app_scratchspace {
 	oneway_tag_scratchspace_struct ot_scratch;
 	oneway_anchor_scratchspace_struct oa_scratch;
+	twr_scratchspace_struct tw_scratch;
 } _app_scratchspace;
 
 /******************************************************************************/
@@ -91,6 +93,10 @@ void polypoint_configure_app (polypoint_application_e app, void* app_config) {
 			oneway_configure((oneway_config_t*) app_config, NULL, (void*)&_app_scratchspace);
 			break;
 
+		case APP_TWR:
+			twr_configure((twr_config_t*) app_config, (void*)&_app_scratchspace);
+			break;
+
 		default:
 			break;
 	}
@@ -117,6 +123,12 @@ void polypoint_start () {
 			oneway_start();
 			break;
 
+		case APP_TWR:
+			if (twr_start() == DW1000_WAKEUP_ERR) {
+				polypoint_reset();
+			}
+			break;
+
 		default:
 			break;
 	}
@@ -136,6 +148,10 @@ void polypoint_stop () {
 			oneway_stop();
 			break;
 
+		case APP_TWR:
+			twr_stop();
+			break;
+
 		default:
 			break;
 	}
@@ -167,6 +183,10 @@ void polypoint_reset () {
 			oneway_reset();
 			break;
 
+		case APP_TWR:
+			twr_reset();
+			break;
+
 		default:
 			break;
 	}
@@ -183,8 +203,9 @@ bool polypoint_ready () {
 }
 
 // Assuming we are a TAG, and we are in on-demand ranging mode, tell
-// the dw1000 algorithm to perform a range.
-void polypoint_tag_do_range () {
+// the dw1000 algorithm to perform a range. anchor_addr is the anchor to
+// range with, for the apps that range with one anchor at a time.
+void polypoint_tag_do_range (uint8_t* anchor_addr) {
 	// If the application isn't running, we are not a tag, or we are not
 	// in on-demand ranging mode, don't do anything.
 	if (_state != APPSTATE_RUNNING) {
@@ -197,6 +218,10 @@ void polypoint_tag_do_range () {
 			oneway_do_range();
 			break;
 
+		case APP_TWR:
+			twr_do_range(anchor_addr);
+			break;
+
 		case APP_CALIBRATION:
 			// Not a thing for this app
 			break;
@@ -206,6 +231,21 @@ void polypoint_tag_do_range () {
 	}
 }
 
+// Tell a oneway TAG where an anchor is. The tag keeps the anchor locations
+// in the app scratchspace, so they have to be sent again after every
+// CONFIG.
+void polypoint_tag_set_anchor_location (uint8_t* anchor_addr, int32_t x_mm, int32_t y_mm, int32_t z_mm) {
+	if (_current_app == APP_ONEWAY) {
+		oneway_set_anchor_location(anchor_addr, x_mm, y_mm, z_mm);
+	}
+}
+
+void polypoint_tag_clear_anchor_locations () {
+	if (_current_app == APP_ONEWAY) {
+		oneway_clear_anchor_locations();
+	}
+}
+
 
 /******************************************************************************/
 // Connection for the anchor/tag code to talk to the main applications
@@ -337,6 +377,11 @@ int main () {
 	config.update_mode = ONEWAY_UPDATE_MODE_PERIODIC;
 	config.update_rate = 10;
 	config.sleep_mode = FALSE;
+	config.filter_ranges = FALSE;
+	config.extended_ranges = FALSE;
+	config.blink_mode = FALSE;
+	config.adaptive_broadcasts = FALSE;
+	config.profile = DW1000_DEFAULT_PROFILE;
 	polypoint_configure_app(APP_ONEWAY, &config);
 	polypoint_start();
 #endif
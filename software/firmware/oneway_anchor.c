@@ -6,12 +6,20 @@
 
 #include "oneway_common.h"
 #include "oneway_anchor.h"
+#include "oneway_range.h"
 #include "dw1000.h"
 #include "timer.h"
 #include "delay.h"
 #include "firmware.h"
 
 static void ranging_listening_window_setup();
+static bool response_can_give_range(oneway_anchor_tag_session_t* session);
+static oneway_anchor_tag_session_t* find_session(uint8_t* tag_addr);
+static void start_session(oneway_anchor_tag_session_t* session, struct pp_tag_poll* rx_poll_pkt, uint64_t dw_rx_timestamp);
+static void record_poll(oneway_anchor_tag_session_t* session, uint8_t subseq_num, uint64_t dw_rx_timestamp);
+static void record_blink(struct pp_blink* blink, uint64_t dw_rx_timestamp);
+static void flush_blinks();
+static void handle_group_ack(struct pp_group_ack* ack, uint16_t len);
 static void anchor_txcallback (const dwt_callback_data_t *txd);
 static void anchor_rxcallback (const dwt_callback_data_t *rxd);
 
@@ -21,10 +29,10 @@ void oneway_anchor_init (void *app_scratchspace) {
 	oa_scratch = (oneway_anchor_scratchspace_struct*) app_scratchspace;
 	
 	// Initialize this app's scratchspace
-	oa_scratch->pp_anc_final_pkt = (struct pp_anc_final) {
+	struct pp_anc_final anc_final_init = (struct pp_anc_final) {
 		.ieee154_header_unicast = {
 			.frameCtrl = {
-				0x61, // FCF[0]: data frame, ack request, panid compression
+				0x41, // FCF[0]: data frame, panid compression
 				0xCC  // FCF[1]: ext source, ext destination
 			},
 			.seqNum = 0,
@@ -40,6 +48,12 @@ void oneway_anchor_init (void *app_scratchspace) {
 		.dw_time_sent  = 0,
 		.TOAs          = { 0 },
 	};
+	dw1000_read_eui(anc_final_init.ieee154_header_unicast.sourceAddr);
+	for (uint8_t i=0; i<ONEWAY_ANCHOR_MAX_TAG_SESSIONS; i++) {
+		oa_scratch->sessions[i].pp_anc_final_pkt = anc_final_init;
+		oa_scratch->sessions[i].in_use = FALSE;
+		oa_scratch->sessions[i].tx_buffer_offset = ONEWAY_ANCHOR_TX_BUFFER_SESSION_OFFSET(i);
+	}
 
 	// Make sure the SPI speed is slow for this function
 	dw1000_spi_slow();
@@ -50,8 +64,9 @@ void oneway_anchor_init (void *app_scratchspace) {
 	// Make sure the radio starts off
 	dwt_forcetrxoff();
 
-	// Set the anchor so it only receives data and ack packets
-	dwt_enableframefilter(DWT_FF_DATA_EN | DWT_FF_ACK_EN);
+	// Set the anchor so it only receives data packets. Tags ACK with a
+	// broadcast group ACK.
+	dwt_enableframefilter(DWT_FF_DATA_EN);
 
 	// // Set the ID and PAN ID for this anchor
 	uint8_t eui_array[8];
@@ -66,17 +81,20 @@ void oneway_anchor_init (void *app_scratchspace) {
 	dwt_setdblrxbuffmode(FALSE);
 	dwt_setrxtimeout(FALSE);
 
-	// Load our EUI into the outgoing packet
-	dw1000_read_eui(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.sourceAddr);
-
 	// Need a timer
 	if (oa_scratch->anchor_timer == NULL) {
 		oa_scratch->anchor_timer = timer_init();
 	}
 
+	// Nothing is waiting to go to the host yet
+	oa_scratch->blink_count = 0;
+
 	// Init the PRNG for determining when to respond to the tag
 	raninit(&(oa_scratch->prng_state), eui_array[0]<<8|eui_array[1]);
 
+	// Ask the glossy master for our own slot to respond to tags in
+	lwb_set_anchor_slot_request(TRUE);
+
 	// Make SPI fast now that everything has been setup
 	dw1000_spi_fast();
 
@@ -110,7 +128,10 @@ dw1000_err_e oneway_anchor_start () {
 	// Obviously we want to be able to receive packets
 	dwt_rxenable(0);
 
-	oa_scratch->final_ack_received = FALSE;
+	// No tags yet
+	for (uint8_t i=0; i<ONEWAY_ANCHOR_MAX_TAG_SESSIONS; i++) {
+		oa_scratch->sessions[i].in_use = FALSE;
+	}
 
 	return DW1000_NO_ERR;
 }
@@ -129,13 +150,21 @@ void oneway_anchor_stop () {
 	dw1000_sleep();
 }
 
+// How many ranging events we didn't respond to because the tag couldn't
+// have gotten a range from us
+uint32_t oneway_anchor_get_responses_suppressed () {
+	return oa_scratch->responses_suppressed;
+}
+
 // This is called by the periodic timer that tracks the tag's periodic
 // broadcast ranging poll messages. This is responsible for setting the
 // antenna and channel properties for the anchor.
 static void ranging_broadcast_subsequence_task () {
 	// When this timer is called it is time to start a new subsequence
-	// slot, so we must increment our counter
-	oa_scratch->ranging_broadcast_ss_num++;
+	// slot, so move on to the next one the tag is sending
+	oa_scratch->ranging_broadcast_ss_num =
+		oneway_next_subsequence(oa_scratch->sessions[0].broadcast_mask,
+		                        oa_scratch->ranging_broadcast_ss_num);
 
 	// Check if we are done listening for packets from the TAG. If we get
 	// a packet on the last subsequence we won't get here, but if we
@@ -156,9 +185,10 @@ static void ranging_broadcast_subsequence_task () {
 // the tag.
 static void ranging_listening_window_task () {
 	// Check if we are done transmitting to the tag.
-	// Ideally we never get here, as an ack from the tag will cause us to stop
-	// cycling through listening windows and put us back into a ready state.
-	if (oa_scratch->ranging_listening_window_num == NUM_RANGING_CHANNELS) {
+	// Ideally we never get here, as a group ACK from the tag will cause us to
+	// stop cycling through listening windows and put us back into a ready
+	// state.
+	if (oa_scratch->ranging_listening_window_num == oa_scratch->ranging_operation_config.reply_windows) {
 		// Go back to IDLE
 		oa_scratch->state = ASTATE_IDLE;
 		// Stop the timer for the window
@@ -169,27 +199,56 @@ static void ranging_listening_window_task () {
 
 	} else {
 
-		if(!oa_scratch->final_ack_received){
+		// We only get one packet out per window, so take turns between the
+		// tags that haven't listed us in a group ACK yet. With one tag this
+		// is every window until it does.
+		oneway_anchor_tag_session_t* session = NULL;
+		for (uint8_t i=0; i<ONEWAY_ANCHOR_MAX_TAG_SESSIONS; i++) {
+			uint8_t session_index = (oa_scratch->ranging_listening_window_num + i) % ONEWAY_ANCHOR_MAX_TAG_SESSIONS;
+			if (oa_scratch->sessions[session_index].in_use &&
+			    !oa_scratch->sessions[session_index].final_ack_received) {
+				session = &(oa_scratch->sessions[session_index]);
+				break;
+			}
+		}
+
+		if(session != NULL){
 
 			dwt_forcetrxoff();
 	
 			// Setup the channel and antenna settings
 			oneway_set_ranging_listening_window_settings(ANCHOR,
 			                                             oa_scratch->ranging_listening_window_num,
-			                                             oa_scratch->pp_anc_final_pkt.final_antenna);
+			                                             session->pp_anc_final_pkt.final_antenna);
 	
-			// Prepare the outgoing packet to send back to the
-			// tag with our TOAs.
-			oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.seqNum = ranval(&(oa_scratch->prng_state)) & 0xFF;
-			const uint16_t frame_len = sizeof(struct pp_anc_final);
-			// const uint16_t frame_len = sizeof(struct pp_anc_final) - (sizeof(uint64_t)*NUM_RANGING_BROADCASTS);
-			dwt_writetxfctrl(frame_len, 0);
+			// The outgoing packet to the tag with our TOAs is already in the
+			// TX buffer. Only the sequence number and, once we know it, the
+			// send time change between windows.
+			session->pp_anc_final_compact_pkt.ieee154_header_unicast.seqNum = ranval(&(oa_scratch->prng_state)) & 0xFF;
+			dwt_writetodevice(TX_BUFFER_ID,
+			                  session->tx_buffer_offset + offsetof(struct ieee154_header_unicast, seqNum),
+			                  1,
+			                  &(session->pp_anc_final_compact_pkt.ieee154_header_unicast.seqNum));
+			const uint16_t frame_len = session->anc_final_compact_len;
+			dwt_writetxfctrl(frame_len, session->tx_buffer_offset);
 	
-			// Pick a slot to respond in. Generate a random number and mod it
-			// by the number of slots
-			uint32_t slot_time = ranval(&(oa_scratch->prng_state)) % (oa_scratch->ranging_operation_config.anchor_reply_window_in_us -
-			                                                           dw1000_packet_data_time_in_us(frame_len) -
-			                                                           dw1000_preamble_time_in_us());
+			// Respond in the slot the glossy master gave us. If we don't have
+			// one yet, or it doesn't fit in the tag's window, pick a random
+			// time in the window instead.
+			uint32_t packet_time = dw1000_packet_data_time_in_us(frame_len) + dw1000_preamble_time_in_us();
+			uint32_t slot_time;
+			uint8_t anchor_slot;
+			if (glossy_get_anchor_slot(&anchor_slot) &&
+			    oa_scratch->ranging_operation_config.anchor_reply_slot_time_in_us >= packet_time &&
+			    ((uint32_t) (anchor_slot+1))*oa_scratch->ranging_operation_config.anchor_reply_slot_time_in_us <=
+			    oa_scratch->ranging_operation_config.anchor_reply_window_in_us) {
+				slot_time = anchor_slot*oa_scratch->ranging_operation_config.anchor_reply_slot_time_in_us;
+			} else if (oa_scratch->ranging_operation_config.anchor_reply_window_in_us <= packet_time) {
+				slot_time = 0;
+			} else {
+				slot_time = ranval(&(oa_scratch->prng_state)) % (oa_scratch->ranging_operation_config.anchor_reply_window_in_us -
+				                                                  packet_time);
+			}
 	
 			dwt_setrxaftertxdelay(1);
 	
@@ -205,22 +264,226 @@ static void ranging_listening_window_task () {
 	
 			// Record the outgoing time in the packet. Do not take calibration into
 			// account here, as that is done on all of the RX timestamps.
-			oa_scratch->pp_anc_final_pkt.dw_time_sent = (((uint64_t) delay_time) << 8) + dw1000_gettimestampoverflow() + oneway_get_txdelay_from_ranging_listening_window(oa_scratch->ranging_listening_window_num);
+			uint64_t dw_time_sent = (((uint64_t) delay_time) << 8) + dw1000_gettimestampoverflow() + oneway_get_txdelay_from_ranging_listening_window(oa_scratch->ranging_listening_window_num);
+			memcpy(session->pp_anc_final_compact_pkt.dw_time_sent, &dw_time_sent, ANC_FINAL_COMPACT_TIMESTAMP_LEN);
+			dwt_writetodevice(TX_BUFFER_ID,
+			                  session->tx_buffer_offset + offsetof(struct pp_anc_final_compact, dw_time_sent),
+			                  ANC_FINAL_COMPACT_TIMESTAMP_LEN,
+			                  session->pp_anc_final_compact_pkt.dw_time_sent);
 	
 			// Send the response packet
 			// TODO: handle if starttx errors. I'm not sure what to do about it,
 			//       other than just wait for the next slot.
 			dwt_starttx(DWT_START_TX_DELAYED | DWT_RESPONSE_EXPECTED);
 			dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
-			dwt_writetxdata(frame_len, (uint8_t*) &(oa_scratch->pp_anc_final_pkt), 0);
 		}
 
 		oa_scratch->ranging_listening_window_num++;
 	}
 }
 
+// Find the session for a tag, or a free one if tag_addr is NULL. Returns
+// NULL if there isn't one.
+static oneway_anchor_tag_session_t* find_session (uint8_t* tag_addr) {
+	for (uint8_t i=0; i<ONEWAY_ANCHOR_MAX_TAG_SESSIONS; i++) {
+		oneway_anchor_tag_session_t* session = &(oa_scratch->sessions[i]);
+		if (tag_addr == NULL) {
+			if (!session->in_use) return session;
+		} else if (session->in_use &&
+		           memcmp(session->pp_anc_final_pkt.ieee154_header_unicast.destAddr, tag_addr, EUI_LEN) == 0) {
+			return session;
+		}
+	}
+	return NULL;
+}
+
+// A tag sent a group ACK. If we are on it, that tag has our response and
+// we don't send it again. Once every tag has it we are done responding.
+static void handle_group_ack (struct pp_group_ack* ack, uint16_t len) {
+	oneway_anchor_tag_session_t* session = find_session(ack->header.sourceAddr);
+	if (session == NULL) {
+		return;
+	}
+
+	// Make sure the packet was really long enough for all of the ids
+	uint8_t num_anchors = ack->num_anchors;
+	if (num_anchors > ONEWAY_GROUP_ACK_MAX_EUIS ||
+	    offsetof(struct pp_group_ack, anchor_ids) + (num_anchors*EUI_LEN) +
+	    sizeof(struct ieee154_footer) > len) {
+		return;
+	}
+
+	// Look for ourselves by the reply slot we told the tag, or by our whole
+	// EUI if we didn't have one.
+	uint8_t reply_slot = session->pp_anc_final_compact_pkt.reply_slot;
+	if (reply_slot != ONEWAY_NO_REPLY_SLOT) {
+		if (ack->slot_mask & (1 << reply_slot)) {
+			session->final_ack_received = TRUE;
+		}
+	} else {
+		for (uint8_t i=0; i<num_anchors; i++) {
+			if (memcmp(ack->anchor_ids[i],
+			           session->pp_anc_final_pkt.ieee154_header_unicast.sourceAddr,
+			           EUI_LEN) == 0) {
+				session->final_ack_received = TRUE;
+				break;
+			}
+		}
+	}
+
+	for (uint8_t i=0; i<ONEWAY_ANCHOR_MAX_TAG_SESSIONS; i++) {
+		if (oa_scratch->sessions[i].in_use &&
+		    !oa_scratch->sessions[i].final_ack_received) {
+			return;
+		}
+	}
+
+	// Nothing left to send, so go back to waiting for polls
+	oa_scratch->state = ASTATE_IDLE;
+	timer_stop(oa_scratch->anchor_timer);
+	oneway_anchor_start();
+}
+
+// Start keeping track of a tag from the first poll we heard from it
+static void start_session (oneway_anchor_tag_session_t* session,
+                           struct pp_tag_poll* rx_poll_pkt,
+                           uint64_t dw_rx_timestamp) {
+	session->in_use = TRUE;
+	session->final_ack_received = FALSE;
+	session->broadcast_mask = rx_poll_pkt->broadcast_mask;
+	session->tracking = rx_poll_pkt->tracking;
+	session->staged_toas = 0;
+
+	// Clear memory for this new tag ranging event
+	memset(session->pp_anc_final_pkt.TOAs, 0, sizeof(session->pp_anc_final_pkt.TOAs));
+	memset(session->anchor_antenna_recv_num, 0, sizeof(session->anchor_antenna_recv_num));
+
+	// Record the EUI of the tag so that we don't get mixed up
+	memcpy(session->pp_anc_final_pkt.ieee154_header_unicast.destAddr, rx_poll_pkt->header.sourceAddr, EUI_LEN);
+
+	// Record the timestamp. Need to subtract off the TX+RX delay from each recorded
+	// timestamp.
+	session->pp_anc_final_pkt.first_rxd_toa = dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, rx_poll_pkt->subsequence);
+	session->pp_anc_final_pkt.first_rxd_idx = rx_poll_pkt->subsequence;
+	session->pp_anc_final_pkt.last_rxd_idx = rx_poll_pkt->subsequence;
+	record_poll(session, rx_poll_pkt->subsequence, dw_rx_timestamp);
+}
+
+// Record when a poll from a tag arrived
+static void record_poll (oneway_anchor_tag_session_t* session,
+                         uint8_t subseq_num,
+                         uint64_t dw_rx_timestamp) {
+	uint64_t toa = dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, subseq_num);
+	uint16_t toa_low = toa & 0xFFFF;
+	session->pp_anc_final_pkt.TOAs[subseq_num] = toa_low;
+
+	// Polls arrive in order, so each new one goes right after the TOAs
+	// already in the TX buffer. This writes the last poll's TOA as well,
+	// but the frame length set when responding leaves it off. A TOA of 0
+	// reads as a missed poll, so those are left out like the compact
+	// packing does.
+	if (subseq_num > session->pp_anc_final_pkt.last_rxd_idx && toa_low != 0) {
+		dwt_writetodevice(TX_BUFFER_ID,
+		                  session->tx_buffer_offset + offsetof(struct pp_anc_final_compact, TOAs) +
+		                  (session->staged_toas*sizeof(uint16_t)),
+		                  sizeof(uint16_t),
+		                  (uint8_t*) &toa_low);
+		session->staged_toas++;
+	}
+
+	session->pp_anc_final_pkt.last_rxd_toa = toa;
+	session->pp_anc_final_pkt.last_rxd_idx = subseq_num;
+
+	// Update the statistics we keep about which antenna
+	// receives the most packets from the tag
+	uint8_t recv_antenna_index = oneway_subsequence_number_to_antenna(ANCHOR, subseq_num);
+	session->anchor_antenna_recv_num[recv_antenna_index]++;
+}
+
+// Check if the tag could get a range out of the polls we heard. It needs
+// MIN_VALID_RANGES_PER_ANCHOR of them, and two on the same channel far
+// enough apart to work out the clock skew. How far apart depends on how
+// many broadcasts the tag sent in between. Tracking events already know
+// the skew, so only need a couple of polls.
+static bool response_can_give_range (oneway_anchor_tag_session_t* session) {
+	uint8_t num_polls = 0;
+	uint8_t first_idx[NUM_RANGING_CHANNELS];
+	uint8_t last_idx[NUM_RANGING_CHANNELS];
+	bool heard_channel[NUM_RANGING_CHANNELS] = { FALSE };
+
+	for (uint8_t i=0; i<NUM_RANGING_BROADCASTS; i++) {
+		// A TOA of 0 means we didn't get this poll
+		if (session->pp_anc_final_pkt.TOAs[i] == 0) {
+			continue;
+		}
+		num_polls++;
+
+		uint8_t channel_index = oneway_subsequence_number_to_channel_index(i);
+		if (!heard_channel[channel_index]) {
+			first_idx[channel_index] = i;
+			heard_channel[channel_index] = TRUE;
+		}
+		last_idx[channel_index] = i;
+	}
+
+	if (session->tracking) {
+		return num_polls >= MIN_VALID_RANGES_PER_ANCHOR_TRACKING;
+	}
+
+	if (num_polls < MIN_VALID_RANGES_PER_ANCHOR) {
+		return FALSE;
+	}
+
+	for (uint8_t i=0; i<NUM_RANGING_CHANNELS; i++) {
+		if (!heard_channel[i]) continue;
+		uint8_t span = oneway_subsequence_position(session->broadcast_mask, last_idx[i]) -
+		               oneway_subsequence_position(session->broadcast_mask, first_idx[i]);
+		if ((uint32_t)span*RANGING_BROADCASTS_PERIOD_US >= ONEWAY_RANGE_MIN_SKEW_SPAN_US) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// Save when we got a blink, in glossy time so the host can compare it
+// with the other anchors. Blinks come in on the channel the anchors
+// wait for polls on, which is subsequence 0.
+static void record_blink (struct pp_blink* blink, uint64_t dw_rx_timestamp) {
+	uint32_t sync_num;
+	uint64_t sync_time;
+	if (!glossy_get_sync_time(dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, 0), &sync_num, &sync_time)) {
+		// Without sync the timestamp means nothing to anyone else
+		return;
+	}
+
+	// Keep each batch to one sync so the host doesn't wait long for them
+	if (oa_scratch->blink_count > 0 && oa_scratch->blinks[0].sync_num != sync_num) {
+		flush_blinks();
+	}
+
+	oneway_blink_t* rec = &(oa_scratch->blinks[oa_scratch->blink_count]);
+	memcpy(rec->tag_addr, blink->header.sourceAddr, EUI_LEN);
+	rec->blink_seq = blink->header.seqNum;
+	rec->blink_idx = blink->blink_idx;
+	rec->sync_num  = sync_num;
+	rec->sync_time = sync_time;
+	oa_scratch->blink_count++;
+
+	if (oa_scratch->blink_count == MAX_NUM_BLINKS_PER_BATCH) {
+		flush_blinks();
+	}
+}
+
+// Hand the blinks we have to the host
+static void flush_blinks () {
+	if (oa_scratch->blink_count == 0) {
+		return;
+	}
+	oneway_set_blinks(oa_scratch->blink_report, oa_scratch->blinks, oa_scratch->blink_count);
+	oa_scratch->blink_count = 0;
+}
+
 // Prepare to transmit a response to the TAG.
-// TODO: check to see if we should even bother. Did we get enough packets?
 static void ranging_listening_window_setup () {
 	// Stop iterating through timing channels
 	timer_stop(oa_scratch->anchor_timer);
@@ -229,28 +492,68 @@ static void ranging_listening_window_setup () {
 	// start transmitting.
 	dwt_forcetrxoff();
 
+	bool responding = FALSE;
+	for (uint8_t s=0; s<ONEWAY_ANCHOR_MAX_TAG_SESSIONS; s++) {
+		oneway_anchor_tag_session_t* session = &(oa_scratch->sessions[s]);
+		if (!session->in_use) {
+			continue;
+		}
+
+		// Don't bother responding if the tag would just throw it out. That
+		// leaves the listening windows for anchors that can be ranged to.
+		if (!response_can_give_range(session)) {
+			oa_scratch->responses_suppressed++;
+			session->in_use = FALSE;
+			continue;
+		}
+		responding = TRUE;
+
+		// Determine which antenna we are going to use for
+		// the response.
+		uint8_t max_packets = 0;
+		uint8_t max_index = 0;
+		for (uint8_t i=0; i<NUM_ANTENNAS; i++) {
+			if (session->anchor_antenna_recv_num[i] > max_packets) {
+				max_packets = session->anchor_antenna_recv_num[i];
+				max_index = i;
+			}
+		}
+		session->pp_anc_final_pkt.final_antenna = max_index;
+
+		// Everything but the send time and sequence number is known now, so
+		// pack the response once for all of the windows. The TOAs are
+		// already in the TX buffer, so only write what comes before them.
+		session->anc_final_compact_len = oneway_anc_final_compact_pack(&(session->pp_anc_final_pkt),
+		                                                               &(session->pp_anc_final_compact_pkt));
+
+		// Tags list us in their group ACKs by our reply slot, if we have one
+		uint8_t anchor_slot;
+		if (glossy_get_anchor_slot(&anchor_slot)) {
+			session->pp_anc_final_compact_pkt.reply_slot = anchor_slot;
+		}
+		dwt_writetodevice(TX_BUFFER_ID,
+		                  session->tx_buffer_offset,
+		                  offsetof(struct pp_anc_final_compact, TOAs),
+		                  (uint8_t*) &(session->pp_anc_final_compact_pkt));
+		session->final_ack_received = FALSE;
+	}
+
+	if (!responding) {
+		oa_scratch->state = ASTATE_IDLE;
+		oneway_anchor_start();
+		return;
+	}
+
 	// Update our state to the TX response state
 	oa_scratch->state = ASTATE_RESPONDING;
 	// Set the listening window index
 	oa_scratch->ranging_listening_window_num = 0;
 
-	// Determine which antenna we are going to use for
-	// the response.
-	uint8_t max_packets = 0;
-	uint8_t max_index = 0;
-	for (uint8_t i=0; i<NUM_ANTENNAS; i++) {
-		if (oa_scratch->anchor_antenna_recv_num[i] > max_packets) {
-			max_packets = oa_scratch->anchor_antenna_recv_num[i];
-			max_index = i;
-		}
-	}
-	oa_scratch->pp_anc_final_pkt.final_antenna = max_index;
-
 	// Now we need to setup a timer to iterate through
 	// the response windows so we can send a packet
 	// back to the tag
 	timer_start(oa_scratch->anchor_timer,
-	            oa_scratch->ranging_operation_config.anchor_reply_window_in_us + RANGING_LISTENING_WINDOW_PADDING_US*2,
+	            RANGING_LISTENING_WINDOW_PERIOD_US(oa_scratch->ranging_operation_config.anchor_reply_window_in_us),
 	            ranging_listening_window_task);
 }
 
@@ -268,136 +571,144 @@ static void anchor_rxcallback (const dwt_callback_data_t *rxd) {
 
 	if (rxd->event == DWT_SIG_RX_OKAY) {
 
-		// First check to see if this is an acknowledgement...
-		// If so, we can stop sending ranging responses
-		if((rxd->fctrl[0] & 0x03) == 0x02){  //This bit says whether this was an ack or not
-			uint8_t cur_seq_num;
-			dwt_readrxdata(&cur_seq_num, 1, 2);
-
-			// Check to see if the sequence number matches the outgoing packet
-			if(cur_seq_num == oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.seqNum)
-				oa_scratch->final_ack_received = TRUE;
-		} else {
-
-			// Read in parameters of this packet reception
-			uint8_t  buf[ONEWAY_ANCHOR_MAX_RX_PKT_LEN];
-			uint64_t dw_rx_timestamp;
-			uint8_t  message_type;
-
-			// Get the received time of this packet first
-			dw_rx_timestamp = dw1000_readrxtimestamp();
-
-			// Get the actual packet bytes
-			dwt_readrxdata(buf, MIN(ONEWAY_ANCHOR_MAX_RX_PKT_LEN, rxd->datalength), 0);
-
-			// We process based on the first byte in the packet. How very active
-			// message like...
-			message_type = buf[offsetof(struct pp_tag_poll, message_type)];
+		// Read in parameters of this packet reception
+		uint8_t  buf[ONEWAY_ANCHOR_MAX_RX_PKT_LEN];
+		uint64_t dw_rx_timestamp;
+		uint8_t  message_type;
+
+		// Get the received time of this packet first
+		dw_rx_timestamp = dw1000_readrxtimestamp();
+
+		// Get the actual packet bytes
+		dwt_readrxdata(buf, MIN(ONEWAY_ANCHOR_MAX_RX_PKT_LEN, rxd->datalength), 0);
+
+		// We process based on the first byte in the packet. How very active
+		// message like...
+		message_type = buf[offsetof(struct pp_tag_poll, message_type)];
+
+		if (message_type == MSG_TYPE_PP_NOSLOTS_TAG_POLL) {
+			// This is one of the broadcast ranging packets from the tag
+			struct pp_tag_poll* rx_poll_pkt = (struct pp_tag_poll*) buf;
+
+			// Decide what to do with this packet
+			if (oa_scratch->state == ASTATE_IDLE) {
+				// We are currently not ranging with any tags.
+
+				if (rx_poll_pkt->subsequence < NUM_RANGING_CHANNELS &&
+				    rx_poll_pkt->pipeline_phase == 0) {
+					// We are idle and this is one of the first packets
+					// that the tag sent. Start listening for this tag's
+					// ranging broadcast packets. This tag sets the
+					// schedule for any others that join in.
+					oa_scratch->state = ASTATE_RANGING;
+					for (uint8_t i=0; i<ONEWAY_ANCHOR_MAX_TAG_SESSIONS; i++) {
+						oa_scratch->sessions[i].in_use = FALSE;
+					}
+					start_session(&(oa_scratch->sessions[0]), rx_poll_pkt, dw_rx_timestamp);
+
+					// Record which ranging subsequence the tag is on
+					oa_scratch->ranging_broadcast_ss_num = rx_poll_pkt->subsequence;
+					// Also record parameters the tag has sent us about how to respond
+					// (or other operational parameters).
+					oa_scratch->ranging_operation_config.reply_after_subsequence = rx_poll_pkt->reply_after_subsequence;
+					oa_scratch->ranging_operation_config.anchor_reply_window_in_us = rx_poll_pkt->anchor_reply_window_in_us;
+					oa_scratch->ranging_operation_config.anchor_reply_slot_time_in_us = rx_poll_pkt->anchor_reply_slot_time_in_us;
+					oa_scratch->ranging_operation_config.reply_windows = rx_poll_pkt->reply_windows;
+					if (oa_scratch->ranging_operation_config.reply_windows > NUM_RANGING_LISTENING_WINDOWS) {
+						oa_scratch->ranging_operation_config.reply_windows = NUM_RANGING_LISTENING_WINDOWS;
+					}
 
-			if (message_type == MSG_TYPE_PP_NOSLOTS_TAG_POLL) {
-				// This is one of the broadcast ranging packets from the tag
-				struct pp_tag_poll* rx_poll_pkt = (struct pp_tag_poll*) buf;
+					// Now we need to start our own state machine to iterate
+					// through the antenna / channel combinations while listening
+					// for packets from the same tag.
+					timer_start(oa_scratch->anchor_timer, RANGING_BROADCASTS_PERIOD_US, ranging_broadcast_subsequence_task);
 
-				// Decide what to do with this packet
-				if (oa_scratch->state == ASTATE_IDLE) {
-					// We are currently not ranging with any tags.
+				} else {
+					// We found this tag ranging sequence late. We don't want
+					// to use this because we won't get enough range estimates.
+					// Or it is sharing an LWB slot with a tag we missed the
+					// start of, and following its timing would put us out
+					// of step with that tag. Just stay idle, but we do need
+					// to re-enable RX to keep receiving packets.
+					dwt_rxenable(0);
+				}
 
-					if (rx_poll_pkt->subsequence < NUM_RANGING_CHANNELS) {
-						// We are idle and this is one of the first packets
-						// that the tag sent. Start listening for this tag's
-						// ranging broadcast packets.
-						oa_scratch->state = ASTATE_RANGING;
+			} else if (oa_scratch->state == ASTATE_RANGING) {
+				// We are currently ranging with a tag, waiting for the various
+				// ranging broadcast packets.
 
-						// Clear memory for this new tag ranging event
-						memset(oa_scratch->pp_anc_final_pkt.TOAs, 0, sizeof(oa_scratch->pp_anc_final_pkt.TOAs));
-						memset(oa_scratch->anchor_antenna_recv_num, 0, sizeof(oa_scratch->anchor_antenna_recv_num));
+				// First check if this is from the tag we are following
+				oneway_anchor_tag_session_t* session = find_session(rx_poll_pkt->header.sourceAddr);
+				if (session == &(oa_scratch->sessions[0])) {
 
-						// Record the EUI of the tag so that we don't get mixed up
-						memcpy(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.destAddr, rx_poll_pkt->header.sourceAddr, 8);
-						// Record which ranging subsequence the tag is on
-						oa_scratch->ranging_broadcast_ss_num = rx_poll_pkt->subsequence;
-						// Record the timestamp. Need to subtract off the TX+RX delay from each recorded
-						// timestamp.
-						oa_scratch->pp_anc_final_pkt.first_rxd_toa = dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, oa_scratch->ranging_broadcast_ss_num);
-						oa_scratch->pp_anc_final_pkt.first_rxd_idx = oa_scratch->ranging_broadcast_ss_num;
-						oa_scratch->pp_anc_final_pkt.TOAs[oa_scratch->ranging_broadcast_ss_num] =
-							(dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, oa_scratch->ranging_broadcast_ss_num)) & 0xFFFF;
-						// Also record parameters the tag has sent us about how to respond
-						// (or other operational parameters).
-						oa_scratch->ranging_operation_config.reply_after_subsequence = rx_poll_pkt->reply_after_subsequence;
-						oa_scratch->ranging_operation_config.anchor_reply_window_in_us = rx_poll_pkt->anchor_reply_window_in_us;
-						oa_scratch->ranging_operation_config.anchor_reply_slot_time_in_us = rx_poll_pkt->anchor_reply_slot_time_in_us;
-
-						// Update the statistics we keep about which antenna
-						// receives the most packets from the tag
-						uint8_t recv_antenna_index = oneway_subsequence_number_to_antenna(ANCHOR, rx_poll_pkt->subsequence);
-						oa_scratch->anchor_antenna_recv_num[recv_antenna_index]++;
-
-						// Now we need to start our own state machine to iterate
-						// through the antenna / channel combinations while listening
-						// for packets from the same tag.
-						timer_start(oa_scratch->anchor_timer, RANGING_BROADCASTS_PERIOD_US, ranging_broadcast_subsequence_task);
+					if (rx_poll_pkt->subsequence == oa_scratch->ranging_broadcast_ss_num) {
+						// This is the packet we were expecting from the tag.
+						// Record the TOA, and adjust it with the calibration value.
+						record_poll(session, oa_scratch->ranging_broadcast_ss_num, dw_rx_timestamp);
 
 					} else {
-						// We found this tag ranging sequence late. We don't want
-						// to use this because we won't get enough range estimates.
-						// Just stay idle, but we do need to re-enable RX to
-						// keep receiving packets.
-						dwt_rxenable(0);
+						// Some how we got out of sync with the tag. Ignore the
+						// range and catch up.
+						oa_scratch->ranging_broadcast_ss_num = rx_poll_pkt->subsequence;
 					}
 
-				} else if (oa_scratch->state == ASTATE_RANGING) {
-					// We are currently ranging with a tag, waiting for the various
-					// ranging broadcast packets.
-
-					// First check if this is from the same tag
-					if (memcmp(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.destAddr, rx_poll_pkt->header.sourceAddr, 8) == 0) {
-						// Same tag
-
-						if (rx_poll_pkt->subsequence == oa_scratch->ranging_broadcast_ss_num) {
-							// This is the packet we were expecting from the tag.
-							// Record the TOA, and adjust it with the calibration value.
-							oa_scratch->pp_anc_final_pkt.TOAs[oa_scratch->ranging_broadcast_ss_num] =
-								(dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, oa_scratch->ranging_broadcast_ss_num)) & 0xFFFF;
-							oa_scratch->pp_anc_final_pkt.last_rxd_toa = dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, oa_scratch->ranging_broadcast_ss_num);
-							oa_scratch->pp_anc_final_pkt.last_rxd_idx = oa_scratch->ranging_broadcast_ss_num;
-
-							// Update the statistics we keep about which antenna
-							// receives the most packets from the tag
-							uint8_t recv_antenna_index = oneway_subsequence_number_to_antenna(ANCHOR, oa_scratch->ranging_broadcast_ss_num);
-							oa_scratch->anchor_antenna_recv_num[recv_antenna_index]++;
-
-						} else {
-							// Some how we got out of sync with the tag. Ignore the
-							// range and catch up.
-							oa_scratch->ranging_broadcast_ss_num = rx_poll_pkt->subsequence;
-						}
-
-						// Regardless, it's a good idea to immediately call the subsequence task and restart the timer
-						timer_reset(oa_scratch->anchor_timer, RANGING_BROADCASTS_PERIOD_US-120); // Magic number calculated from timing
-						//ranging_broadcast_subsequence_task();
-						//timer_reset(oa_scratch->anchor_timer, 0);
-
-						//// Check to see if we got the last of the ranging broadcasts
-						//if (oa_scratch->ranging_broadcast_ss_num == oa_scratch->ranging_operation_config.reply_after_subsequence) {
-						//	// We did!
-						//	ranging_listening_window_setup();
-						//}
-
+					// Regardless, it's a good idea to immediately call the subsequence task and restart the timer
+					timer_reset(oa_scratch->anchor_timer, RANGING_BROADCASTS_PERIOD_US-120); // Magic number calculated from timing
+					//ranging_broadcast_subsequence_task();
+					//timer_reset(oa_scratch->anchor_timer, 0);
+
+					//// Check to see if we got the last of the ranging broadcasts
+					//if (oa_scratch->ranging_broadcast_ss_num == oa_scratch->ranging_operation_config.reply_after_subsequence) {
+					//	// We did!
+					//	ranging_listening_window_setup();
+					//}
+
+				} else if (rx_poll_pkt->subsequence == oa_scratch->ranging_broadcast_ss_num) {
+					// Another tag is polling in step with the first one, so
+					// we are on the right channel and antenna for it too.
+					// Its timing doesn't move our schedule.
+					if (session != NULL) {
+						record_poll(session, oa_scratch->ranging_broadcast_ss_num, dw_rx_timestamp);
 					} else {
-						// Not the same tag, ignore
+						session = find_session(NULL);
+						if (session != NULL) {
+							start_session(session, rx_poll_pkt, dw_rx_timestamp);
+						}
 					}
+
 				} else {
-					// We are in some other state, not sure what that means
+					// Another tag out of step with the first one. We
+					// can't follow both, so ignore it.
 				}
-
 			} else {
-				// We do want to enter RX mode again, however
-				dwt_rxenable(0);
-				// Other message types go here, if they get added
-				if(message_type == MSG_TYPE_PP_GLOSSY_SYNC || message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ)
-					glossy_sync_process(dw_rx_timestamp-oneway_get_rxdelay_from_subsequence(ANCHOR, 0), buf);
+				// We are in some other state, not sure what that means
 			}
+
+		} else if (message_type == MSG_TYPE_PP_GROUP_ACK) {
+			// A tag telling us which anchors it has heard from
+			dwt_rxenable(0);
+			if (oa_scratch->state == ASTATE_RESPONDING) {
+				handle_group_ack((struct pp_group_ack*) buf, MIN(ONEWAY_ANCHOR_MAX_RX_PKT_LEN, rxd->datalength));
+			}
+
+		} else if (message_type == MSG_TYPE_PP_BLINK) {
+			// A tag in blink mode. Stamp it and keep listening.
+			dwt_rxenable(0);
+			if (oa_scratch->state == ASTATE_IDLE) {
+				record_blink((struct pp_blink*) buf, dw_rx_timestamp);
+			}
+
+		} else {
+			// We do want to enter RX mode again, however
+			dwt_rxenable(0);
+			// Other message types go here, if they get added
+			if(message_type == MSG_TYPE_PP_GLOSSY_SYNC || message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ)
+				glossy_sync_process(dw_rx_timestamp-oneway_get_rxdelay_from_subsequence(ANCHOR, 0), buf);
+
+			// Pass on the blinks from the last sync period, so the host
+			// gets them at least once a sync even when there are few.
+			if(message_type == MSG_TYPE_PP_GLOSSY_SYNC)
+				flush_blinks();
 		}
 
 	} else {
@@ -11,6 +11,20 @@
 // is.
 #define ONEWAY_ANCHOR_MAX_RX_PKT_LEN 64
 
+// How many tags the anchor can range with at once. Tags beyond the first
+// can only be heard when their polls line up with the first tag's, since
+// the anchor follows the first tag's channel and antenna schedule. This
+// is bounded by the scratchspace, which the tag's state makes big anyway.
+#define ONEWAY_ANCHOR_MAX_TAG_SESSIONS 3
+
+// Each session builds its ANC_FINAL in its own part of the DW1000 TX
+// buffer as the polls come in, so only a few bytes have to be written when
+// it is time to respond. They start here, past the packets everything else
+// writes at the start of the buffer.
+#define ONEWAY_ANCHOR_TX_BUFFER_OFFSET 128
+#define ONEWAY_ANCHOR_TX_BUFFER_SESSION_OFFSET(_session_idx) \
+	(ONEWAY_ANCHOR_TX_BUFFER_OFFSET + ((_session_idx)*sizeof(struct pp_anc_final_compact)))
+
 typedef enum {
 	ASTATE_IDLE,
 	ASTATE_RANGING,
@@ -23,8 +37,38 @@ typedef struct {
 	uint32_t anchor_reply_window_in_us;
 	uint16_t anchor_reply_slot_time_in_us;
 	uint16_t anchor_reply_num_slots;
+	uint8_t  reply_windows;
 } oneway_anchor_tag_config_t;
 
+// Everything the anchor keeps about one tag it is ranging with. The tag's
+// EUI is the destination address in pp_anc_final_pkt.
+typedef struct {
+	bool in_use;
+	bool final_ack_received;  // The tag listed us in a group ACK
+
+	// Which broadcasts the tag said it would send, and if it is a short
+	// tracking event
+	uint32_t broadcast_mask;
+	bool tracking;
+
+	// Keep track of how many packets we receive from this tag on each
+	// antenna. This lets us pick the best antenna to use when responding.
+	uint8_t anchor_antenna_recv_num[NUM_ANTENNAS];
+
+	// Everything the anchor recorded about the tag's polls
+	struct pp_anc_final pp_anc_final_pkt;
+
+	// Where this session's ANC_FINAL is in the DW1000 TX buffer, and how
+	// many of the 16 bit TOAs have been written there so far
+	uint16_t tx_buffer_offset;
+	uint8_t staged_toas;
+
+	// Packet that the anchor actually unicasts to the tag, and how much of
+	// it to send
+	struct pp_anc_final_compact pp_anc_final_compact_pkt;
+	uint16_t anc_final_compact_len;
+} oneway_anchor_tag_session_t;
+
 typedef struct {
 	// Our timer object that we use for timing packet transmissions
 	stm_timer_t* anchor_timer;
@@ -37,24 +81,28 @@ typedef struct {
 	/******************************************************************************/
 	// What the anchor is currently doing
 	oneway_anchor_state_e state;
-	// Which spot in the ranging broadcast sequence we are currently at
+	// Which spot in the ranging broadcast sequence we are currently at.
+	// This follows the first tag we heard, which is sessions[0], and skips
+	// the broadcasts it isn't sending.
 	uint8_t ranging_broadcast_ss_num;
-	// What config parameters the tag sent us
+	// What config parameters the first tag sent us
 	oneway_anchor_tag_config_t ranging_operation_config;
 	// Which spot in the listening window sequence we are in.
 	// The listening window refers to the time after the ranging broadcasts
 	// when the tag listens for anchor responses on each channel
 	uint8_t ranging_listening_window_num;
-	
-	// Keep track of, in each ranging session with a tag, how many packets we
-	// receive on each antenna. This lets us pick the best antenna to use
-	// when responding to a tag.
-	uint8_t anchor_antenna_recv_num[NUM_ANTENNAS];
-	
-	// Packet that the anchor unicasts to the tag
-	struct pp_anc_final pp_anc_final_pkt;
 
-	bool final_ack_received;
+	// The tags we are ranging with
+	oneway_anchor_tag_session_t sessions[ONEWAY_ANCHOR_MAX_TAG_SESSIONS];
+
+	// How many times we heard a tag too poorly to respond to it
+	uint32_t responses_suppressed;
+
+	// Blinks we've heard but not passed to the host yet
+	oneway_blink_t blinks[MAX_NUM_BLINKS_PER_BATCH];
+	uint8_t blink_count;
+	// The last batch, as the host reads it
+	uint8_t blink_report[ONEWAY_BLINK_REPORT_LEN];
 } oneway_anchor_scratchspace_struct;
 
 oneway_anchor_scratchspace_struct *oa_scratch;
@@ -62,5 +110,6 @@ oneway_anchor_scratchspace_struct *oa_scratch;
 void oneway_anchor_init (void *app_scratchspace);
 dw1000_err_e oneway_anchor_start ();
 void oneway_anchor_stop ();
+uint32_t oneway_anchor_get_responses_suppressed ();
 
 #endif
@@ -23,10 +23,83 @@ static const uint8_t channel_index_to_channel_rf_number[NUM_RANGING_CHANNELS] =
 	1, 4, 3
 };
 
+// The whole broadcast schedule, worked out at compile time. The M0 has no
+// hardware divider, so doing these / and % on every poll means a library
+// call on the tight path between broadcasts.
+//
+// ALGORITHM
+// We iterate through the channels as fast as possible. We do this to
+// find anchors that may not be listening on the first channel as quickly
+// as possible so that they can join the sequence as early as possible.
+// We must rotate the anchor and tag antennas differently so the same
+// ones don't always overlap. This should also be different from the
+// channel sequence. This math is a little weird but somehow works out,
+// even if NUM_RANGING_CHANNELS != NUM_ANTENNAS.
+#define SUBSEQUENCE_CHANNEL_INDEX(_ss)  ((_ss) % NUM_RANGING_CHANNELS)
+#define SUBSEQUENCE_TAG_ANTENNA(_ss)    ((((_ss) / NUM_RANGING_CHANNELS) / NUM_RANGING_CHANNELS) % NUM_ANTENNAS)
+#define SUBSEQUENCE_ANCHOR_ANTENNA(_ss) (((_ss) / NUM_RANGING_CHANNELS) % NUM_ANTENNAS)
+
+#define SUBSEQUENCE_SETTINGS(_ss) { \
+	SUBSEQUENCE_CHANNEL_INDEX(_ss), \
+	SUBSEQUENCE_TAG_ANTENNA(_ss),   \
+	SUBSEQUENCE_ANCHOR_ANTENNA(_ss) }
+
+typedef struct {
+	uint8_t channel_index;
+	uint8_t tag_antenna;
+	uint8_t anchor_antenna;
+} subsequence_settings_t;
+
+static const subsequence_settings_t subsequence_settings[] = {
+	SUBSEQUENCE_SETTINGS(0),  SUBSEQUENCE_SETTINGS(1),  SUBSEQUENCE_SETTINGS(2),
+	SUBSEQUENCE_SETTINGS(3),  SUBSEQUENCE_SETTINGS(4),  SUBSEQUENCE_SETTINGS(5),
+	SUBSEQUENCE_SETTINGS(6),  SUBSEQUENCE_SETTINGS(7),  SUBSEQUENCE_SETTINGS(8),
+	SUBSEQUENCE_SETTINGS(9),  SUBSEQUENCE_SETTINGS(10), SUBSEQUENCE_SETTINGS(11),
+	SUBSEQUENCE_SETTINGS(12), SUBSEQUENCE_SETTINGS(13), SUBSEQUENCE_SETTINGS(14),
+	SUBSEQUENCE_SETTINGS(15), SUBSEQUENCE_SETTINGS(16), SUBSEQUENCE_SETTINGS(17),
+	SUBSEQUENCE_SETTINGS(18), SUBSEQUENCE_SETTINGS(19), SUBSEQUENCE_SETTINGS(20),
+	SUBSEQUENCE_SETTINGS(21), SUBSEQUENCE_SETTINGS(22), SUBSEQUENCE_SETTINGS(23),
+	SUBSEQUENCE_SETTINGS(24), SUBSEQUENCE_SETTINGS(25), SUBSEQUENCE_SETTINGS(26),
+	SUBSEQUENCE_SETTINGS(27), SUBSEQUENCE_SETTINGS(28), SUBSEQUENCE_SETTINGS(29),
+};
+
+// The anchors respond on the channels in order.
+static const uint8_t listening_window_channel_index[] = {
+	0, 1, 2
+};
+
+// If the number of channels, antennas or broadcasts change, the tables
+// above have to be extended to match.
+_Static_assert(sizeof(subsequence_settings)/sizeof(subsequence_settings_t) == NUM_RANGING_BROADCASTS,
+               "subsequence_settings must have an entry for every broadcast");
+_Static_assert(sizeof(listening_window_channel_index) == NUM_RANGING_LISTENING_WINDOWS,
+               "listening_window_channel_index must have an entry for every window");
+_Static_assert(NUM_RANGING_LISTENING_WINDOWS <= NUM_RANGING_CHANNELS,
+               "each listening window must be on its own channel");
+_Static_assert(NUM_RANGING_BROADCASTS == NUM_UNIQUE_PACKET_CONFIGURATIONS + NUM_RANGING_CHANNELS,
+               "the schedule is every configuration plus one repeat of each channel");
+_Static_assert(SUBSEQUENCE_CHANNEL_INDEX(NUM_RANGING_BROADCASTS-1) == NUM_RANGING_CHANNELS-1 &&
+               SUBSEQUENCE_ANCHOR_ANTENNA(NUM_UNIQUE_PACKET_CONFIGURATIONS-1) == NUM_ANTENNAS-1 &&
+               SUBSEQUENCE_TAG_ANTENNA(NUM_UNIQUE_PACKET_CONFIGURATIONS-1) == NUM_ANTENNAS-1,
+               "the schedule must cover every channel and antenna combination");
+_Static_assert(((ONEWAY_REQUIRED_BROADCASTS_MASK | ONEWAY_TRACKING_BROADCASTS_MASK) & ~ONEWAY_ALL_BROADCASTS_MASK) == 0,
+               "broadcast masks can only have bits for broadcasts in the schedule");
+_Static_assert((ONEWAY_REQUIRED_BROADCASTS_MASK & ONEWAY_TRACKING_BROADCASTS_MASK & 1) == 1,
+               "every broadcast mask starts with the first broadcast so anchors can join");
+_Static_assert(NUM_RANGING_BROADCASTS <= 32,
+               "the compact ANC_FINAL needs a bit per broadcast in rxd_bitmap");
+_Static_assert(MAX_ANCHOR_SLOTS <= MAX_NUM_ANCHOR_RESPONSES,
+               "a tag can't keep the responses from more anchor reply slots");
+_Static_assert(MAX_ANCHOR_SLOTS <= 16,
+               "the group ACK needs a bit per anchor reply slot in slot_mask");
+
 // Buffer of anchor IDs and ranges to the anchor.
 // Long enough to hold an anchor id followed by the range, plus the number
 // of ranges
-uint8_t _anchor_ids_ranges[(MAX_NUM_ANCHOR_RESPONSES*(EUI_LEN+sizeof(int32_t)))+1];
+uint8_t _anchor_ids_ranges[(MAX_NUM_ANCHOR_RESPONSES*(EUI_LEN+sizeof(int32_t)+sizeof(oneway_range_quality_t)))+1];
+
+// Buffer for the location the tag found.
+uint8_t _location[sizeof(oneway_location_t)];
 
 static void *_scratchspace_ptr;
 
@@ -58,6 +131,10 @@ void oneway_configure (oneway_config_t* config, stm_timer_t* app_timer, void *ap
 	// Make sure the DW1000 is awake before trying to do anything.
 	dw1000_wakeup();
 
+	// Everything from here on uses the radio settings and timing of the
+	// profile the host asked for
+	dw1000_set_profile(_config.profile);
+
 	// Oneway ranging requires glossy synchronization, so let's enable that now
 	glossy_init(_config.my_glossy_role);
 
@@ -147,13 +224,31 @@ void oneway_do_range () {
 	}
 }
 
+// Tell the tag where an anchor is. Anchors don't need to know, and before
+// we are configured there is nowhere to keep it.
+void oneway_set_anchor_location (uint8_t* anchor_addr, int32_t x_mm, int32_t y_mm, int32_t z_mm) {
+	if (_config.my_role != TAG || _scratchspace_ptr == NULL) {
+		return;
+	}
+	oneway_tag_set_anchor_location(anchor_addr, x_mm, y_mm, z_mm);
+}
+
+void oneway_clear_anchor_locations () {
+	if (_config.my_role != TAG || _scratchspace_ptr == NULL) {
+		return;
+	}
+	oneway_tag_clear_anchor_locations();
+}
+
 // Return a pointer to the application configuration settings
 oneway_config_t* oneway_get_config () {
 	return &_config;
 }
 
 // Record ranges that the tag found.
-void oneway_set_ranges (int32_t* ranges_millimeters, anchor_responses_t* anchor_responses) {
+void oneway_set_ranges (int32_t* ranges_millimeters,
+                        anchor_responses_t* anchor_responses,
+                        oneway_range_quality_t* range_quality) {
 	uint8_t buffer_index = 1;
 	uint8_t num_anchor_ranges = 0;
 
@@ -165,6 +260,10 @@ void oneway_set_ranges (int32_t* ranges_millimeters, anchor_responses_t* anchor_
 			buffer_index += EUI_LEN;
 			memcpy(_anchor_ids_ranges+buffer_index, &ranges_millimeters[i], sizeof(int32_t));
 			buffer_index += sizeof(int32_t);
+			if (_config.extended_ranges) {
+				memcpy(_anchor_ids_ranges+buffer_index, &range_quality[i], sizeof(oneway_range_quality_t));
+				buffer_index += sizeof(oneway_range_quality_t);
+			}
 			num_anchor_ranges++;
 		}
 	}
@@ -173,7 +272,139 @@ void oneway_set_ranges (int32_t* ranges_millimeters, anchor_responses_t* anchor_
 	_anchor_ids_ranges[0] = num_anchor_ranges;
 
 	// Now let the host know so it can do something with the ranges.
-	host_interface_notify_ranges(_anchor_ids_ranges, (num_anchor_ranges*(EUI_LEN+sizeof(int32_t)))+1);
+	if (_config.extended_ranges) {
+		host_interface_notify_ranges_extended(_anchor_ids_ranges, buffer_index);
+	} else {
+		host_interface_notify_ranges(_anchor_ids_ranges, buffer_index);
+	}
+}
+
+// Record the location that the tag found.
+void oneway_set_location (oneway_location_t* location) {
+	memcpy(_location, location, sizeof(oneway_location_t));
+
+	// Now let the host know so it can do something with the location.
+	host_interface_notify_location(_location, sizeof(oneway_location_t));
+}
+
+
+/******************************************************************************/
+// ANC_FINAL packet formats
+/******************************************************************************/
+
+// Fill in the compact ANC_FINAL from the full one the anchor keeps while it
+// records the tag's polls. Returns the frame length to send, including the
+// FCS.
+uint16_t oneway_anc_final_compact_pack (const struct pp_anc_final* anc_final,
+                                        struct pp_anc_final_compact* compact) {
+	uint8_t first_idx = anc_final->first_rxd_idx;
+	uint8_t last_idx  = anc_final->last_rxd_idx;
+
+	memcpy(&compact->ieee154_header_unicast, &anc_final->ieee154_header_unicast, sizeof(struct ieee154_header_unicast));
+	compact->message_type  = MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT;
+	compact->version       = ANC_FINAL_COMPACT_VERSION;
+	compact->reply_slot    = ONEWAY_NO_REPLY_SLOT;
+	compact->final_antenna = anc_final->final_antenna;
+
+	// Timestamps are little endian, so the low 40 bits are the first bytes.
+	memcpy(compact->dw_time_sent, &anc_final->dw_time_sent, ANC_FINAL_COMPACT_TIMESTAMP_LEN);
+	memcpy(compact->first_rxd_toa, &anc_final->first_rxd_toa, ANC_FINAL_COMPACT_TIMESTAMP_LEN);
+	memcpy(compact->last_rxd_toa, &anc_final->last_rxd_toa, ANC_FINAL_COMPACT_TIMESTAMP_LEN);
+
+	compact->rxd_bitmap = (1UL << first_idx) | (1UL << last_idx);
+	uint8_t num_toas = 0;
+	for (uint8_t i=first_idx+1; i<last_idx; i++) {
+		if (anc_final->TOAs[i] != 0) {
+			compact->rxd_bitmap |= 1UL << i;
+			compact->TOAs[num_toas] = anc_final->TOAs[i];
+			num_toas++;
+		}
+	}
+
+	return offsetof(struct pp_anc_final_compact, TOAs) +
+	       (num_toas*sizeof(uint16_t)) +
+	       sizeof(struct ieee154_footer);
+}
+
+// Fill in an anchor response from a received ANC_FINAL in either format.
+// The tag still has to add its own receive time and window. len is the
+// frame length including the FCS. Returns FALSE if the packet is not one we
+// understand.
+bool oneway_anc_final_unpack (const uint8_t* buf, uint16_t len, anchor_responses_t* aresp) {
+	uint8_t message_type = buf[offsetof(struct pp_anc_final, message_type)];
+
+	if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL) {
+		const struct pp_anc_final* anc_final = (const struct pp_anc_final*) buf;
+		if (len < sizeof(struct pp_anc_final)) {
+			return FALSE;
+		}
+
+		memcpy(aresp->anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN);
+		aresp->anchor_final_antenna_index = anc_final->final_antenna;
+		aresp->anc_final_tx_timestamp = anc_final->dw_time_sent;
+		aresp->tag_poll_first_TOA = anc_final->first_rxd_toa;
+		aresp->tag_poll_first_idx = anc_final->first_rxd_idx;
+		aresp->tag_poll_last_TOA = anc_final->last_rxd_toa;
+		aresp->tag_poll_last_idx = anc_final->last_rxd_idx;
+		memcpy(aresp->tag_poll_TOAs, anc_final->TOAs, sizeof(anc_final->TOAs));
+		return TRUE;
+
+	} else if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT) {
+		const struct pp_anc_final_compact* compact = (const struct pp_anc_final_compact*) buf;
+		const uint16_t fixed_len = offsetof(struct pp_anc_final_compact, TOAs) + sizeof(struct ieee154_footer);
+		if (len < fixed_len || compact->version != ANC_FINAL_COMPACT_VERSION) {
+			return FALSE;
+		}
+
+		uint32_t bitmap = compact->rxd_bitmap;
+		if (bitmap == 0 || (bitmap >> NUM_RANGING_BROADCASTS) != 0) {
+			return FALSE;
+		}
+		uint8_t first_idx = 0;
+		while (!(bitmap & (1UL << first_idx))) {
+			first_idx++;
+		}
+		uint8_t last_idx = NUM_RANGING_BROADCASTS-1;
+		while (!(bitmap & (1UL << last_idx))) {
+			last_idx--;
+		}
+
+		// Everything else is measured from the first TOA, so put the other
+		// timestamps back in the same 40 bit period as it.
+		uint64_t first_toa = 0;
+		uint64_t last_toa = 0;
+		uint64_t time_sent = 0;
+		memcpy(&first_toa, compact->first_rxd_toa, ANC_FINAL_COMPACT_TIMESTAMP_LEN);
+		memcpy(&last_toa, compact->last_rxd_toa, ANC_FINAL_COMPACT_TIMESTAMP_LEN);
+		memcpy(&time_sent, compact->dw_time_sent, ANC_FINAL_COMPACT_TIMESTAMP_LEN);
+
+		memcpy(aresp->anchor_addr, compact->ieee154_header_unicast.sourceAddr, EUI_LEN);
+		aresp->anchor_final_antenna_index = compact->final_antenna;
+		aresp->anc_final_tx_timestamp = first_toa + ((time_sent - first_toa) & ANC_FINAL_COMPACT_TIMESTAMP_MASK);
+		aresp->tag_poll_first_TOA = first_toa;
+		aresp->tag_poll_first_idx = first_idx;
+		aresp->tag_poll_last_TOA = first_toa + ((last_toa - first_toa) & ANC_FINAL_COMPACT_TIMESTAMP_MASK);
+		aresp->tag_poll_last_idx = last_idx;
+
+		memset(aresp->tag_poll_TOAs, 0, sizeof(aresp->tag_poll_TOAs));
+		aresp->tag_poll_TOAs[first_idx] = aresp->tag_poll_first_TOA & 0xFFFF;
+		aresp->tag_poll_TOAs[last_idx] = aresp->tag_poll_last_TOA & 0xFFFF;
+
+		uint8_t num_toas = 0;
+		for (uint8_t i=first_idx+1; i<last_idx; i++) {
+			if (bitmap & (1UL << i)) {
+				// Make sure the packet was really long enough to have this
+				if (fixed_len + ((num_toas+1)*sizeof(uint16_t)) > len) {
+					return FALSE;
+				}
+				aresp->tag_poll_TOAs[i] = compact->TOAs[num_toas];
+				num_toas++;
+			}
+		}
+		return TRUE;
+	}
+
+	return FALSE;
 }
 
 
@@ -183,38 +414,71 @@ void oneway_set_ranges (int32_t* ranges_millimeters, anchor_responses_t* anchor_
 
 // Break this out into two functions.
 // (Mostly needed for calibration purposes.)
-static uint8_t subsequence_number_to_channel_index (uint8_t subseq_num) {
-	return subseq_num % NUM_RANGING_CHANNELS;;
+uint8_t oneway_subsequence_number_to_channel_index (uint8_t subseq_num) {
+	if (subseq_num < NUM_RANGING_BROADCASTS) {
+		return subsequence_settings[subseq_num].channel_index;
+	}
+	return SUBSEQUENCE_CHANNEL_INDEX(subseq_num);
 }
 
 // Return the RF channel to use for a given subsequence number
 static uint8_t subsequence_number_to_channel (uint8_t subseq_num) {
-	// ALGORITHM
-	// We iterate through the channels as fast as possible. We do this to
-	// find anchors that may not be listening on the first channel as quickly
-	// as possible so that they can join the sequence as early as possible. This
-	// increases the number of successful packet transmissions and increases
-	// ranging accuracy.
-	uint8_t channel_index = subsequence_number_to_channel_index(subseq_num);
+	uint8_t channel_index = oneway_subsequence_number_to_channel_index(subseq_num);
 	return channel_index_to_channel_rf_number[channel_index];
 }
 
 // Return the Antenna index to use for a given subsequence number
 uint8_t oneway_subsequence_number_to_antenna (dw1000_role_e role, uint8_t subseq_num) {
-	// ALGORITHM
-	// We must rotate the anchor and tag antennas differently so the same
-	// ones don't always overlap. This should also be different from the
-	// channel sequence. This math is a little weird but somehow works out,
-	// even if NUM_RANGING_CHANNELS != NUM_ANTENNAS.
+	// Subsequence numbers come over the air, so anything past the end of
+	// the schedule still gets a sensible answer, just slower.
 	if (role == TAG) {
-		return 	((subseq_num / NUM_RANGING_CHANNELS) / NUM_RANGING_CHANNELS) % NUM_ANTENNAS;
+		if (subseq_num < NUM_RANGING_BROADCASTS) {
+			return subsequence_settings[subseq_num].tag_antenna;
+		}
+		return SUBSEQUENCE_TAG_ANTENNA(subseq_num);
 	} else if (role == ANCHOR) {
-		return (subseq_num / NUM_RANGING_CHANNELS) % NUM_ANTENNAS;
+		if (subseq_num < NUM_RANGING_BROADCASTS) {
+			return subsequence_settings[subseq_num].anchor_antenna;
+		}
+		return SUBSEQUENCE_ANCHOR_ANTENNA(subseq_num);
 	} else {
 		return 0;
 	}
 }
 
+// Which (channel, tag antenna, anchor antenna) combination a broadcast used,
+// as a number below NUM_UNIQUE_PACKET_CONFIGURATIONS.
+uint8_t oneway_subsequence_number_to_configuration (uint8_t subseq_num) {
+	uint8_t tag_antenna = oneway_subsequence_number_to_antenna(TAG, subseq_num);
+	uint8_t anchor_antenna = oneway_subsequence_number_to_antenna(ANCHOR, subseq_num);
+	uint8_t channel_index = oneway_subsequence_number_to_channel_index(subseq_num);
+	return (((tag_antenna * NUM_ANTENNAS) + anchor_antenna) * NUM_RANGING_CHANNELS) + channel_index;
+}
+
+// Return the next subsequence after subseq_num that is in the broadcast
+// mask, or NUM_RANGING_BROADCASTS if there are none left.
+uint8_t oneway_next_subsequence (uint32_t broadcast_mask, uint8_t subseq_num) {
+	for (uint8_t ss=subseq_num+1; ss<NUM_RANGING_BROADCASTS; ss++) {
+		if (broadcast_mask & (1UL << ss)) {
+			return ss;
+		}
+	}
+	return NUM_RANGING_BROADCASTS;
+}
+
+// How many broadcasts in the mask go out before subsequence subseq_num.
+// Broadcasts are sent RANGING_BROADCASTS_PERIOD_US apart, so this is how
+// far into the sequence it is.
+uint8_t oneway_subsequence_position (uint32_t broadcast_mask, uint8_t subseq_num) {
+	uint8_t position = 0;
+	for (uint8_t ss=0; ss<subseq_num && ss<NUM_RANGING_BROADCASTS; ss++) {
+		if (broadcast_mask & (1UL << ss)) {
+			position++;
+		}
+	}
+	return position;
+}
+
 // Go the opposite way and return the ss number based on the antenna used.
 // Returns the LAST valid slot that matches the sequence.
 static uint8_t antenna_and_channel_to_subsequence_number (uint8_t tag_antenna_index,
@@ -227,9 +491,17 @@ static uint8_t antenna_and_channel_to_subsequence_number (uint8_t tag_antenna_in
 	return base_offset;
 }
 
+// Return the channel index the anchors respond to the tag on
+static uint8_t listening_window_number_to_channel_index (uint8_t window_num) {
+	if (window_num < NUM_RANGING_LISTENING_WINDOWS) {
+		return listening_window_channel_index[window_num];
+	}
+	return window_num % NUM_RANGING_CHANNELS;
+}
+
 // Return the RF channel to use when the anchors respond to the tag
 static uint8_t listening_window_number_to_channel (uint8_t window_num) {
-	return channel_index_to_channel_rf_number[window_num % NUM_RANGING_CHANNELS];
+	return channel_index_to_channel_rf_number[listening_window_number_to_channel_index(window_num)];
 }
 
 
@@ -276,7 +548,7 @@ uint8_t oneway_get_ss_index_from_settings (uint8_t anchor_antenna_index,
                                            uint8_t window_num) {
 	// NOTE: need something more rigorous than setting 0 here
 	uint8_t tag_antenna_index = 0;
-	uint8_t channel_index = window_num % NUM_RANGING_CHANNELS;
+	uint8_t channel_index = listening_window_number_to_channel_index(window_num);
 
 	return antenna_and_channel_to_subsequence_number(tag_antenna_index,
 	                                                 anchor_antenna_index,
@@ -287,7 +559,7 @@ uint8_t oneway_get_ss_index_from_settings (uint8_t anchor_antenna_index,
 uint64_t oneway_get_txdelay_from_subsequence (dw1000_role_e role,
                                                 uint8_t subseq_num) {
 	// Need to get channel and antenna to call the dw1000 function
-	uint8_t channel_index = subsequence_number_to_channel_index(subseq_num);
+	uint8_t channel_index = oneway_subsequence_number_to_channel_index(subseq_num);
 	return dw1000_get_tx_delay(channel_index);
 }
 
@@ -295,14 +567,29 @@ uint64_t oneway_get_txdelay_from_subsequence (dw1000_role_e role,
 uint64_t oneway_get_rxdelay_from_subsequence (dw1000_role_e role,
                                                 uint8_t subseq_num) {
 	// Need to get channel and antenna to call the dw1000 function
-	uint8_t channel_index = subsequence_number_to_channel_index(subseq_num);
+	uint8_t channel_index = oneway_subsequence_number_to_channel_index(subseq_num);
 	return dw1000_get_rx_delay(channel_index);
 }
 
 uint64_t oneway_get_txdelay_from_ranging_listening_window (uint8_t window_num){
-	return dw1000_get_tx_delay(window_num % NUM_RANGING_CHANNELS);
+	return dw1000_get_tx_delay(listening_window_number_to_channel_index(window_num));
 }
 
 uint64_t oneway_get_rxdelay_from_ranging_listening_window (uint8_t window_num){
-	return dw1000_get_rx_delay(window_num % NUM_RANGING_CHANNELS);
+	return dw1000_get_rx_delay(listening_window_number_to_channel_index(window_num));
+}
+
+// Pass blinks the anchor heard on to the host. They are copied into
+// blink_report, which is ONEWAY_BLINK_REPORT_LEN long and has to stay put
+// until the host reads it.
+void oneway_set_blinks (uint8_t* blink_report, oneway_blink_t* blinks, uint8_t num_blinks) {
+	if (num_blinks > MAX_NUM_BLINKS_PER_BATCH) {
+		num_blinks = MAX_NUM_BLINKS_PER_BATCH;
+	}
+
+	blink_report[0] = num_blinks;
+	memcpy(blink_report+1, blinks, num_blinks*sizeof(oneway_blink_t));
+
+	// Now let the host know so it can send them on for TDoA.
+	host_interface_notify_blinks(blink_report, 1+num_blinks*sizeof(oneway_blink_t));
 }
@@ -30,6 +30,28 @@
 // on the third channel.
 #define NUM_RANGING_BROADCASTS ((NUM_RANGING_CHANNELS*NUM_ANTENNAS*NUM_ANTENNAS) + NUM_RANGING_CHANNELS)
 
+// The tag can skip broadcasts. Bit i of a broadcast mask is set if
+// subsequence i is sent.
+#define ONEWAY_ALL_BROADCASTS_MASK ((1UL << NUM_RANGING_BROADCASTS) - 1)
+
+// Broadcasts that are always sent, even in a shortened sequence. The first
+// NUM_ANTENNAS*NUM_RANGING_CHANNELS are every configuration with the tag's
+// first antenna. That covers the first channels the anchors listen on, and
+// the poll that matches each anchor's response, which the tag always
+// receives on its first antenna. The repeats at the end keep the sequence
+// long enough to measure clock skew.
+#define ONEWAY_REQUIRED_BROADCASTS_MASK \
+	(((1UL << (NUM_ANTENNAS*NUM_RANGING_CHANNELS)) - 1) | \
+	 (((1UL << NUM_RANGING_CHANNELS) - 1) << NUM_UNIQUE_PACKET_CONFIGURATIONS))
+
+// Broadcasts sent in a tracking event. They are all on the first channel
+// from the tag's first antenna, which is where the anchors wait for polls
+// and where the tag hears the response, so only the anchor's antenna
+// changes. The repeat at the end gives a fourth poll.
+#define ONEWAY_TRACKING_BROADCASTS_MASK \
+	((1UL << 0) | (1UL << NUM_RANGING_CHANNELS) | (1UL << (2*NUM_RANGING_CHANNELS)) | \
+	 (1UL << NUM_UNIQUE_PACKET_CONFIGURATIONS))
+
 // Listen for responses from the anchors on different channels
 #define NUM_RANGING_LISTENING_WINDOWS 3
 
@@ -37,12 +59,43 @@
 // in.
 #define NUM_RANGING_LISTENING_SLOTS 20
 
+// The ranging timing comes from the DW1000 profile in use
+#define RANGING_BROADCASTS_PERIOD_US        (dw1000_get_profile()->broadcasts_period_us)
+#define RANGING_LISTENING_WINDOW_US         (dw1000_get_profile()->listening_window_us)
+#define RANGING_LISTENING_WINDOW_PADDING_US (dw1000_get_profile()->listening_window_padding_us)
+
 // How long the slots inside each window should be for the anchors to choose from
 #define RANGING_LISTENING_SLOT_US (RANGING_LISTENING_WINDOW_US/NUM_RANGING_LISTENING_SLOTS)
 
+// After each listening window but the last the tag broadcasts a group ACK
+// listing the anchors it has heard from, and anchors that aren't on it
+// respond again in the next window. It goes out ONEWAY_GROUP_ACK_GUARD_US
+// after the anchors' replies end, in case their timers run a little behind
+// the tag's. Anchors with a reply slot from the glossy master are listed by
+// their slot. Up to ONEWAY_GROUP_ACK_MAX_EUIS anchors without one are listed
+// by their full EUI. Any others aren't listed and just respond again.
+#define ONEWAY_GROUP_ACK_GUARD_US 200
+#define ONEWAY_GROUP_ACK_MAX_EUIS 2
+#define ONEWAY_GROUP_ACK_US \
+	(dw1000_preamble_time_in_us() + dw1000_packet_data_time_in_us(sizeof(struct pp_group_ack)) + \
+	 ONEWAY_GROUP_ACK_GUARD_US)
+
+// How far apart the listening windows start, for a given reply window
+#define RANGING_LISTENING_WINDOW_PERIOD_US(_window_us) \
+	((_window_us) + ONEWAY_GROUP_ACK_US + (2*RANGING_LISTENING_WINDOW_PADDING_US))
+
 // Maximum number of anchors a tag is willing to hear from
 #define MAX_NUM_ANCHOR_RESPONSES 10
 
+// In blink mode the tag sends this many blinks, one from each antenna, on
+// the channel the anchors wait on, RANGING_BROADCASTS_PERIOD_US apart.
+#define NUM_BLINKS NUM_ANTENNAS
+
+// Anchors pass this many blinks to the host at a time, after the number
+// of blinks
+#define MAX_NUM_BLINKS_PER_BATCH 8
+#define ONEWAY_BLINK_REPORT_LEN (1+(MAX_NUM_BLINKS_PER_BATCH*sizeof(oneway_blink_t)))
+
 // Reasonable constants to rule out unreasonable ranges
 #define MIN_VALID_RANGE_MM -1000      // -1 meter
 #define MAX_VALID_RANGE_MM (50*1000)  // 50 meters
@@ -51,6 +104,10 @@
 // including it in our calculations for the distance to the tag.
 #define MIN_VALID_RANGES_PER_ANCHOR 10
 
+// Tracking events reuse the clock skew from the last full event instead of
+// measuring it, so a couple of polls are enough.
+#define MIN_VALID_RANGES_PER_ANCHOR_TRACKING 2
+
 // When the tag is calculating range for each of the anchors given a bunch
 // of measurements, these define which percentile of the measurements to use.
 // They are split up to facilitate non-floating point math.
@@ -69,6 +126,13 @@
 #define MSG_TYPE_PP_NOSLOTS_ANC_FINAL 0x81
 #define MSG_TYPE_PP_GLOSSY_SYNC       0x82
 #define MSG_TYPE_PP_GLOSSY_SCHED_REQ  0x83
+#define MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT 0x84
+#define MSG_TYPE_PP_BLINK             0x85
+#define MSG_TYPE_PP_TWR_POLL          0x86
+#define MSG_TYPE_PP_TWR_RESP          0x87
+#define MSG_TYPE_PP_TWR_FINAL         0x88
+#define MSG_TYPE_PP_TWR_REPORT        0x89
+#define MSG_TYPE_PP_GROUP_ACK         0x8A
 
 // Packet the tag broadcasts to all nearby anchors
 struct pp_tag_poll  {
@@ -78,6 +142,10 @@ struct pp_tag_poll  {
 	uint8_t reply_after_subsequence;        // Tells anchor which broadcast subsequence number to respond after.
 	uint32_t anchor_reply_window_in_us;     // How long each anchor response window is. Each window allows multiple anchor responses.
 	uint16_t anchor_reply_slot_time_in_us;  // How long that slots that break up each window are.
+	uint32_t broadcast_mask;                // Which subsequences the tag is sending this event.
+	uint8_t reply_windows;                  // How many listening windows the tag will listen in.
+	uint8_t tracking;                       // Set if the tag is using the clock skew from an earlier event.
+	uint8_t pipeline_phase;                 // Where the tag is among tags sharing an LWB slot. Anchors only follow phase 0.
 	struct ieee154_footer footer;
 } __attribute__ ((__packed__));
 
@@ -95,6 +163,61 @@ struct pp_anc_final {
 	struct ieee154_footer footer;
 } __attribute__ ((__packed__));
 
+// Packet the tag broadcasts after a listening window to say which anchors'
+// ANC_FINALs it has received so far this ranging event.
+struct pp_group_ack {
+	struct ieee154_header_broadcast header;
+	uint8_t message_type;
+	uint16_t slot_mask;                     // Bit n is set if the tag has the response from the anchor in reply slot n
+	uint8_t num_anchors;                    // Anchors without a reply slot, listed in anchor_ids
+	uint8_t anchor_ids[ONEWAY_GROUP_ACK_MAX_EUIS][EUI_LEN];
+	struct ieee154_footer footer;           // Really right after the last anchor id that was sent
+} __attribute__ ((__packed__));
+
+// Packet the tag broadcasts in blink mode. Anchors timestamp it against
+// glossy time so the host can find the tag from the differences in arrival
+// times. The tag doesn't listen for anything back. header.seqNum counts
+// blink sequences.
+struct pp_blink {
+	struct ieee154_header_broadcast header;
+	uint8_t message_type;
+	uint8_t blink_idx;                      // Which blink in the sequence this is
+	struct ieee154_footer footer;
+} __attribute__ ((__packed__));
+
+// Version of the pp_anc_final_compact layout. Change this if the layout
+// changes so tags can tell the formats apart.
+#define ANC_FINAL_COMPACT_VERSION 2
+
+// Full timestamps in the compact ANC_FINAL are the low 40 bits of the
+// anchor's clock, which is all the DW1000 keeps anyway.
+#define ANC_FINAL_COMPACT_TIMESTAMP_LEN  5
+#define ANC_FINAL_COMPACT_TIMESTAMP_MASK 0xFFFFFFFFFFULL
+
+// reply_slot of an anchor the glossy master hasn't given a slot
+#define ONEWAY_NO_REPLY_SLOT 0xFF
+
+// Smaller version of pp_anc_final that only carries the polls the anchor
+// actually heard. The first and last received polls are given in full and
+// identified by the lowest and highest bits in rxd_bitmap. Only the low 16
+// bits of the TOAs of received polls in between are sent, in order. The
+// tag resolves the rest of each TOA from when it sent the poll. The packet
+// ends right after the last TOA, so the length on air depends on how many
+// polls the anchor heard.
+struct pp_anc_final_compact {
+	struct ieee154_header_unicast ieee154_header_unicast;
+	uint8_t  message_type;
+	uint8_t  version;                                          // ANC_FINAL_COMPACT_VERSION
+	uint8_t  reply_slot;                                       // The anchor's reply slot, or ONEWAY_NO_REPLY_SLOT
+	uint8_t  final_antenna;                                    // The antenna the anchor used when sending this packet.
+	uint8_t  dw_time_sent[ANC_FINAL_COMPACT_TIMESTAMP_LEN];    // The anchor timestamp of when it sent this packet
+	uint8_t  first_rxd_toa[ANC_FINAL_COMPACT_TIMESTAMP_LEN];
+	uint8_t  last_rxd_toa[ANC_FINAL_COMPACT_TIMESTAMP_LEN];
+	uint32_t rxd_bitmap;                                       // Bit n is set if the anchor received poll n.
+	uint16_t TOAs[NUM_RANGING_BROADCASTS-2];
+	struct ieee154_footer footer;                              // Really right after the last TOA that was sent
+} __attribute__ ((__packed__));
+
 
 /******************************************************************************/
 // State objects for the oneway application
@@ -112,6 +235,10 @@ typedef enum {
 	ONEWAY_UPDATE_MODE_DEMAND = 1     // Range only when the host instructs
 } oneway_update_mode_e;
 
+// An update rate of 0 asks for updates as fast as possible. Tags do that
+// with short tracking events between the full ones.
+#define ONEWAY_UPDATE_RATE_TRACKING 0
+
 // Keep config settings for a oneway node
 typedef struct {
 	dw1000_role_e my_role;
@@ -120,6 +247,11 @@ typedef struct {
 	oneway_update_mode_e update_mode;
 	uint8_t update_rate;
 	bool sleep_mode;
+	bool filter_ranges;
+	bool extended_ranges;
+	bool blink_mode;
+	bool adaptive_broadcasts;
+	dw1000_profile_e profile;
 } oneway_config_t;
 
 typedef struct {
@@ -135,17 +267,57 @@ typedef struct {
 	uint16_t tag_poll_TOAs[NUM_RANGING_BROADCASTS];
 } __attribute__ ((__packed__)) anchor_responses_t;
 
+// Where the tag is, as calculated on the tag and sent to the host.
+typedef struct {
+	int32_t  x_mm;
+	int32_t  y_mm;
+	int32_t  z_mm;
+	uint32_t residual_mm; // RMS of the range residuals, or ONEWAY_LOCATION_NO_FIX
+} __attribute__ ((__packed__)) oneway_location_t;
+
+// When an anchor heard a blink, as sent to the anchor's host.
+typedef struct {
+	uint8_t  tag_addr[EUI_LEN];
+	uint8_t  blink_seq;        // header.seqNum of the blink
+	uint8_t  blink_idx;
+	uint32_t sync_num;         // The glossy sync sync_time is relative to
+	uint64_t sync_time;        // DW1000 time units after the master sent that sync
+} __attribute__ ((__packed__)) oneway_blink_t;
+
+// How much a range to one anchor can be trusted. Sent to the host after
+// each range in the extended range report.
+typedef struct {
+	uint8_t  num_polls;          // Polls that gave a valid distance
+	uint8_t  num_configurations; // Distinct channel/antenna configurations among them
+	uint16_t spread_mm;          // Interquartile range of the per-poll distances
+	uint16_t skew_residual_mm;   // RMS residual of the clock skew fit
+} __attribute__ ((__packed__)) oneway_range_quality_t;
+
 
 void oneway_configure (oneway_config_t* config, stm_timer_t* app_timer, void *app_scratchspace);
 void oneway_start ();
 void oneway_stop ();
 void oneway_reset ();
 void oneway_do_range ();
+void oneway_set_anchor_location (uint8_t* anchor_addr, int32_t x_mm, int32_t y_mm, int32_t z_mm);
+void oneway_clear_anchor_locations ();
 oneway_config_t* oneway_get_config ();
-void oneway_set_ranges (int32_t* ranges_millimeters, anchor_responses_t* anchor_responses);
+void oneway_set_ranges (int32_t* ranges_millimeters,
+                        anchor_responses_t* anchor_responses,
+                        oneway_range_quality_t* range_quality);
+void oneway_set_location (oneway_location_t* location);
+void oneway_set_blinks (uint8_t* blink_report, oneway_blink_t* blinks, uint8_t num_blinks);
+
+uint16_t oneway_anc_final_compact_pack (const struct pp_anc_final* anc_final,
+                                        struct pp_anc_final_compact* compact);
+bool oneway_anc_final_unpack (const uint8_t* buf, uint16_t len, anchor_responses_t* aresp);
 
 
+uint8_t oneway_subsequence_number_to_channel_index (uint8_t subseq_num);
 uint8_t oneway_subsequence_number_to_antenna (dw1000_role_e role, uint8_t subseq_num);
+uint8_t oneway_subsequence_number_to_configuration (uint8_t subseq_num);
+uint8_t oneway_next_subsequence (uint32_t broadcast_mask, uint8_t subseq_num);
+uint8_t oneway_subsequence_position (uint32_t broadcast_mask, uint8_t subseq_num);
 void oneway_set_ranging_broadcast_subsequence_settings (dw1000_role_e role, uint8_t subseq_num);
 void oneway_set_ranging_listening_window_settings (dw1000_role_e role, uint8_t slot_num, uint8_t antenna_num);
 uint8_t oneway_get_ss_index_from_settings (uint8_t anchor_antenna_index, uint8_t window_num);
@@ -0,0 +1,370 @@
+#include <string.h>
+
+#include "oneway_common.h"
+#include "oneway_location.h"
+
+// Fixed-point scaling of the unit vectors from the anchors to the tag
+#define UNIT_Q 14
+// A matrix whose determinant is less than 2^-SINGULAR_SHIFT of the product
+// of its diagonal is treated as singular.
+#define SINGULAR_SHIFT 10
+
+static int64_t abs64 (int64_t x) {
+	return (x < 0) ? -x : x;
+}
+
+static oneway_location_anchor_t* find_anchor (oneway_location_state_t* state, const uint8_t* anchor_addr) {
+	for (uint8_t i=0; i<state->num_anchors; i++) {
+		if (memcmp(state->anchors[i].anchor_addr, anchor_addr, EUI_LEN) == 0) {
+			return &state->anchors[i];
+		}
+	}
+	return NULL;
+}
+
+// Save where an anchor is. Setting an anchor that is already known moves
+// it. Returns FALSE if the location is out of range or there isn't room.
+bool oneway_location_set_anchor (oneway_location_state_t* state,
+                                 const uint8_t* anchor_addr,
+                                 int32_t x_mm, int32_t y_mm, int32_t z_mm) {
+	int32_t position_mm[3] = {x_mm, y_mm, z_mm};
+	for (uint8_t i=0; i<3; i++) {
+		if (position_mm[i] > ONEWAY_LOCATION_MAX_COORDINATE_MM ||
+		    position_mm[i] < -ONEWAY_LOCATION_MAX_COORDINATE_MM) {
+			return FALSE;
+		}
+	}
+
+	oneway_location_anchor_t* anchor = find_anchor(state, anchor_addr);
+	if (anchor == NULL) {
+		if (state->num_anchors == ONEWAY_LOCATION_MAX_ANCHORS) {
+			return FALSE;
+		}
+		anchor = &state->anchors[state->num_anchors++];
+		memcpy(anchor->anchor_addr, anchor_addr, EUI_LEN);
+	}
+	memcpy(anchor->position_mm, position_mm, sizeof(position_mm));
+
+	// The old location may not make sense with the anchors moved.
+	state->last_position_valid = FALSE;
+	return TRUE;
+}
+
+// Forget all of the anchor locations.
+void oneway_location_clear_anchors (oneway_location_state_t* state) {
+	state->num_anchors = 0;
+	state->last_position_valid = FALSE;
+}
+
+// Solve the 3x3 system A x = b. A must be symmetric positive definite.
+// A and b are normalized first so the adjugate products fit in 64 bits,
+// whatever scale they come in at. Returns FALSE if A is too close to
+// singular, which means the anchors don't constrain some direction (they
+// are all in a line, or in a plane with the tag).
+static bool solve_3x3 (int64_t A[3][3], int64_t b[3], int64_t x[3]) {
+	int64_t max_a = 0;
+	int64_t max_b = 0;
+	for (uint8_t k=0; k<3; k++) {
+		for (uint8_t l=0; l<3; l++) {
+			if (abs64(A[k][l]) > max_a) max_a = abs64(A[k][l]);
+		}
+		if (abs64(b[k]) > max_b) max_b = abs64(b[k]);
+	}
+	uint8_t a_shift = 0;
+	uint8_t b_shift = 0;
+	while ((max_a >> a_shift) >= (1 << 15)) a_shift++;
+	while ((max_b >> b_shift) >= (1 << 28)) b_shift++;
+
+	int64_t M[3][3];
+	int64_t v[3];
+	for (uint8_t k=0; k<3; k++) {
+		for (uint8_t l=0; l<3; l++) {
+			M[k][l] = A[k][l] >> a_shift;
+		}
+		v[k] = b[k] >> b_shift;
+	}
+
+	// Invert with the adjugate.
+	int64_t adj[3][3];
+	adj[0][0] = M[1][1]*M[2][2] - M[1][2]*M[2][1];
+	adj[0][1] = M[0][2]*M[2][1] - M[0][1]*M[2][2];
+	adj[0][2] = M[0][1]*M[1][2] - M[0][2]*M[1][1];
+	adj[1][0] = M[1][2]*M[2][0] - M[1][0]*M[2][2];
+	adj[1][1] = M[0][0]*M[2][2] - M[0][2]*M[2][0];
+	adj[1][2] = M[0][2]*M[1][0] - M[0][0]*M[1][2];
+	adj[2][0] = M[1][0]*M[2][1] - M[1][1]*M[2][0];
+	adj[2][1] = M[0][1]*M[2][0] - M[0][0]*M[2][1];
+	adj[2][2] = M[0][0]*M[1][1] - M[0][1]*M[1][0];
+	int64_t det = M[0][0]*adj[0][0] + M[0][1]*adj[1][0] + M[0][2]*adj[2][0];
+
+	// The determinant of a positive definite matrix is at most the product
+	// of its diagonal. Much less than that and some direction is barely
+	// constrained.
+	if (det <= 0 || (det << SINGULAR_SHIFT) < M[0][0]*M[1][1]*M[2][2]) {
+		return FALSE;
+	}
+
+	for (uint8_t k=0; k<3; k++) {
+		int64_t result = (adj[k][0]*v[0] + adj[k][1]*v[1] + adj[k][2]*v[2]) / det;
+		if (b_shift >= a_shift) {
+			x[k] = result * (((int64_t) 1) << (b_shift - a_shift));
+		} else {
+			x[k] = result >> (a_shift - b_shift);
+		}
+	}
+	return TRUE;
+}
+
+// Find a starting point by linearizing the problem. Subtracting the range
+// equation of the first anchor from each of the others leaves equations
+// that are linear in the location:
+//     2 (p_i - p_0) . (x - p_0) = |p_i - p_0|^2 - r_i^2 + r_0^2
+// which are solved in the least squares sense. This has no local minima,
+// but needs at least four anchors that aren't in a plane.
+static bool linearized_start (const int32_t** positions,
+                              const int32_t* ranges,
+                              uint8_t num_anchors,
+                              int32_t* x) {
+	int64_t A[3][3] = {{0}};
+	int64_t b[3] = {0};
+	uint8_t num_equations = 0;
+
+	for (uint8_t i=1; i<num_anchors; i++) {
+		int64_t q[3];
+		bool usable = TRUE;
+		for (uint8_t k=0; k<3; k++) {
+			q[k] = (int64_t) positions[i][k] - positions[0][k];
+			// Two anchors further apart than this can't both be in range,
+			// and skipping them keeps the sums below in 64 bits.
+			if (abs64(q[k]) > 2*MAX_VALID_RANGE_MM) {
+				usable = FALSE;
+			}
+		}
+		if (!usable) {
+			continue;
+		}
+
+		int64_t c = q[0]*q[0] + q[1]*q[1] + q[2]*q[2] -
+		            ((int64_t) ranges[i])*ranges[i] + ((int64_t) ranges[0])*ranges[0];
+		for (uint8_t k=0; k<3; k++) {
+			for (uint8_t l=0; l<3; l++) {
+				A[k][l] += 2*q[k]*q[l];
+			}
+			b[k] += q[k]*c;
+		}
+		num_equations++;
+	}
+
+	int64_t y[3];
+	if (num_equations < 3 || !solve_3x3(A, b, y)) {
+		return FALSE;
+	}
+	for (uint8_t k=0; k<3; k++) {
+		y[k] += positions[0][k];
+		if (abs64(y[k]) > 2*ONEWAY_LOCATION_MAX_COORDINATE_MM) {
+			return FALSE;
+		}
+		x[k] = y[k];
+	}
+	return TRUE;
+}
+
+// Build the normal equations (J^T J) dx = -J^T f at location x, where each
+// row of J is the unit vector from an anchor to x and f is how much longer
+// that distance is than the measured range. A comes back in Q UNIT_Q and
+// b in millimeters in Q UNIT_Q. Returns the sum of the squared residuals.
+static uint64_t build_normal_equations (const int32_t* x,
+                                        const int32_t** positions,
+                                        const int32_t* ranges,
+                                        uint8_t num_anchors,
+                                        int64_t A[3][3],
+                                        int64_t b[3]) {
+	uint64_t sum_squares = 0;
+	memset(A, 0, 9*sizeof(int64_t));
+	memset(b, 0, 3*sizeof(int64_t));
+
+	for (uint8_t i=0; i<num_anchors; i++) {
+		int64_t d[3];
+		for (uint8_t k=0; k<3; k++) {
+			d[k] = (int64_t) x[k] - positions[i][k];
+		}
+		int64_t distance = isqrt64(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+		int64_t residual = distance - ranges[i];
+		sum_squares += residual * residual;
+
+		// Sitting right on an anchor gives no direction to move.
+		if (distance == 0) {
+			continue;
+		}
+
+		int64_t u[3];
+		for (uint8_t k=0; k<3; k++) {
+			u[k] = (d[k] * (1 << UNIT_Q)) / distance;
+		}
+		for (uint8_t k=0; k<3; k++) {
+			for (uint8_t l=0; l<3; l++) {
+				A[k][l] += u[k] * u[l];
+			}
+			b[k] += u[k] * residual;
+		}
+	}
+
+	// A is in Q 2*UNIT_Q, bring it down to match b
+	for (uint8_t k=0; k<3; k++) {
+		for (uint8_t l=0; l<3; l++) {
+			A[k][l] >>= UNIT_Q;
+		}
+	}
+
+	return sum_squares;
+}
+
+// Run Gauss-Newton from x. Each step is halved until it actually reduces
+// the residuals, so a poor starting point doesn't send us flying off.
+// Returns FALSE if the geometry doesn't give a solution.
+static bool gauss_newton (int32_t* x,
+                          const int32_t** positions,
+                          const int32_t* ranges,
+                          uint8_t num_anchors,
+                          uint64_t* sum_squares) {
+	int64_t A[3][3];
+	int64_t b[3];
+	*sum_squares = build_normal_equations(x, positions, ranges, num_anchors, A, b);
+
+	for (uint8_t iteration=0; iteration<ONEWAY_LOCATION_MAX_ITERATIONS; iteration++) {
+		int64_t step[3];
+		if (!solve_3x3(A, b, step)) {
+			return FALSE;
+		}
+		for (uint8_t k=0; k<3; k++) {
+			step[k] = -step[k];
+		}
+
+		bool improved = FALSE;
+		bool converged = FALSE;
+		for (uint8_t halvings=0; halvings<ONEWAY_LOCATION_MAX_HALVINGS; halvings++) {
+			int32_t next[3];
+			converged = TRUE;
+			for (uint8_t k=0; k<3; k++) {
+				int64_t coordinate = x[k] + step[k];
+				// Don't let a bad step walk us off somewhere the math overflows.
+				if (abs64(coordinate) > 2*ONEWAY_LOCATION_MAX_COORDINATE_MM) {
+					coordinate = x[k];
+				}
+				if (abs64(coordinate - x[k]) > ONEWAY_LOCATION_CONVERGED_MM) {
+					converged = FALSE;
+				}
+				next[k] = coordinate;
+			}
+
+			int64_t next_A[3][3];
+			int64_t next_b[3];
+			uint64_t next_sum_squares = build_normal_equations(next, positions, ranges, num_anchors, next_A, next_b);
+			if (next_sum_squares <= *sum_squares) {
+				memcpy(x, next, 3*sizeof(int32_t));
+				memcpy(A, next_A, sizeof(A));
+				memcpy(b, next_b, sizeof(b));
+				*sum_squares = next_sum_squares;
+				improved = TRUE;
+				break;
+			}
+
+			for (uint8_t k=0; k<3; k++) {
+				step[k] /= 2;
+			}
+		}
+
+		// Either we stopped moving, or no step in this direction helps.
+		if (converged || !improved) {
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+// Find the location of the tag from the ranges to the anchors with
+// Gauss-Newton on the range residuals, all in integers.
+//
+// Returns FALSE and sets the residual to ONEWAY_LOCATION_NO_FIX if there
+// are not enough anchors or the geometry doesn't give a solution.
+bool oneway_location_calculate (oneway_location_state_t* state,
+                                const int32_t* ranges_millimeters,
+                                const anchor_responses_t* anchor_responses,
+                                uint8_t num_anchor_responses,
+                                oneway_location_t* location) {
+	const int32_t* positions[MAX_NUM_ANCHOR_RESPONSES];
+	int32_t ranges[MAX_NUM_ANCHOR_RESPONSES];
+	uint8_t num_anchors = 0;
+
+	location->residual_mm = ONEWAY_LOCATION_NO_FIX;
+
+	// Match up the ranges we got with the anchors we know about
+	for (uint8_t i=0; i<num_anchor_responses && i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+		int32_t range = ranges_millimeters[i];
+		if (range == INT32_MAX || range < MIN_VALID_RANGE_MM || range > MAX_VALID_RANGE_MM) {
+			continue;
+		}
+		const oneway_location_anchor_t* anchor = find_anchor(state, anchor_responses[i].anchor_addr);
+		if (anchor == NULL) {
+			continue;
+		}
+		positions[num_anchors] = anchor->position_mm;
+		ranges[num_anchors] = (range < 0) ? 0 : range;
+		num_anchors++;
+	}
+
+	if (num_anchors < ONEWAY_LOCATION_MIN_ANCHORS) {
+		return FALSE;
+	}
+
+	// The range equations have local minima, so try a few starting points
+	// and keep whichever fits the ranges best: near the anchors, the
+	// linearized solution, and where we were last time. Anchors are usually
+	// mounted up high, so the first start is a meter below them. If all of
+	// the anchors are at the same height there is a mirror image solution
+	// above them that fits exactly as well, and ties go to the earlier
+	// start.
+	int32_t best[3];
+	uint64_t best_sum_squares = UINT64_MAX;
+	for (uint8_t attempt=0; attempt<3; attempt++) {
+		int32_t x[3];
+		uint64_t sum_squares;
+
+		if (attempt == 0) {
+			for (uint8_t k=0; k<3; k++) {
+				int32_t sum = 0;
+				for (uint8_t i=0; i<num_anchors; i++) {
+					sum += positions[i][k];
+				}
+				x[k] = sum / num_anchors;
+			}
+			x[2] -= 1000;
+		} else if (attempt == 1) {
+			if (!linearized_start(positions, ranges, num_anchors, x)) continue;
+		} else {
+			if (!state->last_position_valid) continue;
+			memcpy(x, state->last_position_mm, sizeof(x));
+		}
+
+		if (!gauss_newton(x, positions, ranges, num_anchors, &sum_squares)) {
+			continue;
+		}
+		if (sum_squares < best_sum_squares) {
+			memcpy(best, x, sizeof(best));
+			best_sum_squares = sum_squares;
+		}
+	}
+
+	state->last_position_valid = (best_sum_squares != UINT64_MAX);
+	if (!state->last_position_valid) {
+		return FALSE;
+	}
+	memcpy(state->last_position_mm, best, sizeof(best));
+
+	location->x_mm = best[0];
+	location->y_mm = best[1];
+	location->z_mm = best[2];
+	location->residual_mm = isqrt64(best_sum_squares / num_anchors);
+	return TRUE;
+}
@@ -0,0 +1,63 @@
+#ifndef __ONEWAY_LOCATION_H
+#define __ONEWAY_LOCATION_H
+
+#include "oneway_common.h"
+
+/******************************************************************************/
+// Parameters for the location solver
+/******************************************************************************/
+
+// How many anchor locations the host can give the tag. This is more than
+// the number of anchors that can respond in one ranging event so the tag
+// can move around a larger deployment.
+#define ONEWAY_LOCATION_MAX_ANCHORS 12
+
+// Anchor coordinates must be within this many millimeters of the origin.
+// This keeps all of the fixed-point math in the solver in range.
+#define ONEWAY_LOCATION_MAX_COORDINATE_MM 1000000
+
+// Need at least this many anchors with a known location and valid range
+// to find a location.
+#define ONEWAY_LOCATION_MIN_ANCHORS 3
+
+// Limits on the Gauss-Newton iterations. Stop once a step moves less than
+// ONEWAY_LOCATION_CONVERGED_MM in every axis. A step that makes the fit
+// worse is halved up to ONEWAY_LOCATION_MAX_HALVINGS times.
+#define ONEWAY_LOCATION_MAX_ITERATIONS 20
+#define ONEWAY_LOCATION_MAX_HALVINGS 8
+#define ONEWAY_LOCATION_CONVERGED_MM 1
+
+// Set as the residual when a location could not be calculated.
+#define ONEWAY_LOCATION_NO_FIX 0xFFFFFFFF
+
+// Where the anchors are, which the host loads with SET_LOCATION, and where
+// we were last time, which is usually close to where we are now. The tag
+// keeps this in its scratchspace.
+typedef struct {
+	uint8_t anchor_addr[EUI_LEN];
+	int32_t position_mm[3];
+} oneway_location_anchor_t;
+
+typedef struct {
+	oneway_location_anchor_t anchors[ONEWAY_LOCATION_MAX_ANCHORS];
+	uint8_t num_anchors;
+	int32_t last_position_mm[3];
+	bool last_position_valid;
+} oneway_location_state_t;
+
+
+/******************************************************************************/
+// Location functions
+/******************************************************************************/
+
+bool oneway_location_set_anchor (oneway_location_state_t* state,
+                                 const uint8_t* anchor_addr,
+                                 int32_t x_mm, int32_t y_mm, int32_t z_mm);
+void oneway_location_clear_anchors (oneway_location_state_t* state);
+bool oneway_location_calculate (oneway_location_state_t* state,
+                                const int32_t* ranges_millimeters,
+                                const anchor_responses_t* anchor_responses,
+                                uint8_t num_anchor_responses,
+                                oneway_location_t* location);
+
+#endif
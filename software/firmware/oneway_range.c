@@ -0,0 +1,694 @@
+#include <string.h>
+
+#include "dw1000.h"
+#include "oneway_common.h"
+#include "oneway_tag.h"
+#include "oneway_range.h"
+
+// Intervals inside of one ranging event are tens of milliseconds, which is
+// around 2^32 DW1000 time units. Anything longer than this is a corrupted
+// timestamp, and would also overflow the 64 bit fixed-point products below.
+#define MAX_INTERVAL_DWTIME (((int64_t) 1) << 34)
+
+static bool interval_is_valid (int64_t interval) {
+	return interval > -MAX_INTERVAL_DWTIME && interval < MAX_INTERVAL_DWTIME;
+}
+
+// Calculate the crystal offset between the anchor and the tag from the
+// same pair of packets timestamped by both. The result is (ratio - 1) in
+// Q ONEWAY_RANGE_SKEW_Q where ratio = anchor_interval / tag_interval.
+// Returns FALSE if the pair doesn't give a believable offset.
+static bool skew_from_intervals (int64_t tag_interval,
+                                 int64_t anchor_interval,
+                                 int64_t* skew) {
+	if (tag_interval <= 0 || !interval_is_valid(tag_interval)) {
+		return FALSE;
+	}
+
+	int64_t diff = anchor_interval - tag_interval;
+	int64_t max_diff = tag_interval / ONEWAY_RANGE_MAX_SKEW_DIVISOR;
+	if (diff >= max_diff || diff <= -max_diff) {
+		return FALSE;
+	}
+
+	// diff is less than 2^22 here, so this fits in 64 bits.
+	*skew = (diff * (((int64_t) 1) << ONEWAY_RANGE_SKEW_Q)) / tag_interval;
+	return TRUE;
+}
+
+// Convert an interval measured with the tag's clock into the anchor's clock.
+// This is the fixed-point version of interval*offset_anchor_over_tag.
+// The result has ONEWAY_RANGE_TOF_Q fractional bits.
+static int64_t tag_to_anchor_interval (int64_t tag_interval, int64_t skew) {
+	return (tag_interval * (1 << ONEWAY_RANGE_TOF_Q)) +
+	       ((tag_interval * skew) >> (ONEWAY_RANGE_SKEW_Q - ONEWAY_RANGE_TOF_Q));
+}
+
+/******************************************************************************/
+// Clock skew estimation
+/******************************************************************************/
+
+// Residuals larger than this can't come from a believable crystal offset
+// over a valid interval, and would overflow the sums.
+#define MAX_SKEW_RESIDUAL_DWTIME (((int64_t) 1) << 24)
+
+static int64_t abs64 (int64_t x) {
+	return (x < 0) ? -x : x;
+}
+
+void oneway_skew_estimator_init (oneway_skew_estimator_t* est) {
+	memset(est, 0, sizeof(oneway_skew_estimator_t));
+}
+
+// Add one poll to the fit. tag_offset and anchor_offset are the times of
+// this poll relative to the same reference poll as measured by the tag and
+// the anchor.
+void oneway_skew_estimator_add (oneway_skew_estimator_t* est,
+                                uint8_t channel_index,
+                                int64_t tag_offset,
+                                int64_t anchor_offset) {
+	if (channel_index >= NUM_RANGING_CHANNELS ||
+	    !interval_is_valid(tag_offset) || !interval_is_valid(anchor_offset)) {
+		return;
+	}
+
+	// x is under 2^26 and r under 2^24, so with 30 polls none of the sums
+	// overflow 64 bits.
+	int64_t x = tag_offset >> 8;
+	int64_t r = anchor_offset - tag_offset;
+	if (abs64(r) >= MAX_SKEW_RESIDUAL_DWTIME) {
+		return;
+	}
+
+	est->n[channel_index]++;
+	est->sum_x[channel_index] += x;
+	est->sum_r[channel_index] += r;
+	est->sum_xx += x*x;
+	est->sum_xr += x*r;
+	est->sum_rr += r*r;
+}
+
+// Remove each channel's mean from the sums so only the spread within a
+// channel counts.
+static void centered_sums (const oneway_skew_estimator_t* est,
+                           int64_t* sxx,
+                           int64_t* sxr,
+                           int64_t* srr) {
+	*sxx = est->sum_xx;
+	*sxr = est->sum_xr;
+	*srr = est->sum_rr;
+	for (uint8_t i=0; i<NUM_RANGING_CHANNELS; i++) {
+		if (est->n[i] == 0) {
+			continue;
+		}
+		*sxx -= (est->sum_x[i] * est->sum_x[i]) / est->n[i];
+		*sxr -= (est->sum_x[i] * est->sum_r[i]) / est->n[i];
+		*srr -= (est->sum_r[i] * est->sum_r[i]) / est->n[i];
+	}
+}
+
+// Solve the fit for the skew, as (ratio - 1) in Q ONEWAY_RANGE_SKEW_Q.
+// Returns FALSE if the polls were too close together to say anything.
+bool oneway_skew_estimator_get (const oneway_skew_estimator_t* est, int64_t* skew) {
+	int64_t sxx, sxr, srr;
+	centered_sums(est, &sxx, &sxr, &srr);
+
+	const int64_t min_span = DW_DELAY_FROM_US(ONEWAY_RANGE_MIN_SKEW_SPAN_US);
+	if (sxx < (min_span * min_span) / 2) {
+		return FALSE;
+	}
+
+	// The slope is sxr / (sxx * 2^8). Scaled to Q ONEWAY_RANGE_SKEW_Q that is
+	// (sxr * 2^32) / sxx, but sxr can't take all of the shift, so the rest
+	// comes off the bottom of sxx.
+	uint8_t shift = ONEWAY_RANGE_SKEW_Q - 8;
+	while (shift > 0 && abs64(sxr) < (((int64_t) 1) << 61)) {
+		sxr *= 2;
+		shift--;
+	}
+	sxx >>= shift;
+
+	int64_t result = sxr / sxx;
+	if (abs64(result) >= (((int64_t) 1) << ONEWAY_RANGE_SKEW_Q) / ONEWAY_RANGE_MAX_SKEW_DIVISOR) {
+		return FALSE;
+	}
+
+	*skew = result;
+	return TRUE;
+}
+
+// How far the polls are from the fitted clocks, as the RMS residual in
+// millimeters. skew is the result of oneway_skew_estimator_get(). This is
+// timestamp noise that the skew fit couldn't explain, so it says how much
+// the anchor's timestamps can be trusted. Saturates at UINT16_MAX.
+uint16_t oneway_skew_estimator_residual (const oneway_skew_estimator_t* est, int64_t skew) {
+	int64_t sxx, sxr, srr;
+	centered_sums(est, &sxx, &sxr, &srr);
+
+	// Each channel's intercept and the shared slope each use up one poll.
+	int16_t degrees_of_freedom = -1;
+	for (uint8_t i=0; i<NUM_RANGING_CHANNELS; i++) {
+		if (est->n[i] > 0) {
+			degrees_of_freedom += est->n[i] - 1;
+		}
+	}
+	if (degrees_of_freedom <= 0) {
+		return 0;
+	}
+
+	// The fit explains skew * sxr / 2^32 of srr. Shift sxr down just enough
+	// that the product fits in 64 bits.
+	int64_t limit = INT64_MAX / (abs64(skew) + 1);
+	uint8_t shift = ONEWAY_RANGE_SKEW_Q - 8;
+	while (shift > 0 && abs64(sxr) > limit) {
+		sxr /= 2;
+		shift--;
+	}
+	int64_t explained = (sxr * skew) >> shift;
+
+	int64_t mean_square = (srr - explained) / degrees_of_freedom;
+	if (mean_square <= 0) {
+		return 0;
+	}
+
+	// Anything this big is off the end of the uint16 in millimeters anyway.
+	if (mean_square >= (((int64_t) 1) << 32)) {
+		return UINT16_MAX;
+	}
+
+	// Take the root in Q8 so small residuals don't round away.
+	int millimeters = dwtime_fixed_to_millimeters(isqrt64(((uint64_t) mean_square) << 16), 8);
+	if (millimeters > UINT16_MAX) {
+		return UINT16_MAX;
+	}
+	return (uint16_t) millimeters;
+}
+
+/******************************************************************************/
+// Percentile selection
+/******************************************************************************/
+
+// Put the k-th smallest of the values at values[k], with nothing larger
+// before it and nothing smaller after it. This is quickselect, so it works
+// in place and is linear on average instead of sorting the whole array.
+static void select_kth (int values[], uint8_t count, uint8_t k) {
+	int16_t lo = 0;
+	int16_t hi = count - 1;
+
+	while (lo < hi) {
+		int pivot = values[(lo + hi) / 2];
+		int16_t i = lo;
+		int16_t j = hi;
+
+		while (i <= j) {
+			while (values[i] < pivot) i++;
+			while (values[j] > pivot) j--;
+			if (i <= j) {
+				int temp = values[i];
+				values[i] = values[j];
+				values[j] = temp;
+				i++;
+				j--;
+			}
+		}
+
+		// Everything between j and i equals the pivot, so if k landed
+		// there we are done.
+		if (k <= j) {
+			hi = j;
+		} else if (k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+}
+
+// Calculate the RANGE_PERCENTILE_NUMERATOR/RANGE_PERCENTILE_DENOMENATOR
+// percentile of the values. This gives exactly the same result as sorting
+// them and interpolating between the two entries around the percentile,
+// but only has to find those two. The values are reordered. count must
+// be at least one.
+int oneway_range_percentile (int values[], uint8_t count) {
+	// bot represents the whole index of the item at the percentile.
+	// Then we are going to use the remainder decimal portion to get
+	// a scaled value to add to that base.
+	// EXAMPLE: if the 90th percentile would be index 3.4, we do:
+	//                  distances[3] + 0.4*(distances[4]-distances[3])
+	uint8_t bot = (count*RANGE_PERCENTILE_NUMERATOR)/RANGE_PERCENTILE_DENOMENATOR;
+	uint8_t top = bot+1;
+	if (bot >= count) {
+		bot = count-1;
+	}
+
+	select_kth(values, count, bot);
+	int bot_value = values[bot];
+	if (top >= count) {
+		return bot_value;
+	}
+
+	// Everything past bot is no smaller, so the next entry in sorted order
+	// is just the smallest of those.
+	int top_value = values[top];
+	for (uint8_t i=top+1; i<count; i++) {
+		if (values[i] < top_value) {
+			top_value = values[i];
+		}
+	}
+
+	return bot_value +
+		(((top_value-bot_value) * ((RANGE_PERCENTILE_NUMERATOR*count)
+		 - (bot*RANGE_PERCENTILE_DENOMENATOR))) / RANGE_PERCENTILE_DENOMENATOR);
+}
+
+
+// Middle value of the values, or the average of the two middle values if
+// there are an even number of them. The values are reordered.
+static int median (int values[], uint8_t count) {
+	uint8_t mid = count/2;
+	select_kth(values, count, mid);
+	if (count % 2) {
+		return values[mid];
+	}
+
+	// Everything before mid is no larger, so the other middle value is just
+	// the largest of those.
+	int below = values[0];
+	for (uint8_t i=1; i<mid; i++) {
+		if (values[i] > below) {
+			below = values[i];
+		}
+	}
+	return below + ((values[mid] - below) / 2);
+}
+
+// Difference between the upper and lower quartile of the values, which is
+// how spread out they are without caring about a few outliers. The values
+// are reordered.
+static int interquartile_range (int values[], uint8_t count) {
+	uint8_t upper = (count*3)/4;
+	uint8_t lower = count/4;
+	select_kth(values, count, upper);
+
+	// Everything below the upper quartile is now in front of it.
+	select_kth(values, upper, lower);
+	return values[upper] - values[lower];
+}
+
+// Combine distances measured with different channel and antenna
+// configurations into one range. The distances from each configuration are
+// first replaced with their median, which takes out the noise between polls
+// that went over the same path.
+//
+// A configuration's median then only counts if enough of all of the
+// distances agree with it. Now and then the DW1000 mistakes a noise peak
+// for the first path, which makes that poll come out well short. With one
+// or two polls per configuration those are what a low percentile lands on,
+// and nothing near them backs them up. The percentile is taken over the
+// medians of the configurations that are left, each weighted by how many of
+// its polls made it, so it picks out the configurations with the most
+// direct paths. If no configuration is backed up, all of them are used.
+//
+// configurations gives the configuration of each distance. Both arrays are
+// reordered. Returns the number of distinct configurations in
+// num_configurations, and the configuration the percentile landed on in
+// selected_configuration.
+int oneway_range_diversity_estimate (int distances[],
+                                     uint8_t configurations[],
+                                     uint8_t count,
+                                     uint8_t* num_configurations,
+                                     uint8_t* selected_configuration) {
+	int group_medians[NUM_UNIQUE_PACKET_CONFIGURATIONS];
+	uint8_t group_counts[NUM_UNIQUE_PACKET_CONFIGURATIONS];
+	uint8_t group_configurations[NUM_UNIQUE_PACKET_CONFIGURATIONS];
+	uint8_t num_groups = 0;
+
+	uint8_t start = 0;
+	while (start < count) {
+		// Move all of the distances with the same configuration as the first
+		// ungrouped one up next to it.
+		uint8_t end = start+1;
+		for (uint8_t i=start+1; i<count; i++) {
+			if (configurations[i] == configurations[start]) {
+				int distance = distances[i];
+				distances[i] = distances[end];
+				distances[end] = distance;
+				configurations[i] = configurations[end];
+				configurations[end] = configurations[start];
+				end++;
+			}
+		}
+
+		// There can't be more configurations than that, but just in case
+		// something odd got in, leave it out.
+		if (num_groups < NUM_UNIQUE_PACKET_CONFIGURATIONS) {
+			group_medians[num_groups] = median(distances+start, end-start);
+			group_counts[num_groups] = end-start;
+			group_configurations[num_groups] = configurations[start];
+			num_groups++;
+		}
+		start = end;
+	}
+	*num_configurations = num_groups;
+
+	// Find which of the medians the distances back up. Most are backed up
+	// by the first few distances, so stop counting once there are enough.
+	bool any_agreed = FALSE;
+	bool agreed[NUM_UNIQUE_PACKET_CONFIGURATIONS];
+	for (uint8_t g=0; g<num_groups; g++) {
+		uint8_t agreeing = 0;
+		for (uint8_t i=0; i<count && agreeing<ONEWAY_RANGE_MIN_AGREEING_POLLS; i++) {
+			if (distances[i] >= group_medians[g] - ONEWAY_RANGE_AGREEMENT_MM &&
+			    distances[i] <= group_medians[g] + ONEWAY_RANGE_AGREEMENT_MM) {
+				agreeing++;
+			}
+		}
+		agreed[g] = agreeing >= ONEWAY_RANGE_MIN_AGREEING_POLLS;
+		any_agreed |= agreed[g];
+	}
+
+	// Give each of those medians as many entries as the configuration had
+	// polls, and take the percentile over them.
+	uint8_t num_weighted = 0;
+	for (uint8_t g=0; g<num_groups; g++) {
+		if (agreed[g] || !any_agreed) {
+			for (uint8_t i=0; i<group_counts[g]; i++) {
+				distances[num_weighted++] = group_medians[g];
+			}
+		}
+	}
+
+	int result = oneway_range_percentile(distances, num_weighted);
+
+	// The percentile falls between two of the group medians. Credit the
+	// configuration of the lower one.
+	*selected_configuration = 0;
+	int selected_median = INT32_MIN;
+	for (uint8_t g=0; g<num_groups; g++) {
+		if ((agreed[g] || !any_agreed) &&
+		    group_medians[g] <= result && group_medians[g] >= selected_median) {
+			selected_median = group_medians[g];
+			*selected_configuration = group_configurations[g];
+		}
+	}
+
+	return result;
+}
+
+
+/******************************************************************************/
+// Range calculation
+/******************************************************************************/
+
+// Calculate the range from the tag to a single anchor given the anchor's
+// ANC_FINAL and the times the tag sent each of the broadcast polls.
+// Returns the range in millimeters, or one of the ONEWAY_TAG_RANGE_ERROR_*
+// values if a range could not be calculated. How much the range can be
+// trusted is filled in to quality, which is all zeros on error. The
+// configuration that gave the range goes in selected_configuration, and
+// the clock skew to the anchor in skew.
+//
+// For a tracking event, pass the skew from the last full event in
+// known_skew. The polls are too close together to measure it again.
+// Otherwise known_skew is NULL.
+int32_t oneway_range_calculate_anchor (const uint64_t* broadcast_send_times,
+                                       const anchor_responses_t* aresp,
+                                       const int64_t* known_skew,
+                                       int64_t* skew,
+                                       oneway_range_quality_t* quality,
+                                       uint8_t* selected_configuration) {
+	memset(quality, 0, sizeof(oneway_range_quality_t));
+	*selected_configuration = 0;
+
+	uint8_t first_idx = aresp->tag_poll_first_idx;
+	uint8_t last_idx  = aresp->tag_poll_last_idx;
+
+	// These come over the air, make sure we can use them as indices.
+	if (first_idx >= NUM_RANGING_BROADCASTS || last_idx >= NUM_RANGING_BROADCASTS) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+
+	// Since the rxd TOAs are compressed to 16 bits, we first need to
+	// decompress them back to 64-bit quantities. Once they have been turned
+	// into distances their space is reused, to keep the stack small.
+	union {
+		uint64_t tag_poll_TOAs[NUM_RANGING_BROADCASTS];
+		int spread_millimeters[NUM_RANGING_BROADCASTS];
+	} polls;
+	uint64_t* tag_poll_TOAs = polls.tag_poll_TOAs;
+	memset(polls.tag_poll_TOAs, 0, sizeof(polls.tag_poll_TOAs));
+
+	// First put in the TOA values that are known
+	tag_poll_TOAs[first_idx] = aresp->tag_poll_first_TOA;
+	tag_poll_TOAs[last_idx] = aresp->tag_poll_last_TOA;
+
+	// Fit the skew to every poll the anchor heard while we walk them.
+	oneway_skew_estimator_t skew_estimator;
+	oneway_skew_estimator_init(&skew_estimator);
+
+	if (last_idx > first_idx) {
+		// Get an estimate of clock offset from the first and last packets
+		int64_t approx_skew;
+		if (known_skew != NULL) {
+			approx_skew = *known_skew;
+		} else if (!skew_from_intervals(broadcast_send_times[last_idx] - broadcast_send_times[first_idx],
+		                                aresp->tag_poll_last_TOA - aresp->tag_poll_first_TOA,
+		                                &approx_skew)) {
+			return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+		}
+
+		// Then interpolate between the two to find the high 48 bits which
+		// fit best
+		for (uint8_t ii=first_idx+1; ii<last_idx; ii++) {
+			// A compressed TOA of 0 means the anchor didn't get this poll.
+			// Leave it as 0 so it is skipped below.
+			if (aresp->tag_poll_TOAs[ii] == 0) {
+				continue;
+			}
+
+			int64_t tag_interval = broadcast_send_times[ii] - broadcast_send_times[first_idx];
+			uint64_t estimated_TOA = aresp->tag_poll_first_TOA +
+				(tag_to_anchor_interval(tag_interval, approx_skew) >> ONEWAY_RANGE_TOF_Q);
+
+			uint64_t actual_TOA = (estimated_TOA & 0xFFFFFFFFFFFF0000ULL) + aresp->tag_poll_TOAs[ii];
+
+			// Make corrections if we're off by more than 0x7FFF
+			if (actual_TOA < estimated_TOA - 0x7FFF) {
+				actual_TOA += 0x10000;
+			} else if (actual_TOA > estimated_TOA + 0x7FFF) {
+				actual_TOA -= 0x10000;
+			}
+
+			tag_poll_TOAs[ii] = actual_TOA;
+		}
+
+		for (uint8_t ii=first_idx; ii<=last_idx; ii++) {
+			if (tag_poll_TOAs[ii] == 0) {
+				continue;
+			}
+			oneway_skew_estimator_add(&skew_estimator,
+			                          oneway_subsequence_number_to_channel_index(ii),
+			                          broadcast_send_times[ii] - broadcast_send_times[first_idx],
+			                          tag_poll_TOAs[ii] - tag_poll_TOAs[first_idx]);
+		}
+	}
+
+	// If the anchor didn't hear enough of the sequence on any one channel
+	// then we have to skip this anchor.
+	if (known_skew != NULL) {
+		*skew = *known_skew;
+	} else if (!oneway_skew_estimator_get(&skew_estimator, skew)) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+
+	// Use the one packet we have from the anchor to calculate a one-way
+	// time of flight for the poll with the same antennas and channel.
+	uint8_t ss_index_matching = oneway_get_ss_index_from_settings(aresp->anchor_final_antenna_index,
+	                                                              aresp->window_packet_recv);
+	if (ss_index_matching >= NUM_RANGING_BROADCASTS || tag_poll_TOAs[ss_index_matching] == 0) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+
+	uint64_t matching_broadcast_send_time = broadcast_send_times[ss_index_matching];
+	uint64_t matching_broadcast_recv_time = tag_poll_TOAs[ss_index_matching];
+	int64_t tag_round_trip    = aresp->anc_final_rx_timestamp - matching_broadcast_send_time;
+	int64_t anchor_turnaround = aresp->anc_final_tx_timestamp - matching_broadcast_recv_time;
+	if (!interval_is_valid(tag_round_trip) || !interval_is_valid(anchor_turnaround)) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+
+	int64_t two_way_TOF = tag_to_anchor_interval(tag_round_trip, *skew) -
+		(anchor_turnaround * (1 << ONEWAY_RANGE_TOF_Q));
+	int64_t one_way_TOF = two_way_TOF / 2;
+
+	// Declare an array for collecting the ranges.
+	int distances_millimeters[NUM_RANGING_BROADCASTS] = {0};
+	uint8_t distance_configurations[NUM_RANGING_BROADCASTS];
+	uint8_t num_valid_distances = 0;
+
+	// Next we calculate the TOFs for each of the poll messages the tag sent.
+	for (uint8_t broadcast_index=0; broadcast_index<NUM_RANGING_BROADCASTS; broadcast_index++) {
+		// We use 0 as a sentinel for the anchor not receiving the packet.
+		if (tag_poll_TOAs[broadcast_index] == 0) {
+			continue;
+		}
+
+		// We use the reference packet to compensate for the unsynchronized
+		// clock.
+		int64_t broadcast_anchor_offset = tag_poll_TOAs[broadcast_index] - matching_broadcast_recv_time;
+		int64_t broadcast_tag_offset = broadcast_send_times[broadcast_index] - matching_broadcast_send_time;
+		if (!interval_is_valid(broadcast_anchor_offset) || !interval_is_valid(broadcast_tag_offset)) {
+			continue;
+		}
+
+		int64_t TOF = (broadcast_anchor_offset * (1 << ONEWAY_RANGE_TOF_Q)) -
+			tag_to_anchor_interval(broadcast_tag_offset, *skew) + one_way_TOF;
+
+		int distance_millimeters = dwtime_fixed_to_millimeters(TOF, ONEWAY_RANGE_TOF_Q);
+
+		// Check that the distance we have at this point is at all reasonable
+		if (distance_millimeters >= MIN_VALID_RANGE_MM && distance_millimeters <= MAX_VALID_RANGE_MM) {
+			distances_millimeters[num_valid_distances] = distance_millimeters;
+			distance_configurations[num_valid_distances] = oneway_subsequence_number_to_configuration(broadcast_index);
+			num_valid_distances++;
+		}
+	}
+
+	// Check to make sure that we got enough ranges from this anchor.
+	uint8_t min_valid_distances = (known_skew != NULL) ? MIN_VALID_RANGES_PER_ANCHOR_TRACKING :
+	                                                     MIN_VALID_RANGES_PER_ANCHOR;
+	if (num_valid_distances < min_valid_distances) {
+		return ONEWAY_TAG_RANGE_ERROR_TOO_FEW_RANGES;
+	}
+
+	// Work out how spread out the distances are before they get combined.
+	// That sorts them, so it gets a copy, in the space the TOAs were in.
+	int* spread_millimeters = polls.spread_millimeters;
+	memcpy(spread_millimeters, distances_millimeters, num_valid_distances*sizeof(int));
+	int spread = interquartile_range(spread_millimeters, num_valid_distances);
+
+	// Now that we have all of the calculated ranges from all of the tag
+	// broadcasts we can combine them into one range.
+	uint8_t configurations;
+	int32_t result = oneway_range_diversity_estimate(distances_millimeters,
+	                                                 distance_configurations,
+	                                                 num_valid_distances,
+	                                                 &configurations,
+	                                                 selected_configuration);
+
+	if (result == INT32_MAX) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+
+	quality->num_polls = num_valid_distances;
+	quality->num_configurations = configurations;
+	quality->spread_mm = (spread > UINT16_MAX) ? UINT16_MAX : spread;
+	quality->skew_residual_mm = oneway_skew_estimator_residual(&skew_estimator, *skew);
+	return result;
+}
+
+
+/******************************************************************************/
+// Range tracking
+/******************************************************************************/
+
+static bool range_is_valid (int32_t range) {
+	// This also catches the ONEWAY_TAG_RANGE_ERROR_* values, which are all
+	// very negative.
+	return range >= MIN_VALID_RANGE_MM && range <= MAX_VALID_RANGE_MM;
+}
+
+// Find the track for this anchor, or make a new one. If all of the tracks
+// are in use, the one we have heard from least recently is replaced.
+static oneway_range_track_t* get_track (oneway_range_track_t* tracks,
+                                        const uint8_t* anchor_addr,
+                                        bool* is_new) {
+	oneway_range_track_t* oldest = &tracks[0];
+	for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+		if (tracks[i].in_use && memcmp(tracks[i].anchor_addr, anchor_addr, EUI_LEN) == 0) {
+			*is_new = FALSE;
+			return &tracks[i];
+		}
+		if (!oldest->in_use) {
+			continue;
+		}
+		if (!tracks[i].in_use || tracks[i].missed > oldest->missed) {
+			oldest = &tracks[i];
+		}
+	}
+
+	*is_new = TRUE;
+	memcpy(oldest->anchor_addr, anchor_addr, EUI_LEN);
+	oldest->in_use = TRUE;
+	return oldest;
+}
+
+static void restart_track (oneway_range_track_t* track, int32_t range) {
+	track->range_mm = range;
+	track->variance = ONEWAY_RANGE_TRACK_MEASUREMENT_NOISE_MM * ONEWAY_RANGE_TRACK_MEASUREMENT_NOISE_MM;
+	track->missed = 0;
+	track->rejected = 0;
+}
+
+// Filter the ranges from this ranging event with the tracks from previous
+// ones. ranges_millimeters is updated in place with the filtered ranges.
+// Anchors that didn't give a range this time are left alone.
+void oneway_range_track (oneway_range_track_t* tracks,
+                         int32_t* ranges_millimeters,
+                         const anchor_responses_t* anchor_responses,
+                         uint8_t num_anchor_responses) {
+	const uint32_t process_variance = ONEWAY_RANGE_TRACK_PROCESS_NOISE_MM * ONEWAY_RANGE_TRACK_PROCESS_NOISE_MM;
+	const uint32_t measurement_variance = ONEWAY_RANGE_TRACK_MEASUREMENT_NOISE_MM * ONEWAY_RANGE_TRACK_MEASUREMENT_NOISE_MM;
+	bool updated[MAX_NUM_ANCHOR_RESPONSES] = {FALSE};
+
+	for (uint8_t i=0; i<num_anchor_responses && i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+		int32_t range = ranges_millimeters[i];
+		if (!range_is_valid(range)) {
+			continue;
+		}
+
+		bool is_new;
+		oneway_range_track_t* track = get_track(tracks, anchor_responses[i].anchor_addr, &is_new);
+		updated[track - tracks] = TRUE;
+		if (is_new) {
+			restart_track(track, range);
+			continue;
+		}
+
+		// The range could have wandered off since we last heard from
+		// this anchor.
+		track->variance += process_variance * (track->missed + 1);
+		track->missed = 0;
+
+		// Throw out anything the tag couldn't have physically moved, and
+		// report where we think the anchor is instead.
+		int32_t innovation = range - track->range_mm;
+		if (innovation > ONEWAY_RANGE_TRACK_MAX_JUMP_MM || innovation < -ONEWAY_RANGE_TRACK_MAX_JUMP_MM) {
+			track->rejected++;
+			if (track->rejected >= ONEWAY_RANGE_TRACK_MAX_REJECTED) {
+				restart_track(track, range);
+			} else {
+				ranges_millimeters[i] = track->range_mm;
+			}
+			continue;
+		}
+		track->rejected = 0;
+
+		// Kalman gain in Q16
+		uint32_t gain = (uint32_t) ((((uint64_t) track->variance) << 16) / (track->variance + measurement_variance));
+		track->range_mm += (int32_t) ((((int64_t) innovation) * gain) >> 16);
+		track->variance = (uint32_t) ((((uint64_t) track->variance) * ((1 << 16) - gain)) >> 16);
+
+		ranges_millimeters[i] = track->range_mm;
+	}
+
+	// Age the anchors we didn't hear from, and eventually forget them.
+	for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+		if (tracks[i].in_use && !updated[i]) {
+			tracks[i].missed++;
+			if (tracks[i].missed > ONEWAY_RANGE_TRACK_MAX_MISSED) {
+				tracks[i].in_use = FALSE;
+			}
+		}
+	}
+}
@@ -0,0 +1,131 @@
+#ifndef __ONEWAY_RANGE_H
+#define __ONEWAY_RANGE_H
+
+#include "oneway_common.h"
+
+/******************************************************************************/
+// Fixed-point formats for the range calculation
+/******************************************************************************/
+
+// The STM32F031 has no FPU, so all of the range math is done in integers.
+// The crystal offset between an anchor and the tag is kept as (ratio - 1)
+// scaled by 2^ONEWAY_RANGE_SKEW_Q. 40 bits keeps the error well below a
+// DW1000 time unit over a whole ranging event.
+#define ONEWAY_RANGE_SKEW_Q 40
+
+// Time of flight values carry this many fractional bits of a DW1000 time
+// unit so that the /2 for the one way TOF doesn't throw away precision.
+#define ONEWAY_RANGE_TOF_Q 8
+
+// The largest crystal offset we believe between an anchor and the tag.
+// Both sides are 20 ppm parts, so anything past this is a bad timestamp.
+// Expressed as a divisor: |ratio - 1| must be less than 1/4096 (~244 ppm).
+#define ONEWAY_RANGE_MAX_SKEW_DIVISOR 4096
+
+// The skew fit needs polls spread out in time on the same channel to be
+// trustworthy. It must be at least as good as two polls this far apart.
+#define ONEWAY_RANGE_MIN_SKEW_SPAN_US 10000
+
+
+/******************************************************************************/
+// Combining the distances from each poll
+/******************************************************************************/
+
+// The median of a channel and antenna configuration's distances only goes
+// into the range if at least ONEWAY_RANGE_MIN_AGREEING_POLLS of all of the
+// distances, its own included, are within ONEWAY_RANGE_AGREEMENT_MM of it.
+#define ONEWAY_RANGE_AGREEMENT_MM 200
+#define ONEWAY_RANGE_MIN_AGREEING_POLLS 4
+
+
+/******************************************************************************/
+// Parameters for range tracking
+/******************************************************************************/
+
+// Ranges can be tracked across ranging events. Each anchor's range is a
+// 1-D Kalman filter with a random walk between events.
+//
+// How far the range is expected to wander between events, and how noisy a
+// single range is, both as a standard deviation in millimeters.
+#define ONEWAY_RANGE_TRACK_PROCESS_NOISE_MM 150
+#define ONEWAY_RANGE_TRACK_MEASUREMENT_NOISE_MM 150
+
+// A range that moves further than this from the track in one event can't
+// be the tag moving, so it is thrown out and the track is reported instead.
+// If this happens ONEWAY_RANGE_TRACK_MAX_REJECTED times in a row, the track
+// is wrong and starts over from the new range.
+#define ONEWAY_RANGE_TRACK_MAX_JUMP_MM 2000
+#define ONEWAY_RANGE_TRACK_MAX_REJECTED 3
+
+// Forget an anchor after this many events without a range from it.
+#define ONEWAY_RANGE_TRACK_MAX_MISSED 10
+
+
+/******************************************************************************/
+// Clock skew estimation
+/******************************************************************************/
+
+// Running sums for a least squares fit of the anchor's clock against the
+// tag's clock over every poll the anchor heard. Each channel gets its own
+// intercept, since the antenna delays are calibrated per channel, but they
+// all share one slope, which is the skew. The state is the same size no
+// matter how many polls are added.
+//
+// x is the tag's send time relative to a reference poll in units of 2^8
+// DW1000 time units, and r is how much further the anchor's clock moved
+// than the tag's over the same interval.
+typedef struct {
+	uint8_t n[NUM_RANGING_CHANNELS];
+	int64_t sum_x[NUM_RANGING_CHANNELS];
+	int64_t sum_r[NUM_RANGING_CHANNELS];
+	int64_t sum_xx;
+	int64_t sum_xr;
+	int64_t sum_rr;
+} oneway_skew_estimator_t;
+
+
+/******************************************************************************/
+// Range tracking
+/******************************************************************************/
+
+typedef struct {
+	uint8_t  anchor_addr[EUI_LEN];
+	int32_t  range_mm;    // Filtered range
+	uint32_t variance;    // Variance of range_mm in mm^2
+	bool     in_use;
+	uint8_t  missed;      // Events since we last got a range
+	uint8_t  rejected;    // Ranges thrown out in a row by the jump gate
+} oneway_range_track_t;
+
+
+/******************************************************************************/
+// Range calculation functions
+/******************************************************************************/
+
+void oneway_skew_estimator_init (oneway_skew_estimator_t* est);
+void oneway_skew_estimator_add (oneway_skew_estimator_t* est,
+                                uint8_t channel_index,
+                                int64_t tag_offset,
+                                int64_t anchor_offset);
+bool oneway_skew_estimator_get (const oneway_skew_estimator_t* est, int64_t* skew);
+uint16_t oneway_skew_estimator_residual (const oneway_skew_estimator_t* est, int64_t skew);
+
+int oneway_range_percentile (int values[], uint8_t count);
+int oneway_range_diversity_estimate (int distances[],
+                                     uint8_t configurations[],
+                                     uint8_t count,
+                                     uint8_t* num_configurations,
+                                     uint8_t* selected_configuration);
+
+int32_t oneway_range_calculate_anchor (const uint64_t* broadcast_send_times,
+                                       const anchor_responses_t* aresp,
+                                       const int64_t* known_skew,
+                                       int64_t* skew,
+                                       oneway_range_quality_t* quality,
+                                       uint8_t* selected_configuration);
+void oneway_range_track (oneway_range_track_t* tracks,
+                         int32_t* ranges_millimeters,
+                         const anchor_responses_t* anchor_responses,
+                         uint8_t num_anchor_responses);
+
+#endif
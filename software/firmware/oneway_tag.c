@@ -7,13 +7,43 @@
 #include "delay.h"
 #include "dw1000.h"
 #include "oneway_tag.h"
+#include "oneway_range.h"
+#include "oneway_location.h"
 #include "firmware.h"
 
+#ifdef PROFILE_RANGING
+// The DW1000 system time is the only free running clock we have. Its high
+// 32 bits tick every 256 DW1000 time units, or just over 4 ns.
+#define PROFILE_NOW() dwt_readsystimestamphi32()
+#define PROFILE_TICKS_TO_US(_ticks) (((_ticks)*10)/2496)
+#endif
+
 // Functions
+static dw1000_err_e start_ranging_event (bool lwb_slot);
+static void lwb_slot_task ();
+static void start_tag_timer (uint32_t period_us, timer_callback cb);
+static void start_broadcasts ();
+static uint32_t reply_window_us (uint32_t broadcast_mask, uint16_t* slot_us);
+static void tracking_event_task ();
+static void start_tag_delay (uint32_t delay_us, timer_callback cb);
+static void tag_delay_task ();
 static void send_poll ();
+static void send_group_ack ();
+static void send_blink ();
+static void blink_task ();
 static void ranging_broadcast_subsequence_task ();
 static void ranging_listening_window_task ();
-static void calculate_ranges ();
+static void calculate_pending_ranges ();
+static bool heard_expected_anchors ();
+static void update_expected_anchors ();
+static uint32_t choose_broadcasts ();
+static void update_configuration_scores ();
+static oneway_tag_anchor_t* find_anchor (uint8_t* anchor_addr);
+static oneway_tag_anchor_t* add_anchor (uint8_t* anchor_addr);
+static void save_anchor_skew (uint8_t* anchor_addr, int64_t skew);
+#ifdef PROFILE_RANGING
+static void send_profile ();
+#endif
 static void report_range ();
 static void tag_txcallback (const dwt_callback_data_t *txd);
 static void tag_rxcallback (const dwt_callback_data_t *rxd);
@@ -47,7 +77,11 @@ void oneway_tag_init (void *app_scratchspace) {
 		0,                             // Sub Sequence number
 		NUM_RANGING_BROADCASTS-1,
 		RANGING_LISTENING_WINDOW_US,
-		RANGING_LISTENING_SLOT_US
+		RANGING_LISTENING_SLOT_US,
+		ONEWAY_ALL_BROADCASTS_MASK,
+		NUM_RANGING_LISTENING_WINDOWS,
+		FALSE,
+		0
 	};
 
 	// Make sure the SPI speed is slow for this function
@@ -56,17 +90,26 @@ void oneway_tag_init (void *app_scratchspace) {
 	// Setup callbacks to this TAG
 	dwt_setcallbacks(tag_txcallback, tag_rxcallback);
 
-	// Allow data and ack frames
-	dwt_enableframefilter(DWT_FF_DATA_EN | DWT_FF_ACK_EN);
+	// Allow data frames. Anchors are ACKed with a group ACK after each
+	// window, not an ACK frame each.
+	dwt_enableframefilter(DWT_FF_DATA_EN);
 
 	// Setup parameters of how the radio should work
 	dwt_setautorxreenable(TRUE);
 	dwt_setdblrxbuffmode(TRUE);//FALSE);
-	dwt_enableautoack(DW1000_ACK_RESPONSE_TIME);
 
 	// Put source EUI in the pp_tag_poll packet
 	dw1000_read_eui(ot_scratch->pp_tag_poll_pkt.header.sourceAddr);
 
+	// Blinks go out with the same header as the polls
+	ot_scratch->pp_blink_pkt.header = ot_scratch->pp_tag_poll_pkt.header;
+	ot_scratch->pp_blink_pkt.message_type = MSG_TYPE_PP_BLINK;
+	ot_scratch->pp_blink_pkt.blink_idx = 0;
+
+	// Same for the group ACKs
+	ot_scratch->pp_group_ack_pkt.header = ot_scratch->pp_tag_poll_pkt.header;
+	ot_scratch->pp_group_ack_pkt.message_type = MSG_TYPE_PP_GROUP_ACK;
+
 	// Create a timer for use when sending ranging broadcast packets
 	if (ot_scratch->tag_timer == NULL) {
 		ot_scratch->tag_timer = timer_init();
@@ -80,12 +123,28 @@ void oneway_tag_init (void *app_scratchspace) {
 
 	// LPM now schedules all of our ranging events!
 	lwb_set_sched_request(TRUE);
-	lwb_set_sched_callback(oneway_tag_start_ranging_event);
+	lwb_set_sched_callback(lwb_slot_task);
+}
+
+// Called at the start of each LWB slot the tag is scheduled in
+static void lwb_slot_task () {
+	start_ranging_event(TRUE);
 }
 
 // This starts a ranging event by causing the tag to send a series of
 // ranging broadcasts.
 dw1000_err_e oneway_tag_start_ranging_event () {
+	return start_ranging_event(FALSE);
+}
+
+// Other tags can be ranging in the same LWB slot, offset in time. Every
+// tag in the slot then sends all of the polls and listens in full windows,
+// so it doesn't matter which of them the anchors follow. The anchors
+// follow the first one, which is at phase 0, and move to the next
+// subsequence's channel and antenna right after each of its polls. The
+// tags after it skip the first poll and so poll a subsequence ahead, on
+// the settings the anchors just moved to.
+static dw1000_err_e start_ranging_event (bool lwb_slot) {
 	dw1000_err_e err;
 
 	if (ot_scratch->state != TSTATE_IDLE) {
@@ -112,6 +171,56 @@ dw1000_err_e oneway_tag_start_ranging_event () {
 		return err;
 	}
 
+	ot_scratch->pipelined = lwb_slot &&
+		lwb_get_pipeline_phase(&(ot_scratch->pipeline_phase), &(ot_scratch->pipeline_start_offset_us));
+	if (!ot_scratch->pipelined) {
+		ot_scratch->pipeline_phase = 0;
+		ot_scratch->pipeline_start_offset_us = 0;
+	}
+
+	// In blink mode the anchors do all of the work. Just send the blinks.
+	if (oneway_get_config()->blink_mode) {
+		ot_scratch->state = TSTATE_BLINKS;
+		ot_scratch->blink_num = 0;
+		ot_scratch->pp_blink_pkt.header.seqNum++;
+		start_tag_timer(RANGING_BROADCASTS_PERIOD_US, blink_task);
+		return DW1000_NO_ERR;
+	}
+
+	// In tracking mode, fill this LWB slot with tracking events, unless it
+	// is time to measure the clock skews again. Without any skews there is
+	// nothing to track with. A shared slot only has room for full events.
+	ot_scratch->tracking_event = FALSE;
+	ot_scratch->tracking_events_left = 0;
+	if (oneway_get_config()->update_rate == ONEWAY_UPDATE_RATE_TRACKING && !ot_scratch->pipelined) {
+		bool have_skew = FALSE;
+		for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+			have_skew |= ot_scratch->anchors[i].have_skew;
+		}
+
+		if (have_skew && ot_scratch->slots_since_full_event < ONEWAY_TAG_TRACKING_FULL_INTERVAL) {
+			ot_scratch->tracking_event = TRUE;
+			// A tracking event is always shorter than a full one, so run at
+			// least one even if they don't all fit in the slot.
+			uint16_t slot_us;
+			uint8_t events_per_slot =
+				ONEWAY_TAG_TRACKING_EVENTS_PER_SLOT(reply_window_us(ONEWAY_TRACKING_BROADCASTS_MASK, &slot_us));
+			if (events_per_slot > 1) {
+				ot_scratch->tracking_events_left = events_per_slot - 1;
+			}
+			ot_scratch->slots_since_full_event++;
+		} else {
+			ot_scratch->slots_since_full_event = 0;
+		}
+	}
+
+	start_broadcasts();
+
+	return DW1000_NO_ERR;
+}
+
+// Set up for a new ranging event and start sending the polls.
+static void start_broadcasts () {
 	// Move to the broadcast state
 	ot_scratch->state = TSTATE_BROADCASTS;
 
@@ -119,10 +228,127 @@ dw1000_err_e oneway_tag_start_ranging_event () {
 	memset(ot_scratch->ranging_broadcast_ss_send_times, 0, sizeof(ot_scratch->ranging_broadcast_ss_send_times));
 	ot_scratch->ranging_broadcast_ss_num = 0;
 
+	// Let the anchors know if they should follow another tag in this slot
+	ot_scratch->pp_tag_poll_pkt.pipeline_phase = ot_scratch->pipeline_phase;
+
+	// Pick which broadcasts to send and how long to listen. Both masks
+	// start with the first broadcast, which only tags after the first in
+	// a shared LWB slot skip.
+	if (ot_scratch->tracking_event) {
+		ot_scratch->pp_tag_poll_pkt.broadcast_mask = ONEWAY_TRACKING_BROADCASTS_MASK;
+		ot_scratch->pp_tag_poll_pkt.reply_windows = 1;
+		ot_scratch->pp_tag_poll_pkt.tracking = TRUE;
+	} else {
+		if (ot_scratch->pipelined) {
+			ot_scratch->pp_tag_poll_pkt.broadcast_mask = ONEWAY_ALL_BROADCASTS_MASK;
+			if (ot_scratch->pipeline_phase > 0) {
+				ot_scratch->pp_tag_poll_pkt.broadcast_mask &= ~1UL;
+				ot_scratch->ranging_broadcast_ss_num =
+					oneway_next_subsequence(ot_scratch->pp_tag_poll_pkt.broadcast_mask, 0);
+			}
+		} else {
+			ot_scratch->pp_tag_poll_pkt.broadcast_mask = choose_broadcasts();
+		}
+		ot_scratch->pp_tag_poll_pkt.reply_windows = NUM_RANGING_LISTENING_WINDOWS;
+		ot_scratch->pp_tag_poll_pkt.tracking = FALSE;
+
+		// This event measures the skews again. Forget the ones that
+		// haven't been measured for a while.
+		for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+			oneway_tag_anchor_t* anchor = &(ot_scratch->anchors[i]);
+			if (anchor->have_skew && ++anchor->skew_age > ONEWAY_TAG_TRACKING_MAX_SKEW_AGE) {
+				anchor->have_skew = FALSE;
+			}
+		}
+	}
+
+	// Only listen as long as the anchors we expect need to respond
+	uint16_t slot_us;
+	ot_scratch->pp_tag_poll_pkt.anchor_reply_window_in_us =
+		reply_window_us(ot_scratch->pp_tag_poll_pkt.broadcast_mask, &slot_us);
+	ot_scratch->pp_tag_poll_pkt.anchor_reply_slot_time_in_us = slot_us;
+#ifdef PROFILE_RANGING
+	ot_scratch->profile_calculate_ranges = 0;
+	ot_scratch->profile_last_calculate_ranges = 0;
+	ot_scratch->profile_track = 0;
+	ot_scratch->profile_report = 0;
+#endif
+
 	// Start a timer that will kick off the broadcast ranging events
-	timer_start(ot_scratch->tag_timer, RANGING_BROADCASTS_PERIOD_US, ranging_broadcast_subsequence_task);
+	start_tag_timer(RANGING_BROADCASTS_PERIOD_US, ranging_broadcast_subsequence_task);
+}
 
-	return DW1000_NO_ERR;
+// Start the tag timer. The first callback is right away, unless we share
+// the LWB slot and it isn't our turn yet.
+static void start_tag_timer (uint32_t period_us, timer_callback cb) {
+	timer_start(ot_scratch->tag_timer, period_us, cb);
+	if (ot_scratch->pipeline_start_offset_us > 0) {
+		timer_reset(ot_scratch->tag_timer, period_us - ot_scratch->pipeline_start_offset_us);
+	}
+}
+
+// Work out how long each anchor reply window should be, and how long the
+// slots in it are. Each slot fits one ANC_FINAL at the current data rate,
+// which is shorter when fewer polls are sent. There are enough slots for
+// every anchor with a slot from the glossy master, or for the anchors that
+// responded recently if there are none.
+static uint32_t reply_window_us (uint32_t broadcast_mask, uint16_t* slot_us) {
+	uint8_t num_broadcasts = oneway_subsequence_position(broadcast_mask, NUM_RANGING_BROADCASTS);
+	uint16_t frame_len = sizeof(struct pp_anc_final_compact) -
+		((NUM_RANGING_BROADCASTS - num_broadcasts) * sizeof(uint16_t));
+	*slot_us = dw1000_preamble_time_in_us() + dw1000_packet_data_time_in_us(frame_len) +
+		ONEWAY_TAG_REPLY_SLOT_GUARD_US;
+
+	uint8_t num_slots = glossy_get_num_anchor_slots();
+	if (num_slots == 0) {
+		for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+			if (ot_scratch->anchors[i].expected) {
+				num_slots += ONEWAY_TAG_SLOTS_PER_EXPECTED_ANCHOR;
+			}
+		}
+	}
+
+	if (num_slots < ONEWAY_TAG_MIN_REPLY_SLOTS) {
+		num_slots = ONEWAY_TAG_MIN_REPLY_SLOTS;
+	}
+
+	// Full events listen for the whole time every so often, so anchors
+	// that don't fit yet get found. Tags sharing an LWB slot always do, as
+	// the anchors use the window of whichever tag they follow. Never
+	// listen longer than the profile allows.
+	uint32_t window_us = num_slots * (*slot_us);
+	if (ot_scratch->pipelined ||
+	    (!ot_scratch->tracking_event &&
+	     ot_scratch->events_since_full_listen >= ONEWAY_TAG_FULL_LISTEN_INTERVAL) ||
+	    window_us > RANGING_LISTENING_WINDOW_US) {
+		window_us = RANGING_LISTENING_WINDOW_US;
+	}
+
+	return window_us;
+}
+
+// Start the next tracking event in this LWB slot.
+static void tracking_event_task () {
+	timer_stop(ot_scratch->tag_timer);
+	if (ot_scratch->state == TSTATE_IDLE) {
+		start_broadcasts();
+	}
+}
+
+// Call cb once, delay_us from now. The timer calls back as soon as it is
+// started, so that first call is skipped.
+static void start_tag_delay (uint32_t delay_us, timer_callback cb) {
+	ot_scratch->delay_callback = cb;
+	ot_scratch->delay_armed = FALSE;
+	timer_start(ot_scratch->tag_timer, delay_us, tag_delay_task);
+}
+
+static void tag_delay_task () {
+	if (!ot_scratch->delay_armed) {
+		ot_scratch->delay_armed = TRUE;
+		return;
+	}
+	ot_scratch->delay_callback();
 }
 
 // Put the TAG into sleep mode
@@ -141,6 +367,16 @@ void oneway_tag_stop () {
 	//dw1000_sleep();
 }
 
+// Save where the host says an anchor is. Returns FALSE if it was out of
+// range or there wasn't room.
+bool oneway_tag_set_anchor_location (uint8_t* anchor_addr, int32_t x_mm, int32_t y_mm, int32_t z_mm) {
+	return oneway_location_set_anchor(&(ot_scratch->location), anchor_addr, x_mm, y_mm, z_mm);
+}
+
+void oneway_tag_clear_anchor_locations () {
+	oneway_location_clear_anchors(&(ot_scratch->location));
+}
+
 // Called after the TAG has transmitted a packet.
 static void tag_txcallback (const dwt_callback_data_t *data) {
 	glossy_process_txcallback();
@@ -160,9 +396,30 @@ static void tag_txcallback (const dwt_callback_data_t *data) {
 			// Init some state
 			ot_scratch->ranging_listening_window_num = 0;
 			ot_scratch->anchor_response_count = 0;
+			ot_scratch->anchor_ranges_calculated = 0;
+			ot_scratch->end_listening_early = FALSE;
+			ot_scratch->group_ack_next = FALSE;
+
+			// Clear array, don't use memset
+			for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+				ot_scratch->ranges_millimeters[i] = INT32_MAX;
+			}
 
 			// Start a timer to switch between the windows
-			timer_start(ot_scratch->tag_timer, RANGING_LISTENING_WINDOW_US + RANGING_LISTENING_WINDOW_PADDING_US*2, ranging_listening_window_task);
+			ot_scratch->listening_window_period_us =
+				RANGING_LISTENING_WINDOW_PERIOD_US(ot_scratch->pp_tag_poll_pkt.anchor_reply_window_in_us);
+			timer_start(ot_scratch->tag_timer,
+			            ot_scratch->listening_window_period_us,
+			            ranging_listening_window_task);
+
+			// Tags after the first in a shared LWB slot were a poll ahead,
+			// so wait out that poll to line up with the anchors' windows.
+			// They are still a little behind the first tag, which keeps
+			// the group ACKs apart.
+			if (ot_scratch->pipeline_phase > 0) {
+				timer_reset(ot_scratch->tag_timer,
+				            ot_scratch->listening_window_period_us - RANGING_BROADCASTS_PERIOD_US);
+			}
 
 		} else {
 			// We don't need to do anything on TX done for any other states
@@ -194,24 +451,27 @@ static void tag_rxcallback (const dwt_callback_data_t* rxd) {
 		dwt_readrxdata(buf, MIN(ONEWAY_TAG_MAX_RX_PKT_LEN, rxd->datalength), 0);
 		message_type = buf[offsetof(struct pp_anc_final, message_type)];
 
-		if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL) {
+		if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL ||
+		    message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT) {
 			// This is what we were looking for, an ANC_FINAL packet
-			struct pp_anc_final* anc_final;
-
 			if (ot_scratch->anchor_response_count >= MAX_NUM_ANCHOR_RESPONSES) {
 				// Nowhere to store this, so we have to ignore this
 				return;
 			}
 
-			// Continue parsing the received packet
-			anc_final = (struct pp_anc_final*) buf;
+			// Parse it straight into the next free response. It only counts
+			// once anchor_response_count is incremented.
+			anchor_responses_t* aresp = &(ot_scratch->anchor_responses[ot_scratch->anchor_response_count]);
+			if (!oneway_anc_final_unpack(buf, MIN(ONEWAY_TAG_MAX_RX_PKT_LEN, rxd->datalength), aresp)) {
+				return;
+			}
 
 			// Check that we haven't already received a packet from this anchor.
 			// The anchors should check for an ACK and not retransmit, but that
 			// could still fail.
 			bool anc_already_found = FALSE;
 			for (uint8_t i=0; i<ot_scratch->anchor_response_count; i++) {
-				if (memcmp(ot_scratch->anchor_responses[i].anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN) == 0) {
+				if (memcmp(ot_scratch->anchor_responses[i].anchor_addr, aresp->anchor_addr, EUI_LEN) == 0) {
 					anc_already_found = TRUE;
 					break;
 				}
@@ -220,34 +480,43 @@ static void tag_rxcallback (const dwt_callback_data_t* rxd) {
 			// Only save this response if we haven't already seen this anchor
 			if (!anc_already_found) {
 
-				// Save the anchor address
-				memcpy(ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN);
-
-				// Save the anchor's list of when it received the tag broadcasts
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].tag_poll_first_TOA = anc_final->first_rxd_toa;
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].tag_poll_first_idx = anc_final->first_rxd_idx;
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].tag_poll_last_TOA = anc_final->last_rxd_toa;
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].tag_poll_last_idx = anc_final->last_rxd_idx;
-				memcpy(ot_scratch->anchor_responses[ot_scratch->anchor_response_count].tag_poll_TOAs, anc_final->TOAs, sizeof(anc_final->TOAs));
-
-				// Save the antenna the anchor chose to use when responding to us
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anchor_final_antenna_index = anc_final->final_antenna;
-
-				// Save when the anchor sent the packet we just received
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anc_final_tx_timestamp = anc_final->dw_time_sent;
-
 				// Save when we received the packet.
 				// We have already handled the calibration values so
 				// we don't need to here.
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anc_final_rx_timestamp = dw_rx_timestamp - oneway_get_rxdelay_from_ranging_listening_window(ot_scratch->ranging_listening_window_num - 1);
+				aresp->anc_final_rx_timestamp = dw_rx_timestamp - oneway_get_rxdelay_from_ranging_listening_window(ot_scratch->ranging_listening_window_num - 1);
 
 				// Also need to save what window we are in when we received
 				// this packet. This is used so we know all of the settings
 				// that were used when this packet was sent to us.
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].window_packet_recv = ot_scratch->ranging_listening_window_num - 1;
+				aresp->window_packet_recv = ot_scratch->ranging_listening_window_num - 1;
+
+				// And which reply slot the anchor has, to list it by in the
+				// group ACK. The full ANC_FINAL doesn't say.
+				uint8_t reply_slot = ONEWAY_NO_REPLY_SLOT;
+				if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT) {
+					reply_slot = buf[offsetof(struct pp_anc_final_compact, reply_slot)];
+				}
+				if (reply_slot >= MAX_ANCHOR_SLOTS) {
+					reply_slot = ONEWAY_NO_REPLY_SLOT;
+				}
+				ot_scratch->anchor_reply_slots[ot_scratch->anchor_response_count] = reply_slot;
 
 				// Increment the number of anchors heard from
 				ot_scratch->anchor_response_count++;
+
+				// If that was the last anchor we were waiting on, there's
+				// no need to sit through the rest of the windows. Give any
+				// other reply on the air time to finish and then finish up.
+				// Pipelined tags keep the full window, like reply_window_us().
+				if (!ot_scratch->end_listening_early &&
+				    !ot_scratch->pipelined &&
+				    !ot_scratch->tracking_event &&
+				    ot_scratch->events_since_full_listen < ONEWAY_TAG_FULL_LISTEN_INTERVAL &&
+				    heard_expected_anchors()) {
+					ot_scratch->end_listening_early = TRUE;
+					ot_scratch->group_ack_next = FALSE;
+					start_tag_delay(ONEWAY_TAG_EARLY_END_GRACE_US, ranging_listening_window_task);
+				}
 			}
 
 		} else {
@@ -281,9 +550,6 @@ static void send_poll () {
 	// Record the packet length to send to DW1000
 	uint16_t tx_len = sizeof(struct pp_tag_poll);
 
-	// Vary reply window length depending on baudrate and preamble length
-	//ot_scratch->pp_tag_poll_pkt.anchor_reply_window_in_us = RANGING_LISTENING_WINDOW_US + dw1000_preamble_time_in_us() + dw1000_packet_data_time_in_us(sizeof(struct pp_anc_final));
-
 	// Setup what needs to change in the outgoing packet
 	ot_scratch->pp_tag_poll_pkt.header.seqNum++;
 	ot_scratch->pp_tag_poll_pkt.subsequence = ot_scratch->ranging_broadcast_ss_num;
@@ -308,7 +574,7 @@ static void send_poll () {
 	dwt_writetxdata(tx_len, (uint8_t*) &(ot_scratch->pp_tag_poll_pkt), 0);
 
 	// Start the transmission
-	if (ot_scratch->ranging_broadcast_ss_num == NUM_RANGING_BROADCASTS-1) {
+	if (ot_scratch->state == TSTATE_TRANSITION_TO_ANC_FINAL) {
 		// This is the last broadcast ranging packet, so we want to transition
 		// to RX mode after this packet to receive the responses from the anchors.
 		dwt_setrxaftertxdelay(1); // us
@@ -326,13 +592,112 @@ static void send_poll () {
 	}
 }
 
+// Tell the anchors which of them we have heard from so far this ranging
+// event. Anchors that aren't listed send their response again in the next
+// window.
+static void send_group_ack () {
+	uint16_t slot_mask = 0;
+	uint8_t num_anchors = 0;
+	for (uint8_t i=0; i<ot_scratch->anchor_response_count; i++) {
+		uint8_t reply_slot = ot_scratch->anchor_reply_slots[i];
+		if (reply_slot != ONEWAY_NO_REPLY_SLOT) {
+			slot_mask |= 1 << reply_slot;
+		} else if (num_anchors < ONEWAY_GROUP_ACK_MAX_EUIS) {
+			memcpy(ot_scratch->pp_group_ack_pkt.anchor_ids[num_anchors],
+			       ot_scratch->anchor_responses[i].anchor_addr,
+			       EUI_LEN);
+			num_anchors++;
+		}
+	}
+	ot_scratch->pp_group_ack_pkt.slot_mask = slot_mask;
+	ot_scratch->pp_group_ack_pkt.num_anchors = num_anchors;
+	ot_scratch->pp_group_ack_pkt.header.seqNum++;
+
+	// Only send the ids we filled in
+	uint16_t tx_len = offsetof(struct pp_group_ack, anchor_ids) +
+	                  (num_anchors*EUI_LEN) +
+	                  sizeof(struct ieee154_footer);
+
+	// Make sure we're out of RX mode before attempting to transmit
+	dwt_forcetrxoff();
+
+	dwt_writetxfctrl(tx_len, 0);
+	dwt_writetxdata(tx_len, (uint8_t*) &(ot_scratch->pp_group_ack_pkt), 0);
+	dwt_starttx(DWT_START_TX_IMMEDIATE);
+
+	// MP bug - TX antenna delay needs reprogramming as it is not preserved
+	dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
+}
+
+// Send the next blink. Every blink is on the channel the anchors wait for
+// polls on, and each one goes out a different antenna.
+static void send_blink () {
+	int err;
+	uint16_t tx_len = sizeof(struct pp_blink);
+
+	ot_scratch->pp_blink_pkt.blink_idx = ot_scratch->blink_num;
+
+	// Make sure we're out of RX mode before attempting to transmit
+	dwt_forcetrxoff();
+
+	oneway_set_ranging_broadcast_subsequence_settings(TAG, 0);
+	dw1000_choose_antenna(ot_scratch->blink_num % NUM_ANTENNAS);
+
+	dwt_writetxfctrl(tx_len, 0);
+	dwt_writetxdata(tx_len, (uint8_t*) &(ot_scratch->pp_blink_pkt), 0);
+
+	// Go back to listening after the last one so we still hear the
+	// glossy syncs
+	if (ot_scratch->blink_num == NUM_BLINKS-1) {
+		dwt_setrxaftertxdelay(1);
+		err = dwt_starttx(DWT_START_TX_IMMEDIATE | DWT_RESPONSE_EXPECTED);
+	} else {
+		err = dwt_starttx(DWT_START_TX_IMMEDIATE);
+	}
+
+	// MP bug - TX antenna delay needs reprogramming as it is not preserved
+	dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
+
+	if (err != DWT_SUCCESS) {
+		// Nothing to do, the anchors will just miss this blink
+	}
+}
+
+// Called every RANGING_BROADCASTS_PERIOD_US in blink mode. Sends the
+// blinks and then ends the event, since there is nothing to listen for.
+static void blink_task () {
+	if (ot_scratch->blink_num == NUM_BLINKS) {
+		timer_stop(ot_scratch->tag_timer);
+		ot_scratch->state = TSTATE_IDLE;
+
+		if (oneway_get_config()->sleep_mode) {
+			oneway_tag_stop();
+		}
+		return;
+	}
+
+	send_blink();
+	ot_scratch->blink_num++;
+}
+
 // This is called for each broadcast ranging subsequence interval where
 // the tag sends broadcast packets.
 static void ranging_broadcast_subsequence_task () {
 
-	if (ot_scratch->ranging_broadcast_ss_num == NUM_RANGING_BROADCASTS-1) {
-		// This is our last packet to send. Stop the timer so we don't generate
-		// more packets.
+	// The masks can't have bits past the last broadcast, but make sure we
+	// never send past the end of the send times anyway
+	if (ot_scratch->ranging_broadcast_ss_num >= NUM_RANGING_BROADCASTS) {
+		timer_stop(ot_scratch->tag_timer);
+		ot_scratch->state = TSTATE_IDLE;
+		return;
+	}
+
+	uint8_t next_ss_num = oneway_next_subsequence(ot_scratch->pp_tag_poll_pkt.broadcast_mask,
+	                                              ot_scratch->ranging_broadcast_ss_num);
+
+	if (next_ss_num == NUM_RANGING_BROADCASTS) {
+		// This is our last packet to send, whichever broadcasts are in the
+		// mask. Stop the timer so we don't generate more packets.
 		timer_stop(ot_scratch->tag_timer);
 
 		// Also update the state to say that we are moving to RX mode
@@ -345,19 +710,38 @@ static void ranging_broadcast_subsequence_task () {
 
 	// Actually send the packet
 	send_poll();
-	ot_scratch->ranging_broadcast_ss_num += 1;
+	ot_scratch->ranging_broadcast_ss_num = next_ss_num;
 }
 
 // This is called after the broadcasts have been sent in order to receive
 // the responses from the anchors.
 static void ranging_listening_window_task () {
 
-	// Stop after the last of the receive windows
-	if (ot_scratch->ranging_listening_window_num == NUM_RANGING_LISTENING_WINDOWS) {
+	// Once the anchors' replies in this window are done, tell them who we
+	// heard. The timer is moved so the next window still starts on time.
+	if (ot_scratch->group_ack_next) {
+		ot_scratch->group_ack_next = FALSE;
+		timer_reset(ot_scratch->tag_timer,
+		            ot_scratch->pp_tag_poll_pkt.anchor_reply_window_in_us +
+		            RANGING_LISTENING_WINDOW_PADDING_US + ONEWAY_GROUP_ACK_GUARD_US);
+		send_group_ack();
+		return;
+	}
+
+	// Stop after the last of the receive windows, or once everyone we
+	// expected has responded
+	if (ot_scratch->ranging_listening_window_num == ot_scratch->pp_tag_poll_pkt.reply_windows ||
+	    ot_scratch->end_listening_early) {
 		timer_stop(ot_scratch->tag_timer);
 
-		// Stop the radio
-		dwt_forcetrxoff();
+		if (ot_scratch->end_listening_early) {
+			// The anchors would keep responding in the windows we're
+			// skipping, so let them know they can stop
+			send_group_ack();
+		} else {
+			// Stop the radio
+			dwt_forcetrxoff();
+		}
 
 		// This function finishes up this ranging event.
 		report_range();
@@ -373,6 +757,19 @@ static void ranging_listening_window_task () {
 		// Increment and wait
 		ot_scratch->ranging_listening_window_num++;
 
+		// Send a group ACK at the end of every window but the last
+		if (ot_scratch->ranging_listening_window_num < ot_scratch->pp_tag_poll_pkt.reply_windows) {
+			ot_scratch->group_ack_next = TRUE;
+			timer_reset(ot_scratch->tag_timer,
+			            ot_scratch->listening_window_period_us -
+			            (ot_scratch->pp_tag_poll_pkt.anchor_reply_window_in_us +
+			             RANGING_LISTENING_WINDOW_PADDING_US + ONEWAY_GROUP_ACK_GUARD_US));
+		}
+
+		// The radio is listening again, so use the padding at the start of
+		// the window to work through the ANC_FINALs we got in the last one.
+		calculate_pending_ranges();
+
 	}
 }
 
@@ -381,8 +778,15 @@ static void report_range () {
 	// New state
 	ot_scratch->state = TSTATE_CALCULATE_RANGE;
 
-	// Calculate ranges
-	//calculate_ranges();
+	// Calculate ranges. Only the anchors that responded in the last window
+	// should be left at this point.
+#ifdef PROFILE_RANGING
+	uint32_t profile_start = PROFILE_NOW();
+	calculate_pending_ranges();
+	ot_scratch->profile_last_calculate_ranges = PROFILE_NOW() - profile_start;
+#else
+	calculate_pending_ranges();
+#endif
 
 	// Push data out over UART if configured to do so
 #ifdef UART_DATA_OFFLOAD
@@ -429,203 +833,349 @@ static void report_range () {
 	// these right back to the host, or we can try to get the anchors
 	// to calculate location.
 	oneway_report_mode_e report_mode = oneway_get_config()->report_mode;
-	if (report_mode == ONEWAY_REPORT_MODE_RANGES) {
-		// We're done, so go to idle.
-		ot_scratch->state = TSTATE_IDLE;
 
+	// Smooth the ranges with what we got in earlier ranging events before
+	// they get used for anything.
+#ifdef PROFILE_RANGING
+	profile_start = PROFILE_NOW();
+#endif
+	if (oneway_get_config()->filter_ranges) {
+		oneway_range_track(ot_scratch->range_tracks,
+		                   ot_scratch->ranges_millimeters,
+		                   ot_scratch->anchor_responses,
+		                   ot_scratch->anchor_response_count);
+	}
+#ifdef PROFILE_RANGING
+	ot_scratch->profile_track = PROFILE_NOW() - profile_start;
+	profile_start = PROFILE_NOW();
+#endif
+
+	// Remember who responded so next time we know when we can stop early,
+	// and learn which broadcasts are worth sending. Tracking events only
+	// listen on one channel, so they'd throw both off.
+	if (!ot_scratch->tracking_event) {
+		update_expected_anchors();
+		update_configuration_scores();
+	}
+
+	// We're done, so go to idle.
+	ot_scratch->state = TSTATE_IDLE;
+
+	if (report_mode == ONEWAY_REPORT_MODE_RANGES) {
 		// Just need to send the ranges back to the host. Send the array
 		// of ranges to the main application and let it deal with it.
 		// This also returns control to the main application and signals
 		// the end of the ranging event.
-		oneway_set_ranges(ot_scratch->ranges_millimeters, ot_scratch->anchor_responses);
-
-		// Check if we should try to sleep after the ranging event.
-		if (oneway_get_config()->sleep_mode) {
-			// Call stop() to sleep, it will be woken up automatically on
-			// the next call to start_ranging_event().
-			oneway_tag_stop();
-		}
+		oneway_set_ranges(ot_scratch->ranges_millimeters,
+		                  ot_scratch->anchor_responses,
+		                  ot_scratch->range_quality);
 
 	} else if (report_mode == ONEWAY_REPORT_MODE_LOCATION) {
-		// TODO: implement this
+		// Work out where we are from the ranges and the anchor locations
+		// the host gave us. The host still gets told when we can't, so it
+		// knows the ranging event is over.
+		oneway_location_t location;
+		memset(&location, 0, sizeof(oneway_location_t));
+		oneway_location_calculate(&(ot_scratch->location),
+		                          ot_scratch->ranges_millimeters,
+		                          ot_scratch->anchor_responses,
+		                          ot_scratch->anchor_response_count,
+		                          &location);
+		oneway_set_location(&location);
 	}
-}
 
+#ifdef PROFILE_RANGING
+	ot_scratch->profile_report = PROFILE_NOW() - profile_start;
+	send_profile();
+#endif
 
-// After getting responses from anchors calculate the range to each anchor.
-// These values are stored in ot_scratch->ranges_millimeters.
-static void calculate_ranges () {
-	// Clear array, don't use memset
-	for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
-		ot_scratch->ranges_millimeters[i] = INT32_MAX;
+	// Run the next tracking event if there's room left in the slot.
+	if (ot_scratch->tracking_events_left > 0) {
+		ot_scratch->tracking_events_left--;
+		start_tag_delay(ONEWAY_TAG_TRACKING_GAP_US, tracking_event_task);
+		return;
 	}
 
-	// Iterate through all anchors to calculate the range from the tag
-	// to each anchor
-	for (uint8_t anchor_index=0; anchor_index<ot_scratch->anchor_response_count; anchor_index++) {
-		anchor_responses_t* aresp = &(ot_scratch->anchor_responses[anchor_index]);
-
-		// Since the rxd TOAs are compressed to 16 bits, we first need to decompress them back to 64-bit quantities
-		uint64_t tag_poll_TOAs[NUM_RANGING_BROADCASTS];
-		memset(tag_poll_TOAs, 0, sizeof(tag_poll_TOAs));
-
-		// Get an estimate of clock offset
-		double approx_clock_offset = (double)(aresp->tag_poll_last_TOA - aresp->tag_poll_first_TOA) / (double)(ot_scratch->ranging_broadcast_ss_send_times[aresp->tag_poll_last_idx] - ot_scratch->ranging_broadcast_ss_send_times[aresp->tag_poll_first_idx]);
+	// Check if we should try to sleep after the ranging event.
+	if (oneway_get_config()->sleep_mode) {
+		// Call stop() to sleep, it will be woken up automatically on
+		// the next call to start_ranging_event().
+		oneway_tag_stop();
+	}
+}
 
-		// First put in the TOA values that are known
-		tag_poll_TOAs[aresp->tag_poll_first_idx] = aresp->tag_poll_first_TOA;
-		tag_poll_TOAs[aresp->tag_poll_last_idx] = aresp->tag_poll_last_TOA;
 
-		// Then interpolate between the two to find the high 48 bits which fit best
-		uint8_t ii;
-		for(ii=aresp->tag_poll_first_idx+1; ii < aresp->tag_poll_last_idx; ii++){
-			uint64_t estimated_TOA = aresp->tag_poll_first_TOA + (approx_clock_offset*(ot_scratch->ranging_broadcast_ss_send_times[ii] - ot_scratch->ranging_broadcast_ss_send_times[aresp->tag_poll_first_idx]));
+// Calculate the range to each anchor whose ANC_FINAL we have received but
+// not processed yet. This is called between listening windows, rather than
+// in the RX callback, so we don't hold up receiving the next response.
+// These values are stored in ot_scratch->ranges_millimeters.
+static void calculate_pending_ranges () {
+#ifdef PROFILE_RANGING
+	uint32_t profile_start = PROFILE_NOW();
+#endif
+	while (ot_scratch->anchor_ranges_calculated < ot_scratch->anchor_response_count) {
+		uint8_t anchor_index = ot_scratch->anchor_ranges_calculated;
+		anchor_responses_t* aresp = &(ot_scratch->anchor_responses[anchor_index]);
+		ot_scratch->anchor_ranges_calculated++;
+
+		// Tracking events need the skew from the last full event
+		const int64_t* known_skew = NULL;
+		int64_t saved_skew;
+		if (ot_scratch->tracking_event) {
+			oneway_tag_anchor_t* anchor = find_anchor(aresp->anchor_addr);
+			if (anchor == NULL || !anchor->have_skew) {
+				ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+				memset(&(ot_scratch->range_quality[anchor_index]), 0, sizeof(oneway_range_quality_t));
+				continue;
+			}
+			saved_skew = anchor->skew;
+			known_skew = &saved_skew;
+		}
 
-			uint64_t actual_TOA = (estimated_TOA & 0xFFFFFFFFFFFF0000ULL) + aresp->tag_poll_TOAs[ii];
+		int64_t skew;
+		ot_scratch->ranges_millimeters[anchor_index] =
+			oneway_range_calculate_anchor(ot_scratch->ranging_broadcast_ss_send_times,
+			                              aresp,
+			                              known_skew,
+			                              &skew,
+			                              &(ot_scratch->range_quality[anchor_index]),
+			                              &(ot_scratch->range_configuration[anchor_index]));
+
+		// The quality is all zeros if there was no range
+		if (!ot_scratch->tracking_event && ot_scratch->range_quality[anchor_index].num_polls > 0) {
+			save_anchor_skew(aresp->anchor_addr, skew);
+		}
+	}
+#ifdef PROFILE_RANGING
+	ot_scratch->profile_calculate_ranges += PROFILE_NOW() - profile_start;
+#endif
+}
 
-			// Make corrections if we're off by more than 0x7FFF
-			if(actual_TOA < estimated_TOA - 0x7FFF)
-				actual_TOA += 0x10000;
-			else if(actual_TOA > estimated_TOA + 0x7FFF)
-				actual_TOA -= 0x10000;
+// Check if every anchor in the expected set has responded this ranging
+// event. Returns FALSE if we don't expect anyone yet.
+static bool heard_expected_anchors () {
+	bool expecting_any = FALSE;
 
-			// We're done -- store it...
-			tag_poll_TOAs[ii] = actual_TOA;
+	for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+		oneway_tag_anchor_t* expected = &(ot_scratch->anchors[i]);
+		if (!expected->expected) continue;
+		expecting_any = TRUE;
+
+		bool found = FALSE;
+		for (uint8_t j=0; j<ot_scratch->anchor_response_count; j++) {
+			if (memcmp(expected->anchor_addr, ot_scratch->anchor_responses[j].anchor_addr, EUI_LEN) == 0) {
+				found = TRUE;
+				break;
+			}
 		}
+		if (!found) return FALSE;
+	}
 
-		// First need to calculate the crystal offset between the anchor and tag.
-		// To do this, we need to get the timestamps at the anchor and tag
-		// for packets that are repeated. In the current scheme, the first
-		// three packets are repeated, where three is the number of channels.
-		// If we get multiple matches, we take the average of the clock offsets.
-		uint8_t valid_offset_calculations = 0;
-		double offset_ratios_sum = 0.0;
-		for (uint8_t j=0; j<NUM_RANGING_CHANNELS; j++) {
-			uint8_t first_broadcast_index = j;
-			uint8_t last_broadcast_index = NUM_RANGING_BROADCASTS - NUM_RANGING_CHANNELS + j;
-			uint64_t first_broadcast_send_time = ot_scratch->ranging_broadcast_ss_send_times[first_broadcast_index];
-			uint64_t first_broadcast_recv_time = tag_poll_TOAs[first_broadcast_index];
-			uint64_t last_broadcast_send_time  = ot_scratch->ranging_broadcast_ss_send_times[last_broadcast_index];
-			uint64_t last_broadcast_recv_time  = tag_poll_TOAs[last_broadcast_index];
-
-			// Now lets check that the anchor actually received both of these
-			// packets. If it didn't then this isn't valid.
-			if (first_broadcast_recv_time == 0 || last_broadcast_recv_time == 0) {
-				// A packet was dropped (or the anchor wasn't listening on the
-				// first channel). This isn't useful so we skip it.
-				continue;
-			}
+	return expecting_any;
+}
 
-			// Calculate the "multiplier for the crystal offset between tag
-			// and anchor".
-			// (last_recv-first_recv) / (last_send-first_send)
-			double offset_anchor_over_tag_item = ((double) last_broadcast_recv_time - (double) first_broadcast_recv_time) /
-				((double) last_broadcast_send_time - (double) first_broadcast_send_time);
+// Update the expected set with the anchors that responded this ranging
+// event. Anchors that keep missing events are dropped, and new ones are
+// added if there is room.
+static void update_expected_anchors () {
+	bool heard[MAX_NUM_ANCHOR_RESPONSES] = { FALSE };
 
-			// Add this to the running sum for the average
-			offset_ratios_sum += offset_anchor_over_tag_item;
-			valid_offset_calculations++;
+	for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+		oneway_tag_anchor_t* expected = &(ot_scratch->anchors[i]);
+		if (!expected->expected) continue;
+
+		bool found = FALSE;
+		for (uint8_t j=0; j<ot_scratch->anchor_response_count; j++) {
+			if (memcmp(expected->anchor_addr, ot_scratch->anchor_responses[j].anchor_addr, EUI_LEN) == 0) {
+				heard[j] = TRUE;
+				found = TRUE;
+				break;
+			}
 		}
 
-		// If we didn't get any matching pairs in the first and last rounds
-		// then we have to skip this anchor.
-		if (valid_offset_calculations == 0) {
-			ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
-			continue;
+		if (found) {
+			expected->missed = 0;
+		} else if (++expected->missed >= ONEWAY_TAG_EXPECTED_ANCHOR_MAX_MISSED) {
+			expected->expected = FALSE;
 		}
+	}
 
-		// Calculate the average clock offset multiplier
-		double offset_anchor_over_tag = offset_ratios_sum / (double) valid_offset_calculations;
-
-		// Now we need to use the one packet we have from the anchor
-		// to calculate a one-way time of flight measurement so that we can
-		// account for the time offset between the anchor and tag (i.e. the
-		// tag and anchors are not synchronized). We will use this TOF
-		// to calculate ranges from all of the other polls the tag sent.
-		// To do this, we need to match the anchor_antenna, tag_antenna, and
-		// channel between the anchor response and the correct tag poll.
-		uint8_t ss_index_matching = oneway_get_ss_index_from_settings(aresp->anchor_final_antenna_index,
-		                                                              aresp->window_packet_recv);
-
-		// Exit early if the corresponding broadcast wasn't received
-		if(tag_poll_TOAs[ss_index_matching] == 0){
-			ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
-			continue;
+	for (uint8_t j=0; j<ot_scratch->anchor_response_count; j++) {
+		if (heard[j]) continue;
+		oneway_tag_anchor_t* expected = find_anchor(ot_scratch->anchor_responses[j].anchor_addr);
+		if (expected == NULL) {
+			expected = add_anchor(ot_scratch->anchor_responses[j].anchor_addr);
 		}
+		if (expected != NULL) {
+			expected->expected = TRUE;
+			expected->missed = 0;
+		}
+	}
 
-		uint64_t matching_broadcast_send_time = ot_scratch->ranging_broadcast_ss_send_times[ss_index_matching];
-		uint64_t matching_broadcast_recv_time = tag_poll_TOAs[ss_index_matching];
-		uint64_t response_send_time  = aresp->anc_final_tx_timestamp;
-		uint64_t response_recv_time  = aresp->anc_final_rx_timestamp;
+	if (ot_scratch->events_since_full_listen >= ONEWAY_TAG_FULL_LISTEN_INTERVAL) {
+		ot_scratch->events_since_full_listen = 0;
+	} else {
+		ot_scratch->events_since_full_listen++;
+	}
+}
 
-		double two_way_TOF = (((double) response_recv_time - (double) matching_broadcast_send_time)*offset_anchor_over_tag) -
-			((double) response_send_time - (double) matching_broadcast_recv_time);
-		double one_way_TOF = two_way_TOF / 2.0;
+// Decide which broadcasts to send this ranging event. Without adaptive
+// broadcasts, or when it is time for a full sweep, that is all of them.
+// Otherwise it is the required ones plus the configurations that scored
+// best.
+//
+// The learned broadcasts go between the required ones, so they set how far
+// apart the first broadcasts and the repeats at the end are. If that is too
+// short to measure the clock skew with this profile, send everything.
+static uint32_t choose_broadcasts () {
+	uint32_t shortened_span_us = ((NUM_ANTENNAS*NUM_RANGING_CHANNELS) + ONEWAY_TAG_ADAPTIVE_BROADCASTS) *
+	                             RANGING_BROADCASTS_PERIOD_US;
+	if (!oneway_get_config()->adaptive_broadcasts ||
+	    shortened_span_us < ONEWAY_RANGE_MIN_SKEW_SPAN_US ||
+	    ot_scratch->events_since_full_sweep >= ONEWAY_TAG_FULL_SWEEP_INTERVAL) {
+		ot_scratch->events_since_full_sweep = 0;
+		return ONEWAY_ALL_BROADCASTS_MASK;
+	}
 
+	uint32_t broadcast_mask = ONEWAY_REQUIRED_BROADCASTS_MASK;
+	for (uint8_t n=0; n<ONEWAY_TAG_ADAPTIVE_BROADCASTS; n++) {
+		uint8_t best_ss = NUM_RANGING_BROADCASTS;
+		uint16_t best_score = 0;
+
+		// Each configuration is sent once in the first
+		// NUM_UNIQUE_PACKET_CONFIGURATIONS broadcasts.
+		for (uint8_t ss=0; ss<NUM_UNIQUE_PACKET_CONFIGURATIONS; ss++) {
+			if (broadcast_mask & (1UL << ss)) continue;
+			uint16_t score = ot_scratch->configuration_scores[oneway_subsequence_number_to_configuration(ss)];
+			if (score > best_score) {
+				best_score = score;
+				best_ss = ss;
+			}
+		}
 
-		// Declare an array for sorting the ranges.
-		int distances_millimeters[NUM_RANGING_BROADCASTS] = {0};
-		uint8_t num_valid_distances = 0;
+		if (best_ss == NUM_RANGING_BROADCASTS) {
+			if (n == 0) {
+				// Nothing has worked yet, so we don't know enough to skip
+				// anything.
+				ot_scratch->events_since_full_sweep = 0;
+				return ONEWAY_ALL_BROADCASTS_MASK;
+			}
+			break;
+		}
+		broadcast_mask |= 1UL << best_ss;
+	}
 
-		// Next we calculate the TOFs for each of the poll messages the tag sent.
-		for (uint8_t broadcast_index=0; broadcast_index<NUM_RANGING_BROADCASTS; broadcast_index++) {
-			uint64_t broadcast_send_time = ot_scratch->ranging_broadcast_ss_send_times[broadcast_index];
-			uint64_t broadcast_recv_time = tag_poll_TOAs[broadcast_index];
+	ot_scratch->events_since_full_sweep++;
+	return broadcast_mask;
+}
 
-			// Check that the anchor actually received the tag broadcast.
-			// We use 0 as a sentinel for the anchor not receiving the packet.
-			if (broadcast_recv_time == 0) {
-				continue;
-			}
+// After a full sweep, credit each configuration for the anchors that heard
+// it and the ranges it gave. Shortened events only hear the configurations
+// they already picked, so they don't count.
+static void update_configuration_scores () {
+	if (ot_scratch->pp_tag_poll_pkt.broadcast_mask != ONEWAY_ALL_BROADCASTS_MASK) {
+		return;
+	}
 
-			// We use the reference packet (that we used to calculate one_way_TOF)
-			// to compensate for the unsynchronized clock.
-			int64_t broadcast_anchor_offset = (int64_t) broadcast_recv_time - (int64_t) matching_broadcast_recv_time;
-			int64_t broadcast_tag_offset = (int64_t) broadcast_send_time - (int64_t) matching_broadcast_send_time;
-			double TOF = (double) broadcast_anchor_offset - (((double) broadcast_tag_offset) * offset_anchor_over_tag) + one_way_TOF;
+	for (uint8_t c=0; c<NUM_UNIQUE_PACKET_CONFIGURATIONS; c++) {
+		ot_scratch->configuration_scores[c] -=
+			ot_scratch->configuration_scores[c] >> ONEWAY_TAG_SCORE_DECAY_SHIFT;
+	}
 
-			int distance_millimeters = dwtime_to_millimeters(TOF);
+	for (uint8_t anchor_index=0; anchor_index<ot_scratch->anchor_response_count; anchor_index++) {
+		anchor_responses_t* aresp = &(ot_scratch->anchor_responses[anchor_index]);
 
-			// Check that the distance we have at this point is at all reasonable
-			if (distance_millimeters >= MIN_VALID_RANGE_MM && distance_millimeters <= MAX_VALID_RANGE_MM) {
-				// Add this to our sorted array of distances
-				insert_sorted(distances_millimeters, distance_millimeters, num_valid_distances);
-				num_valid_distances++;
+		for (uint8_t ss=0; ss<NUM_RANGING_BROADCASTS; ss++) {
+			if (ss == aresp->tag_poll_first_idx || ss == aresp->tag_poll_last_idx ||
+			    aresp->tag_poll_TOAs[ss] != 0) {
+				ot_scratch->configuration_scores[oneway_subsequence_number_to_configuration(ss)] += ONEWAY_TAG_SCORE_HEARD;
 			}
 		}
 
-		// Check to make sure that we got enough ranges from this anchor.
-		// If not, we just skip it.
-		if (num_valid_distances < MIN_VALID_RANGES_PER_ANCHOR) {
-			ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_TOO_FEW_RANGES;
-			continue;
+		// The quality is all zeros if there was no range
+		if (ot_scratch->range_quality[anchor_index].num_polls > 0) {
+			ot_scratch->configuration_scores[ot_scratch->range_configuration[anchor_index]] += ONEWAY_TAG_SCORE_SELECTED;
 		}
+	}
+}
 
+// Find what we know about an anchor, or NULL if we don't know it.
+static oneway_tag_anchor_t* find_anchor (uint8_t* anchor_addr) {
+	for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+		oneway_tag_anchor_t* anchor = &(ot_scratch->anchors[i]);
+		if ((anchor->expected || anchor->have_skew) &&
+		    memcmp(anchor->anchor_addr, anchor_addr, EUI_LEN) == 0) {
+			return anchor;
+		}
+	}
+	return NULL;
+}
 
-		// Now that we have all of the calculated ranges from all of the tag
-		// broadcasts we can calculate some percentile range.
-		uint8_t bot = (num_valid_distances*RANGE_PERCENTILE_NUMERATOR)/RANGE_PERCENTILE_DENOMENATOR;
-		uint8_t top = bot+1;
-		// bot represents the whole index of the item at the percentile.
-		// Then we are going to use the remainder decimal portion to get
-		// a scaled value to add to that base. And we are going to do this
-		// without floating point, so buckle up.
-		// EXAMPLE: if the 90th percentile would be index 3.4, we do:
-		//                  distances[3] + 0.4*(distances[4]-distances[3])
-		int32_t result = distances_millimeters[bot] +
-			(((distances_millimeters[top]-distances_millimeters[bot]) * ((RANGE_PERCENTILE_NUMERATOR*num_valid_distances)
-			 - (bot*RANGE_PERCENTILE_DENOMENATOR))) / RANGE_PERCENTILE_DENOMENATOR);
-
-		// Save the result
-		ot_scratch->ranges_millimeters[anchor_index] = result;
-		// ot_scratch->ranges_millimeters[anchor_index] = (int32_t) one_way_TOF;
-		// ot_scratch->ranges_millimeters[anchor_index] = dm;
-		// ot_scratch->ranges_millimeters[anchor_index] = distances_millimeters[bot];
-		// ot_scratch->ranges_millimeters[anchor_index] = ot_scratch->ranging_broadcast_ss_send_times[0];
-		// ot_scratch->ranges_millimeters[anchor_index] = ss_index_matching;
-		// ot_scratch->ranges_millimeters[anchor_index] = num_valid_distances;
-		if (ot_scratch->ranges_millimeters[anchor_index] == INT32_MAX) {
-			ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_MISC;
+// Take a free entry for an anchor, with nothing known about it yet.
+// Returns NULL if there is no room.
+static oneway_tag_anchor_t* add_anchor (uint8_t* anchor_addr) {
+	for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+		oneway_tag_anchor_t* anchor = &(ot_scratch->anchors[i]);
+		if (!anchor->expected && !anchor->have_skew) {
+			memcpy(anchor->anchor_addr, anchor_addr, EUI_LEN);
+			anchor->missed = 0;
+			return anchor;
 		}
 	}
+	return NULL;
 }
+
+// Remember the clock skew a full event measured to an anchor. If there is
+// no room, the anchor with the oldest skew is replaced, or one without a
+// skew if there is one.
+static void save_anchor_skew (uint8_t* anchor_addr, int64_t skew) {
+	oneway_tag_anchor_t* anchor = find_anchor(anchor_addr);
+	if (anchor == NULL) {
+		anchor = add_anchor(anchor_addr);
+	}
+
+	if (anchor == NULL) {
+		anchor = &(ot_scratch->anchors[0]);
+		for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+			oneway_tag_anchor_t* candidate = &(ot_scratch->anchors[i]);
+			if (!candidate->have_skew) {
+				anchor = candidate;
+				break;
+			}
+			if (candidate->skew_age > anchor->skew_age) {
+				anchor = candidate;
+			}
+		}
+		memcpy(anchor->anchor_addr, anchor_addr, EUI_LEN);
+		anchor->expected = FALSE;
+		anchor->missed = 0;
+	}
+
+	anchor->have_skew = TRUE;
+	anchor->skew = (int32_t) skew;
+	anchor->skew_age = 0;
+}
+
+#ifdef PROFILE_RANGING
+// Push how long the range calculations took this ranging event out over
+// UART, in microseconds. data_dump_glossy.py skips over these packets
+// unless it is asked to print them.
+static void send_profile () {
+#ifdef UART_DATA_OFFLOAD
+	const uint8_t header[] = {0x80, 0x01, 0x80, 0x02};
+	uart_write(4, header);
+
+	uint32_t profile_us[4] = {
+		PROFILE_TICKS_TO_US(ot_scratch->profile_calculate_ranges),
+		PROFILE_TICKS_TO_US(ot_scratch->profile_last_calculate_ranges),
+		PROFILE_TICKS_TO_US(ot_scratch->profile_track),
+		PROFILE_TICKS_TO_US(ot_scratch->profile_report)
+	};
+	uart_write(sizeof(uint8_t), &(ot_scratch->anchor_response_count));
+	uart_write(sizeof(profile_us), (uint8_t*) profile_us);
+
+	const uint8_t footer[] = {0x80, 0xfe};
+	uart_write(2, footer);
+#endif
+}
+#endif
@@ -2,6 +2,8 @@
 #define __ONEWAY_TAG_H
 
 #include "oneway_common.h"
+#include "oneway_range.h"
+#include "oneway_location.h"
 #include "deca_device_api.h"
 #include "deca_regs.h"
 
@@ -10,7 +12,8 @@ typedef enum {
 	TSTATE_BROADCASTS,
 	TSTATE_TRANSITION_TO_ANC_FINAL,
 	TSTATE_LISTENING,
-	TSTATE_CALCULATE_RANGE
+	TSTATE_CALCULATE_RANGE,
+	TSTATE_BLINKS
 } tag_state_e;
 
 // ERRORS for reporting to the TAG host what happened with ranges from different
@@ -19,7 +22,7 @@ typedef enum {
 // and if something went wrong with the range an invalid range from below
 // will be returned.
 
-// The ANCHOR did not receive matching packets from the first three cycle.
+// The ANCHOR did not receive enough polls spread out on the same channel.
 // This prevents us from calculating clock skew, and we have to skip this
 // anchor range.
 #define ONEWAY_TAG_RANGE_ERROR_NO_OFFSET 0x80000001
@@ -34,9 +37,82 @@ typedef enum {
 // Size buffers for reading in packets
 #define ONEWAY_TAG_MAX_RX_PKT_LEN 296
 
+// The tag remembers which anchors responded in recent ranging events, and
+// stops listening once all of them have responded again. It waits
+// ONEWAY_TAG_EARLY_END_GRACE_US after the last one in case another reply
+// is on the air, then sends a group ACK so the anchors stop.
+// An anchor is dropped from the set after it misses this many events in
+// a row.
+#define ONEWAY_TAG_EXPECTED_ANCHOR_MAX_MISSED 3
+#define ONEWAY_TAG_EARLY_END_GRACE_US 500
+
+// Every this many ranging events, listen for the whole time anyway so new
+// anchors that respond late in the windows get found.
+#define ONEWAY_TAG_FULL_LISTEN_INTERVAL 10
+
+// The reply windows are sized for the anchors we expect. Each slot fits
+// one ANC_FINAL plus ONEWAY_TAG_REPLY_SLOT_GUARD_US. Anchors without a
+// slot from the glossy master pick their own time, so they get
+// ONEWAY_TAG_SLOTS_PER_EXPECTED_ANCHOR slots each to keep them from
+// colliding. There are always at least ONEWAY_TAG_MIN_REPLY_SLOTS so new
+// anchors have room.
+#define ONEWAY_TAG_REPLY_SLOT_GUARD_US 100
+#define ONEWAY_TAG_SLOTS_PER_EXPECTED_ANCHOR 2
+#define ONEWAY_TAG_MIN_REPLY_SLOTS 4
+
+// With adaptive broadcasts the tag only sends the required broadcasts plus
+// this many of the other configurations, the ones that have worked best.
+// Every ONEWAY_TAG_FULL_SWEEP_INTERVAL events it sends all of them again
+// to re-learn which those are.
+#define ONEWAY_TAG_ADAPTIVE_BROADCASTS 3
+#define ONEWAY_TAG_FULL_SWEEP_INTERVAL 20
+
+// How a configuration is scored during a full sweep. It gains
+// ONEWAY_TAG_SCORE_HEARD for each anchor that heard it, and
+// ONEWAY_TAG_SCORE_SELECTED for each range it supplied. Old scores lose
+// 1/2^ONEWAY_TAG_SCORE_DECAY_SHIFT each sweep.
+#define ONEWAY_TAG_SCORE_HEARD 1
+#define ONEWAY_TAG_SCORE_SELECTED 4
+#define ONEWAY_TAG_SCORE_DECAY_SHIFT 2
+
+// In tracking mode each LWB ranging slot the tag gets is filled with
+// short tracking events, one after another. Every
+// ONEWAY_TAG_TRACKING_FULL_INTERVAL slots it does a full event instead to
+// measure the clock skew to each anchor again. Skews that haven't been
+// measured in ONEWAY_TAG_TRACKING_MAX_SKEW_AGE full events are dropped.
+#define ONEWAY_TAG_TRACKING_FULL_INTERVAL 10
+#define ONEWAY_TAG_TRACKING_MAX_SKEW_AGE 3
+
+// How long one tracking event takes: the polls, one listening window, and
+// a gap so the anchors are back to waiting for polls before the next one.
+#define ONEWAY_TAG_TRACKING_GAP_US RANGING_LISTENING_WINDOW_PADDING_US
+#define ONEWAY_TAG_TRACKING_EVENT_US(_window_us) \
+	((4*RANGING_BROADCASTS_PERIOD_US) + RANGING_LISTENING_WINDOW_PERIOD_US(_window_us) + \
+	 ONEWAY_TAG_TRACKING_GAP_US)
+#define ONEWAY_TAG_TRACKING_EVENTS_PER_SLOT(_window_us) \
+	((uint8_t) (((uint32_t) (LWB_SLOTS_PER_RANGE*LWB_SLOT_US)) / ONEWAY_TAG_TRACKING_EVENT_US(_window_us)))
+
+// What the tag keeps about an anchor between ranging events: whether it
+// expects the anchor to respond, and the clock skew to it for tracking
+// events. The entry is free when it has neither.
+typedef struct {
+	uint8_t anchor_addr[EUI_LEN];
+	bool    expected;
+	uint8_t missed;    // Events in a row this anchor didn't respond in
+	bool    have_skew;
+	uint8_t skew_age;  // Full events since the skew was measured
+	int32_t skew;      // As returned by oneway_range_calculate_anchor(),
+	                   // which keeps it under 2^28
+} oneway_tag_anchor_t;
+
 typedef struct {
 	// Our timer object that we use for timing packet transmissions
 	stm_timer_t* tag_timer;
+
+	// For waiting once with the timer: what to call when the wait is over,
+	// and whether the call timer_start() makes right away has been skipped
+	timer_callback delay_callback;
+	bool delay_armed;
 	
 	tag_state_e state;
 	
@@ -46,23 +122,90 @@ typedef struct {
 	
 	// Which slot we are in when receiving packets from the anchor.
 	uint8_t ranging_listening_window_num;
+
+	// How far apart the listening windows are, and whether the next timer
+	// callback is the group ACK partway through a window instead of the
+	// start of the next one.
+	uint32_t listening_window_period_us;
+	bool group_ack_next;
 	
 	// Array of when we sent each of the broadcast ranging packets
 	uint64_t ranging_broadcast_ss_send_times[NUM_RANGING_BROADCASTS];
 	
 	// How many anchor responses we have gotten
 	uint8_t anchor_response_count;
+
+	// How many of the anchor responses we have already calculated ranges
+	// for. Ranges are calculated between listening windows so that little
+	// work is left when the last window ends.
+	uint8_t anchor_ranges_calculated;
 	
 	// Array of when we received ANC_FINAL packets and from whom
 	anchor_responses_t anchor_responses[MAX_NUM_ANCHOR_RESPONSES];
+
+	// The reply slot each of those anchors said it has, for the group ACK.
+	// ONEWAY_NO_REPLY_SLOT if it doesn't have one.
+	uint8_t anchor_reply_slots[MAX_NUM_ANCHOR_RESPONSES];
 	
 	// These are the ranges we have calculated to a series of anchors.
 	// They use the same index as the _anchor_responses array.
 	// Invalid ranges are marked with INT32_MAX.
 	int32_t ranges_millimeters[MAX_NUM_ANCHOR_RESPONSES];
+
+	// How much each of the ranges above can be trusted.
+	oneway_range_quality_t range_quality[MAX_NUM_ANCHOR_RESPONSES];
+
+	// Which configuration each of the ranges above came from.
+	uint8_t range_configuration[MAX_NUM_ANCHOR_RESPONSES];
+
+	// Filtered range to each anchor we have heard from recently. Unlike
+	// everything above, these are kept across ranging events.
+	oneway_range_track_t range_tracks[MAX_NUM_ANCHOR_RESPONSES];
+
+	// Anchor locations from the host, for the location report mode
+	oneway_location_state_t location;
 	
+	// Anchors that responded in recent ranging events, and whether we can
+	// stop listening once the expected ones all have this time.
+	oneway_tag_anchor_t anchors[MAX_NUM_ANCHOR_RESPONSES];
+	uint8_t events_since_full_listen;
+	bool end_listening_early;
+
+	// How well each configuration has worked in recent full sweeps, which
+	// picks the broadcasts to send in between.
+	uint16_t configuration_scores[NUM_UNIQUE_PACKET_CONFIGURATIONS];
+	uint8_t events_since_full_sweep;
+
+	// Tracking mode. Whether this is a tracking event and how many more to
+	// run in this LWB slot. The skews they use are in anchors.
+	bool tracking_event;
+	uint8_t tracking_events_left;
+	uint8_t slots_since_full_event;
+
+	// Whether other tags share this LWB slot, which of them we are, and
+	// how long after the start of the slot we start
+	bool pipelined;
+	uint8_t pipeline_phase;
+	uint32_t pipeline_start_offset_us;
+
 	// Prepopulated struct of the outgoing broadcast poll packet.
 	struct pp_tag_poll pp_tag_poll_pkt;
+
+	// And the group ACK sent after each listening window
+	struct pp_group_ack pp_group_ack_pkt;
+
+	// Same for blink mode, and which blink we are on
+	struct pp_blink pp_blink_pkt;
+	uint8_t blink_num;
+
+#ifdef PROFILE_RANGING
+	// How long each part of the range calculation took this ranging event,
+	// in DW1000 system time ticks (256 DW1000 time units each).
+	uint32_t profile_calculate_ranges;      // All calls to calculate_pending_ranges()
+	uint32_t profile_last_calculate_ranges; // The call after the last window
+	uint32_t profile_track;                 // oneway_range_track()
+	uint32_t profile_report;                // Setting the ranges or location
+#endif
 } oneway_tag_scratchspace_struct;
 
 oneway_tag_scratchspace_struct *ot_scratch;
@@ -70,5 +213,7 @@ oneway_tag_scratchspace_struct *ot_scratch;
 void oneway_tag_init (void *app_scratchspace);
 dw1000_err_e oneway_tag_start_ranging_event ();
 void oneway_tag_stop ();
+bool oneway_tag_set_anchor_location (uint8_t* anchor_addr, int32_t x_mm, int32_t y_mm, int32_t z_mm);
+void oneway_tag_clear_anchor_locations ();
 
 #endif
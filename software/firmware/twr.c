@@ -0,0 +1,398 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "deca_device_api.h"
+#include "deca_regs.h"
+
+#include "twr.h"
+#include "dw1000.h"
+#include "host_interface.h"
+#include "timer.h"
+#include "firmware.h"
+
+static void twr_init ();
+static void start_listening ();
+static bool send_delayed (uint8_t* pkt, uint16_t len, uint32_t delay_time, uint64_t* tx_time);
+static void finish_range (int32_t range_mm);
+static int32_t calculate_range (struct pp_twr_report* report);
+static void timeout_task ();
+static void twr_txcallback (const dwt_callback_data_t *txd);
+static void twr_rxcallback (const dwt_callback_data_t *rxd);
+
+// All of the configuration passed to us by the host for how this application
+// should operate.
+static twr_config_t _config;
+
+// Timer for giving up on an exchange. Kept out of the scratchspace so
+// reconfiguring doesn't use up another one.
+static stm_timer_t* _twr_timer;
+
+// Buffer for the range sent to the host. Same layout as the oneway ranges:
+// the number of ranges, then the anchor id and range.
+static uint8_t _anchor_id_range[1+EUI_LEN+sizeof(int32_t)];
+
+// This sets the settings for this node and initializes the node.
+void twr_configure (twr_config_t* config, void *app_scratchspace) {
+	tw_scratch = (twr_scratchspace_struct*) app_scratchspace;
+
+	// Save the settings
+	memcpy(&_config, config, sizeof(twr_config_t));
+
+	// Make sure the DW1000 is awake before trying to do anything.
+	dw1000_wakeup();
+
+	// Everything from here on uses the radio settings and timing of the
+	// profile the host asked for
+	dw1000_set_profile(_config.profile);
+
+	twr_init();
+}
+
+static void twr_init () {
+	// Both ends use the same header, just with different addresses and
+	// no ACK request.
+	struct ieee154_header_unicast header = {
+		.frameCtrl = {
+			0x41, // FCF[0]: data frame, panid compression
+			0xCC  // FCF[1]: ext source, ext destination
+		},
+		.seqNum = 0,
+		.panID = {
+			POLYPOINT_PANID & 0xFF,
+			POLYPOINT_PANID >> 8,
+		},
+		.destAddr = { 0 },    // (blank for now)
+		.sourceAddr = { 0 },  // (blank for now)
+	};
+	dw1000_read_eui(header.sourceAddr);
+	tw_scratch->msg_pkt.header = header;
+	tw_scratch->report_pkt.header = header;
+	tw_scratch->report_pkt.message_type = MSG_TYPE_PP_TWR_REPORT;
+
+	// Make sure the SPI speed is slow for this function
+	dw1000_spi_slow();
+
+	// Setup callbacks for TWR
+	dwt_setcallbacks(twr_txcallback, twr_rxcallback);
+
+	// Make sure the radio starts off
+	dwt_forcetrxoff();
+
+	// Only take data packets addressed to us
+	dwt_enableframefilter(DWT_FF_DATA_EN);
+
+	// Automatically go back to receive
+	dwt_setautorxreenable(TRUE);
+
+	// Don't use these
+	dwt_setdblrxbuffmode(FALSE);
+	dwt_setrxtimeout(FALSE);
+
+	// Replies go out once the packet they answer has been received and
+	// handled, and the reply's preamble has been sent.
+	tw_scratch->reply_delay = DW_DELAY_FROM_US(dw1000_packet_data_time_in_us(sizeof(struct pp_twr_msg)) +
+	                                           TWR_REPLY_PROCESSING_US +
+	                                           dw1000_preamble_time_in_us());
+
+	if (_twr_timer == NULL) {
+		_twr_timer = timer_init();
+	}
+
+	// Make SPI fast now that everything has been setup
+	dw1000_spi_fast();
+
+	// Reset our state because nothing should be in progress if we call init()
+	tw_scratch->state = TWR_STATE_IDLE;
+}
+
+// Kick off the application. Anchors start listening for polls, tags wait
+// for the host to ask for a range.
+dw1000_err_e twr_start () {
+	dw1000_err_e err;
+
+	// Make sure the DW1000 is awake.
+	err = dw1000_wakeup();
+	if (err == DW1000_WAKEUP_SUCCESS) {
+		// We did wake the chip, so reconfigure it properly
+		twr_init();
+	} else if (err) {
+		// Chip did not seem to wakeup. This is not good, so we have
+		// to reset the application.
+		return err;
+	}
+
+	tw_scratch->state = TWR_STATE_IDLE;
+	if (_config.my_role == ANCHOR) {
+		start_listening();
+	}
+
+	return DW1000_NO_ERR;
+}
+
+// Stop the TWR application. This cancels any exchange in progress.
+void twr_stop () {
+	tw_scratch->state = TWR_STATE_IDLE;
+
+	// Stop the timer in case it was in use
+	timer_stop(_twr_timer);
+
+	// Put the DW1000 in SLEEP mode.
+	dw1000_sleep();
+}
+
+// The whole DW1000 reset, so we need to get this app running again
+void twr_reset () {
+	twr_init();
+}
+
+// Range to one anchor. The result goes to the host once the exchange
+// finishes or times out.
+void twr_do_range (uint8_t* anchor_addr) {
+	dw1000_err_e err;
+
+	if (_config.my_role != TAG || tw_scratch->state != TWR_STATE_IDLE) {
+		return;
+	}
+
+	// Make sure the DW1000 is awake. If it is, this will just return.
+	err = dw1000_wakeup();
+	if (err == DW1000_WAKEUP_SUCCESS) {
+		twr_init();
+	} else if (err) {
+		polypoint_reset();
+		return;
+	}
+
+	memcpy(tw_scratch->peer_addr, anchor_addr, EUI_LEN);
+	memcpy(tw_scratch->msg_pkt.header.destAddr, anchor_addr, EUI_LEN);
+	tw_scratch->msg_pkt.header.seqNum++;
+	tw_scratch->msg_pkt.message_type = MSG_TYPE_PP_TWR_POLL;
+
+	oneway_set_ranging_listening_window_settings(TAG, TWR_LISTENING_WINDOW, TWR_ANTENNA);
+
+	// Nothing to reply to yet, so just send it as soon as we can
+	uint32_t delay_time = dwt_readsystimestamphi32() + DW_DELAY_FROM_PKT_LEN(sizeof(struct pp_twr_msg));
+	if (!send_delayed((uint8_t*) &(tw_scratch->msg_pkt), sizeof(struct pp_twr_msg), delay_time, &(tw_scratch->poll_time))) {
+		finish_range(INT32_MAX);
+		return;
+	}
+
+	tw_scratch->state = TWR_STATE_WAIT_RESP;
+	tw_scratch->timeout_armed = FALSE;
+	timer_start(_twr_timer, TWR_TIMEOUT_US, timeout_task);
+}
+
+// Listen for polls from tags
+static void start_listening () {
+	oneway_set_ranging_listening_window_settings(ANCHOR, TWR_LISTENING_WINDOW, TWR_ANTENNA);
+	dwt_rxenable(0);
+}
+
+// Send a packet at delay_time (DW1000 time >> 8) and go back to receive
+// after. Saves when it goes out, with calibration applied, in tx_time.
+// Returns FALSE if the DW1000 couldn't send it then.
+static bool send_delayed (uint8_t* pkt, uint16_t len, uint32_t delay_time, uint64_t* tx_time) {
+	int err;
+
+	// Make sure we're out of RX mode before attempting to transmit
+	dwt_forcetrxoff();
+
+	// Tell the DW1000 about the packet
+	dwt_writetxfctrl(len, 0);
+
+	delay_time &= 0xFFFFFFFE; //Make sure last bit is zero
+	dw1000_setdelayedtrxtime(delay_time);
+
+	// Take the TX delay into account here by adding it to the time stamp
+	*tx_time = (((uint64_t) delay_time) << 8) + dw1000_gettimestampoverflow() +
+	           oneway_get_txdelay_from_ranging_listening_window(TWR_LISTENING_WINDOW);
+
+	dwt_writetxdata(len, pkt, 0);
+
+	dwt_setrxaftertxdelay(1); // us
+	err = dwt_starttx(DWT_START_TX_DELAYED | DWT_RESPONSE_EXPECTED);
+
+	// MP bug - TX antenna delay needs reprogramming as it is not preserved
+	dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
+
+	return err == DWT_SUCCESS;
+}
+
+// The tag is done with this exchange. Tell the host the range, or that
+// there isn't one if range_mm is INT32_MAX.
+static void finish_range (int32_t range_mm) {
+	uint8_t len = 1;
+
+	timer_stop(_twr_timer);
+	dwt_forcetrxoff();
+	tw_scratch->state = TWR_STATE_IDLE;
+
+	if (range_mm != INT32_MAX) {
+		_anchor_id_range[0] = 1;
+		memcpy(_anchor_id_range+len, tw_scratch->peer_addr, EUI_LEN);
+		len += EUI_LEN;
+		memcpy(_anchor_id_range+len, &range_mm, sizeof(int32_t));
+		len += sizeof(int32_t);
+	} else {
+		_anchor_id_range[0] = 0;
+	}
+
+	host_interface_notify_ranges(_anchor_id_range, len);
+}
+
+// Work out the range from our timestamps and the anchor's. Returns
+// INT32_MAX if they don't make sense.
+static int32_t calculate_range (struct pp_twr_report* report) {
+	uint64_t poll_rx = 0;
+	uint64_t resp_tx = 0;
+	uint64_t final_rx = 0;
+	memcpy(&poll_rx, report->poll_rx, TWR_TIMESTAMP_LEN);
+	memcpy(&resp_tx, report->resp_tx, TWR_TIMESTAMP_LEN);
+	memcpy(&final_rx, report->final_rx, TWR_TIMESTAMP_LEN);
+
+	// The anchor only sends 40 bits, which is all the DW1000 keeps anyway,
+	// so work with differences on both sides.
+	uint64_t round_a = (tw_scratch->resp_time - tw_scratch->poll_time) & TWR_TIMESTAMP_MASK;
+	uint64_t reply_a = (tw_scratch->final_time - tw_scratch->resp_time) & TWR_TIMESTAMP_MASK;
+	uint64_t round_b = (final_rx - resp_tx) & TWR_TIMESTAMP_MASK;
+	uint64_t reply_b = (resp_tx - poll_rx) & TWR_TIMESTAMP_MASK;
+
+	// Each of these is a few reply delays. Anything past 2^30 time units
+	// (about 17 ms) is garbage, and would overflow the products below.
+	if (round_a >= (1ULL << 30) || reply_a >= (1ULL << 30) ||
+	    round_b >= (1ULL << 30) || reply_b >= (1ULL << 30)) {
+		return INT32_MAX;
+	}
+
+	// Asymmetric DS-TWR, which cancels out the clock skew between the two
+	// nodes without the reply times having to match. Keep some fractional
+	// bits without overflowing the numerator.
+	int64_t num = (int64_t) (round_a*round_b) - (int64_t) (reply_a*reply_b);
+	int64_t den = (int64_t) (round_a + round_b + reply_a + reply_b);
+	int64_t tof = ((num / den) * (1 << TWR_TOF_FRAC_BITS)) + (((num % den) * (1 << TWR_TOF_FRAC_BITS)) / den);
+
+	int range_mm = dwtime_fixed_to_millimeters(tof, TWR_TOF_FRAC_BITS);
+	if (range_mm < MIN_VALID_RANGE_MM || range_mm > MAX_VALID_RANGE_MM) {
+		return INT32_MAX;
+	}
+	return range_mm;
+}
+
+// Give up on the exchange
+static void timeout_task () {
+	// The timer fires right when it starts, so skip that one
+	if (!tw_scratch->timeout_armed) {
+		tw_scratch->timeout_armed = TRUE;
+		return;
+	}
+
+	if (_config.my_role == TAG) {
+		finish_range(INT32_MAX);
+	} else {
+		timer_stop(_twr_timer);
+		tw_scratch->state = TWR_STATE_IDLE;
+		start_listening();
+	}
+}
+
+// Called after a packet is transmitted. The receiver is turned back on
+// automatically, so there is nothing to do.
+static void twr_txcallback (const dwt_callback_data_t *txd) {
+}
+
+// Called when the radio has received a packet.
+static void twr_rxcallback (const dwt_callback_data_t *rxd) {
+	if (rxd->event == DWT_SIG_RX_OKAY) {
+		uint64_t dw_rx_timestamp;
+		uint8_t  buf[TWR_MAX_RX_PKT_LEN];
+		uint8_t  message_type;
+
+		// Get the received time of this packet first
+		dw_rx_timestamp = dw1000_readrxtimestamp();
+		uint64_t rx_time = dw_rx_timestamp - oneway_get_rxdelay_from_ranging_listening_window(TWR_LISTENING_WINDOW);
+
+		// The reply goes out a fixed time after this packet arrived
+		uint32_t reply_time = ((uint32_t) (dw_rx_timestamp >> 8)) + tw_scratch->reply_delay;
+
+		// Get the actual packet bytes
+		dwt_readrxdata(buf, MIN(TWR_MAX_RX_PKT_LEN, rxd->datalength), 0);
+		struct ieee154_header_unicast* header = (struct ieee154_header_unicast*) buf;
+		message_type = buf[offsetof(struct pp_twr_msg, message_type)];
+		bool from_peer = memcmp(header->sourceAddr, tw_scratch->peer_addr, EUI_LEN) == 0;
+
+		if (_config.my_role == TAG) {
+			if (message_type == MSG_TYPE_PP_TWR_RESP &&
+			    tw_scratch->state == TWR_STATE_WAIT_RESP && from_peer) {
+				tw_scratch->resp_time = rx_time;
+
+				tw_scratch->msg_pkt.header.seqNum++;
+				tw_scratch->msg_pkt.message_type = MSG_TYPE_PP_TWR_FINAL;
+				if (!send_delayed((uint8_t*) &(tw_scratch->msg_pkt), sizeof(struct pp_twr_msg), reply_time, &(tw_scratch->final_time))) {
+					finish_range(INT32_MAX);
+					return;
+				}
+				tw_scratch->state = TWR_STATE_WAIT_REPORT;
+
+			} else if (message_type == MSG_TYPE_PP_TWR_REPORT &&
+			           tw_scratch->state == TWR_STATE_WAIT_REPORT && from_peer &&
+			           rxd->datalength >= sizeof(struct pp_twr_report)) {
+				finish_range(calculate_range((struct pp_twr_report*) buf));
+			}
+
+		} else if (_config.my_role == ANCHOR) {
+			if (message_type == MSG_TYPE_PP_TWR_POLL) {
+				// A new exchange. If we were in the middle of one the tag
+				// must have given up on it.
+				tw_scratch->poll_time = rx_time;
+				memcpy(tw_scratch->peer_addr, header->sourceAddr, EUI_LEN);
+				memcpy(tw_scratch->msg_pkt.header.destAddr, header->sourceAddr, EUI_LEN);
+				memcpy(tw_scratch->report_pkt.header.destAddr, header->sourceAddr, EUI_LEN);
+
+				tw_scratch->msg_pkt.header.seqNum++;
+				tw_scratch->msg_pkt.message_type = MSG_TYPE_PP_TWR_RESP;
+				if (!send_delayed((uint8_t*) &(tw_scratch->msg_pkt), sizeof(struct pp_twr_msg), reply_time, &(tw_scratch->resp_time))) {
+					tw_scratch->state = TWR_STATE_IDLE;
+					start_listening();
+					return;
+				}
+				tw_scratch->state = TWR_STATE_WAIT_FINAL;
+				tw_scratch->timeout_armed = FALSE;
+				timer_start(_twr_timer, TWR_TIMEOUT_US, timeout_task);
+
+			} else if (message_type == MSG_TYPE_PP_TWR_FINAL &&
+			           tw_scratch->state == TWR_STATE_WAIT_FINAL && from_peer) {
+				timer_stop(_twr_timer);
+				tw_scratch->state = TWR_STATE_IDLE;
+
+				memcpy(tw_scratch->report_pkt.poll_rx, &(tw_scratch->poll_time), TWR_TIMESTAMP_LEN);
+				memcpy(tw_scratch->report_pkt.resp_tx, &(tw_scratch->resp_time), TWR_TIMESTAMP_LEN);
+				memcpy(tw_scratch->report_pkt.final_rx, &rx_time, TWR_TIMESTAMP_LEN);
+				tw_scratch->report_pkt.header.seqNum++;
+
+				// Nothing more comes from the tag, so if this can't go out
+				// the tag will time out
+				uint64_t report_time;
+				if (!send_delayed((uint8_t*) &(tw_scratch->report_pkt), sizeof(struct pp_twr_report), reply_time, &report_time)) {
+					start_listening();
+				}
+
+			} else {
+				dwt_rxenable(0);
+			}
+		}
+
+	} else {
+		// If an RX error has occurred, we're gonna need to setup the receiver again
+		// (because dwt_rxreset within dwt_isr smashes everything without regard)
+		if (rxd->event == DWT_SIG_RX_PHR_ERROR ||
+		    rxd->event == DWT_SIG_RX_ERROR ||
+		    rxd->event == DWT_SIG_RX_SYNCLOSS ||
+		    rxd->event == DWT_SIG_RX_SFDTIMEOUT ||
+		    rxd->event == DWT_SIG_RX_PTOTIMEOUT) {
+			oneway_set_ranging_listening_window_settings(_config.my_role, TWR_LISTENING_WINDOW, TWR_ANTENNA);
+			if (_config.my_role == ANCHOR || tw_scratch->state != TWR_STATE_IDLE) {
+				dwt_rxenable(0);
+			}
+		}
+	}
+}
@@ -0,0 +1,108 @@
+#ifndef __TWR_H
+#define __TWR_H
+
+#include "deca_device_api.h"
+#include "deca_regs.h"
+
+#include "oneway_common.h"
+#include "dw1000.h"
+
+// Double-sided two way ranging (DS-TWR) with a single anchor. The tag
+// sends a POLL addressed to the anchor, the anchor sends a RESP, the tag
+// sends a FINAL, and the anchor sends back a REPORT with its timestamps so
+// the tag can calculate the range:
+//
+//   TAG     POLL ----------------------> (T1)         FINAL --------> (T5)
+//   ANCHOR          (T2) <---- RESP (T3)                        (T6) REPORT
+//
+// Every packet is sent a fixed delay after the one before it was received,
+// so the whole exchange takes about three of those delays.
+//
+// Everything happens on the first ranging channel and the first antenna,
+// which is where oneway anchors wait for polls.
+#define TWR_ANTENNA 0
+#define TWR_LISTENING_WINDOW 0
+
+// How long a node has between receiving a packet and the packet it sends
+// in reply going out. This is on top of the time to receive the rest of
+// the packet and send the preamble of the reply.
+#define TWR_REPLY_PROCESSING_US 700
+
+// Give up on a range if the exchange hasn't finished in this long
+#define TWR_TIMEOUT_US 10000
+
+// Size buffers for reading in packets
+#define TWR_MAX_RX_PKT_LEN 64
+
+// Timestamps in the REPORT are the low 40 bits of the anchor's clock
+#define TWR_TIMESTAMP_LEN  5
+#define TWR_TIMESTAMP_MASK 0xFFFFFFFFFFULL
+
+// The TOF is calculated with this many fractional bits before it is turned
+// into millimeters
+#define TWR_TOF_FRAC_BITS 4
+
+// POLL, RESP and FINAL carry nothing but who they are for
+struct pp_twr_msg {
+	struct ieee154_header_unicast header;
+	uint8_t message_type;
+	struct ieee154_footer footer;
+} __attribute__ ((__packed__));
+
+// The anchor's timestamps from the exchange, with its calibration applied
+struct pp_twr_report {
+	struct ieee154_header_unicast header;
+	uint8_t message_type;
+	uint8_t poll_rx[TWR_TIMESTAMP_LEN];   // T2
+	uint8_t resp_tx[TWR_TIMESTAMP_LEN];   // T3
+	uint8_t final_rx[TWR_TIMESTAMP_LEN];  // T6
+	struct ieee154_footer footer;
+} __attribute__ ((__packed__));
+
+typedef enum {
+	TWR_STATE_IDLE,
+	TWR_STATE_WAIT_RESP,    // TAG: POLL sent
+	TWR_STATE_WAIT_REPORT,  // TAG: FINAL sent
+	TWR_STATE_WAIT_FINAL    // ANCHOR: RESP sent
+} twr_state_e;
+
+// Keep config settings for a TWR node. Tags range when the host asks.
+typedef struct {
+	dw1000_role_e my_role;
+	dw1000_profile_e profile;
+} twr_config_t;
+
+typedef struct {
+	twr_state_e state;
+
+	// The node we are in an exchange with
+	uint8_t peer_addr[EUI_LEN];
+
+	// Our timestamps from the exchange, with calibration applied. TAGs keep
+	// T1, T4 and T5, ANCHORs T2 and T3.
+	uint64_t poll_time;
+	uint64_t resp_time;
+	uint64_t final_time;
+
+	// How long after receiving a packet to send the reply, in DW1000 time
+	// units >> 8
+	uint32_t reply_delay;
+
+	// Set once the timeout timer has fired the first time, which it does
+	// as soon as it starts
+	bool timeout_armed;
+
+	// Outgoing packets
+	struct pp_twr_msg msg_pkt;
+	struct pp_twr_report report_pkt;
+} twr_scratchspace_struct;
+
+twr_scratchspace_struct *tw_scratch;
+
+void twr_configure (twr_config_t* config, void *app_scratchspace);
+dw1000_err_e twr_start ();
+void twr_stop ();
+void twr_reset ();
+void twr_do_range (uint8_t* anchor_addr);
+
+#endif